@@ -2,6 +2,7 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void initChunk(Chunk* chunk)
@@ -28,6 +29,32 @@ int Chunk::addConstant(Value value) noexcept
     return m_constants.size() - 1;
 }
 
+int Chunk::addName(ObjString* name) noexcept
+{
+    push(OBJ_VAL(name));
+    m_names.push_back(name);
+    pop();
+    return m_names.size() - 1;
+}
+
+int Chunk::addPropertyCache() noexcept
+{
+    m_propertyCaches.emplace_back();
+    return m_propertyCaches.size() - 1;
+}
+
+int Chunk::addInvokeCache() noexcept
+{
+    m_invokeCaches.emplace_back();
+    return m_invokeCaches.size() - 1;
+}
+
+int Chunk::addScalarSite() noexcept
+{
+    m_scalarSites.emplace_back();
+    return m_scalarSites.size() - 1;
+}
+
 size_t Chunk::size() const noexcept
 {
     return m_code.size();
@@ -47,3 +74,169 @@ ValueArray& Chunk::constants() noexcept
 {
     return m_constants;
 }
+
+std::vector<ObjString*>& Chunk::names() noexcept
+{
+    return m_names;
+}
+
+std::vector<PropertyCache>& Chunk::propertyCaches() noexcept
+{
+    return m_propertyCaches;
+}
+
+std::vector<InvokeCache>& Chunk::invokeCaches() noexcept
+{
+    return m_invokeCaches;
+}
+
+std::vector<ScalarSite>& Chunk::scalarSites() noexcept
+{
+    return m_scalarSites;
+}
+
+int instructionLength(Chunk* chunk, int offset)
+{
+    switch (chunk->code()[offset])
+    {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_CLOSURE:
+        case OP_CALL_NATIVE:
+        case OP_CLASS:
+        case OP_METHOD: return 2;
+
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_LOOP_TRACE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_GET_LOCAL_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG: return 3;
+
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_NEW_SCALAR: return 4;
+
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+        case OP_GET_LOCAL_PROPERTY:
+        case OP_SET_SCALAR: return 5;
+
+        case OP_GET_SCALAR: return 6;
+
+        case OP_CLOSURE:
+        {
+            ObjFunction* function = AS_FUNCTION(chunk->constants()[chunk->code()[offset + 1]]);
+            return 2 + 2 * function->upvalueCount;
+        }
+
+        case OP_CLOSURE_LONG:
+        {
+            int          constant = (chunk->code()[offset + 1] << 8) | chunk->code()[offset + 2];
+            ObjFunction* function = AS_FUNCTION(chunk->constants()[constant]);
+            return 3 + 3 * function->upvalueCount;
+        }
+
+        default: return 1;
+    }
+}
+
+int stackEffect(Chunk* chunk, int offset)
+{
+    uint8_t* code = chunk->code().data() + offset;
+    switch ((OpCode)code[0])
+    {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+        case OP_GET_LOCAL_PROPERTY:
+        case OP_GET_SCALAR:
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+        case OP_CLASS: return 1;
+
+        case OP_GET_LOCAL_CONSTANT: return 2;
+
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG:
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_LOOP_TRACE:
+        case OP_RETURN_NIL: return 0;
+
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_PROPERTY:
+        case OP_SET_SCALAR:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_METHOD: return -1;
+
+        case OP_LESS_JUMP_IF_FALSE: return -2;
+
+        // The callee and its arguments make way for the result.
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_CLOSURE:
+        case OP_CALL_NATIVE: return -code[1];
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE: return -code[2];
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE: return -code[2] - 1;  // The superclass too.
+        case OP_NEW_SCALAR: return -code[3];
+    }
+
+    return 0;
+}
+
+int jumpTarget(Chunk* chunk, int offset)
+{
+    uint16_t jump = (uint16_t)((chunk->code()[offset + 1] << 8) | chunk->code()[offset + 2]);
+    uint8_t instruction = chunk->code()[offset];
+    if (instruction == OP_LOOP || instruction == OP_LOOP_TRACE) return offset + 3 - jump;
+    return offset + 3 + jump;
+}
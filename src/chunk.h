@@ -35,22 +35,113 @@ enum OpCode
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,  // OP_CALL in a `return`, reusing the caller's frame.
     OP_INVOKE,
     OP_SUPER_INVOKE,
+    OP_TAIL_INVOKE,        // OP_INVOKE in a `return`, as OP_TAIL_CALL.
+    OP_TAIL_SUPER_INVOKE,  // OP_SUPER_INVOKE in a `return`.
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
     OP_CLASS,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+
+    // Superinstructions, fused by the compiler's emitters.
+    OP_POP_JUMP_IF_FALSE,   // OP_JUMP_IF_FALSE that pops the condition.
+    OP_LESS_JUMP_IF_FALSE,  // OP_LESS, OP_POP_JUMP_IF_FALSE
+    OP_GET_LOCAL_PROPERTY,  // OP_GET_LOCAL, OP_GET_PROPERTY
+    OP_GET_LOCAL_CONSTANT,  // OP_GET_LOCAL, OP_CONSTANT
+    OP_RETURN_NIL,          // OP_NIL, OP_RETURN
+
+    // Wide forms with 16-bit operands, emitted only for constants, slots
+    // and upvalues past the first 256.
+    OP_CONSTANT_LONG,
+    OP_GET_LOCAL_LONG,
+    OP_SET_LOCAL_LONG,
+    OP_GET_UPVALUE_LONG,
+    OP_SET_UPVALUE_LONG,
+    OP_CLOSURE_LONG,  // Each capture is a CaptureKind and a 16-bit index.
+
+    // Quickened forms. run() rewrites the generic instruction in place the
+    // first time it executes; each keeps a guard and falls back to the
+    // generic code when it fails.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_CALL_CLOSURE,
+    OP_CALL_NATIVE,
+
+    // An OP_LOOP whose loop the tracing JIT has compiled. Only JIT builds
+    // write it.
+    OP_LOOP_TRACE,
+
+    // Scalar replacement of instances that never leave their function.
+    // The instance's fields live in locals of their own, and the local the
+    // instance would have been stored in holds UNDEFINED_VAL. When the
+    // callee turns out not to be a class they can stand in for, a real
+    // instance is made and these act as the instructions they replace.
+    OP_NEW_SCALAR,  // OP_CALL that fills the field locals below the callee: site, then argCount.
+    OP_GET_SCALAR,  // OP_GET_LOCAL_PROPERTY with the field's local first.
+    OP_SET_SCALAR   // OP_SET_PROPERTY with the field's local first.
+};
+
+// How OP_CLOSURE fills one upvalue of the new closure: the first byte of
+// each capture after the instruction.
+enum CaptureKind : uint8_t
+{
+    CAPTURE_UPVALUE,  // Shares an upvalue of the enclosing closure.
+    CAPTURE_LOCAL,    // Shares the local's open upvalue, closed when it leaves scope.
+    CAPTURE_VALUE     // Copies a local that is never assigned.
+};
+
+struct ObjClass;
+struct ObjClosure;
+
+// Inline cache of one OP_GET_PROPERTY or OP_SET_PROPERTY site. Fields live
+// in a hash table per instance, so the cache remembers the entry the name
+// was found in last time; instances built by the same initializer share
+// that layout. Methods are cached per receiver class.
+struct PropertyCache
+{
+    int         field{0};
+    ObjClass*   klass{nullptr};
+    ObjClosure* method{nullptr};
+};
+
+#define INVOKE_CACHE_SIZE 4
+
+// Polymorphic inline cache of one OP_INVOKE site: the methods found for up
+// to INVOKE_CACHE_SIZE receiver classes. Once it is full, other classes
+// take the uncached lookup. OP_SUPER_INVOKE sites key it on the
+// superclass, so they resolve their target once.
+struct InvokeCache
+{
+    int         count{0};
+    ObjClass*   klasses[INVOKE_CACHE_SIZE]{};
+    ObjClosure* methods[INVOKE_CACHE_SIZE]{};
+};
+
+struct ObjString;
+
+// One OP_NEW_SCALAR site: the fields its instance's uses name, in the order
+// of their locals, and the last class that could stand in for it.
+struct ScalarSite
+{
+    std::vector<ObjString*> fields{};
+    ObjClass*               klass{nullptr};
 };
 
 class Chunk
 {
 private:
-    std::vector<uint8_t> m_code{};
-    std::vector<int>     m_lines{};
-    ValueArray           m_constants{};
+    std::vector<uint8_t>    m_code{};
+    std::vector<int>        m_lines{};
+    ValueArray              m_constants{};
+    std::vector<ObjString*> m_names{};  // Property, method and class names.
+
+    std::vector<PropertyCache> m_propertyCaches{};
+    std::vector<InvokeCache>   m_invokeCaches{};
+    std::vector<ScalarSite>    m_scalarSites{};
 
 public:
     Chunk() = default;
@@ -58,15 +149,34 @@ public:
     void writeChunk(uint8_t byte, int line) noexcept;
 
     [[nodiscard]] int addConstant(Value value) noexcept;
+    [[nodiscard]] int addName(ObjString* name) noexcept;
+    [[nodiscard]] int addPropertyCache() noexcept;
+    [[nodiscard]] int addInvokeCache() noexcept;
+    [[nodiscard]] int addScalarSite() noexcept;
 
     [[nodiscard]] size_t size() const noexcept;
 
-    [[nodiscard]] std::vector<uint8_t>& code() noexcept;
-    [[nodiscard]] std::vector<int>&     lines() noexcept;
-    [[nodiscard]] ValueArray&           constants() noexcept;
+    [[nodiscard]] std::vector<uint8_t>&    code() noexcept;
+    [[nodiscard]] std::vector<int>&        lines() noexcept;
+    [[nodiscard]] ValueArray&              constants() noexcept;
+    [[nodiscard]] std::vector<ObjString*>& names() noexcept;
+
+    [[nodiscard]] std::vector<PropertyCache>& propertyCaches() noexcept;
+    [[nodiscard]] std::vector<InvokeCache>&   invokeCaches() noexcept;
+    [[nodiscard]] std::vector<ScalarSite>&    scalarSites() noexcept;
 };
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 
+// Size in bytes of the instruction at `offset`, operands included.
+int instructionLength(Chunk* chunk, int offset);
+
+// Destination of the jump or loop instruction at `offset`.
+int jumpTarget(Chunk* chunk, int offset);
+
+// How many values the instruction at `offset` leaves on the stack, less
+// how many it takes off.
+int stackEffect(Chunk* chunk, int offset);
+
 #endif
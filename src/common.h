@@ -5,18 +5,43 @@
 #include <cstdint>
 
 #define NAN_BOXING
+
+// Threaded dispatch in run() needs labels-as-values, which MSVC doesn't have.
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+
+// The baseline JIT is switched on with the ENABLE_JIT CMake option, which
+// defines JIT. It emits x86-64 code for Linux and relies on NaN boxing.
+#ifdef JIT
+#if !defined(__x86_64__) || !defined(__linux__) || !defined(NAN_BOXING)
+#error "The JIT needs x86-64 Linux and NAN_BOXING."
+#endif
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100  // Calls before a function is compiled.
+#endif
+#ifndef JIT_LOOP_THRESHOLD
+#define JIT_LOOP_THRESHOLD 56  // Iterations before a loop is traced.
+#endif
+#endif
+
 #define DEBUG_PRINT_CODE
+#define DEBUG_PRINT_ESCAPE
 #define DEBUG_TRACE_EXECUTION
 
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
+#define DEBUG_LOG_JIT
 
-#define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT8_COUNT  (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif
 // In the book, we show them defined, but for working on them locally,
 // we don't want them to be.
 //#undef DEBUG_PRINT_CODE
+//#undef DEBUG_PRINT_ESCAPE
 //#undef DEBUG_TRACE_EXECUTION
 //#undef DEBUG_STRESS_GC
 //#undef DEBUG_LOG_GC
+//#undef DEBUG_LOG_JIT
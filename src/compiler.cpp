@@ -1,9 +1,12 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
 
 #include "common.h"
 #include "compiler.h"
+#include "escape.h"
 #include "memory.h"
 #include "scanner.h"
 
@@ -45,15 +48,34 @@ struct ParseRule
 
 struct Local
 {
-    Token name;
-    int   depth;
-    bool  isCaptured;
+    Token            name;
+    int              depth;
+    bool             isCaptured;
+    bool             isAssigned;    // Ever the target of an assignment, here or in a closure.
+    std::vector<int> captureSites;  // Code offsets of the kind bytes of its captures.
+
+    int                ordinal;  // Which local var declaration of the function it is, or -1.
+    int                callEnd;  // Offset just past a call its initializer ends in, or -1.
+    const ScalarLocal* scalar;   // Its field locals sit just below it, if it has any.
 };
 
 struct Upvalue
 {
-    uint8_t index;
-    bool    isLocal;
+    uint16_t index;
+    bool     isLocal;
+    bool     isAssigned;  // Whether the function assigns to it, see markAssigned().
+    Token    name;        // To capture the same variable again, see reuseFunction().
+};
+
+// A function nested in one that may be compiled again for escape analysis.
+// The second compile takes it from the first, skipping its source.
+struct NestedFunction
+{
+    const char*          start;  // Its parameter list, to find it by.
+    ObjFunction*         function;
+    std::vector<Upvalue> upvalues;
+    Parser               parserEnd;
+    Scanner              scannerEnd;
 };
 
 enum FunctionType
@@ -70,10 +92,25 @@ struct Compiler
     ObjFunction* function;
     FunctionType type;
 
-    Local   locals[UINT8_COUNT];
-    int     localCount;
-    Upvalue upvalues[UINT8_COUNT];
-    int     scopeDepth;
+    std::vector<Local>   locals;
+    int                  localCount;
+    std::vector<Upvalue> upvalues;
+    int                  scopeDepth;
+
+    int lastInstruction;  // Offset of the last opcode emitted, for fusing.
+    int jumpTarget;       // Latest offset some jump lands on.
+
+    // Escape analysis. The first compile of a function notes its locals
+    // holding the result of a call; if some of them can be replaced by
+    // their fields, the function is compiled again with `scalars` set.
+    std::vector<CallLocal>   callLocals;
+    std::vector<ScalarLocal> scalars;
+    int                      varCount;
+
+    // The functions nested in it, noted by the first compile. The second
+    // reuses them in order, so each body is compiled only once.
+    std::vector<NestedFunction> nested;
+    size_t                      nestedReused;
 };
 
 struct ClassCompiler
@@ -171,15 +208,61 @@ static void emitByte(uint8_t byte)
     currentChunk()->writeChunk(byte, parser.previous.line);
 }
 
+static void emitOp(uint8_t op)
+{
+    current->lastInstruction = currentChunk()->size();
+    emitByte(op);
+}
+
+// Returns the opcode of the last instruction if it is `length` bytes long
+// and no jump lands right after it, meaning the next instruction can be
+// fused into it. Returns -1 otherwise.
+static int fusableOp(int length)
+{
+    int last = current->lastInstruction;
+    int size = currentChunk()->size();
+    if (last < 0 || last + length != size || current->jumpTarget == size) return -1;
+
+    return currentChunk()->code()[last];
+}
+
 static void emitBytes(uint8_t byte1, uint8_t byte2)
 {
-    emitByte(byte1);
+    if (fusableOp(2) == OP_GET_LOCAL)
+    {
+        // Superinstructions picked from the opcode-pair counts of the
+        // benchmarks: `this.field` and `local <op> constant`.
+        uint8_t& op = currentChunk()->code()[current->lastInstruction];
+        if (byte1 == OP_GET_PROPERTY)
+        {
+            op = OP_GET_LOCAL_PROPERTY;
+            emitByte(byte2);
+            return;
+        }
+
+        if (byte1 == OP_CONSTANT)
+        {
+            op = OP_GET_LOCAL_CONSTANT;
+            emitByte(byte2);
+            return;
+        }
+    }
+
+    emitOp(byte1);
     emitByte(byte2);
 }
 
+// Marks the current end of the chunk as the destination of a jump, so that
+// nothing gets fused across it.
+static int markJumpTarget()
+{
+    current->jumpTarget = currentChunk()->size();
+    return current->jumpTarget;
+}
+
 static void emitLoop(int loopStart)
 {
-    emitByte(OP_LOOP);
+    emitOp(OP_LOOP);
 
     int offset = currentChunk()->size() - loopStart + 2;
     if (offset > UINT16_MAX) error("Loop body too large.");
@@ -190,7 +273,19 @@ static void emitLoop(int loopStart)
 
 static int emitJump(uint8_t instruction)
 {
-    emitByte(instruction);
+    if (instruction == OP_POP_JUMP_IF_FALSE && fusableOp(1) == OP_LESS)
+    {
+        // Compare-and-branch, the usual loop and `if` condition. The offset
+        // keeps the line of the comparison for error reporting.
+        int last                     = current->lastInstruction;
+        int line                     = currentChunk()->lines()[last];
+        currentChunk()->code()[last] = OP_LESS_JUMP_IF_FALSE;
+        currentChunk()->writeChunk(0xff, line);
+        currentChunk()->writeChunk(0xff, line);
+        return currentChunk()->size() - 2;
+    }
+
+    emitOp(instruction);
     emitByte(0xff);
     emitByte(0xff);
     return currentChunk()->size() - 2;
@@ -201,30 +296,73 @@ static void emitReturn()
     if (current->type == TYPE_INITIALIZER)
     {
         emitBytes(OP_GET_LOCAL, 0);
+        emitOp(OP_RETURN);
     }
     else
     {
-        emitByte(OP_NIL);
+        emitOp(OP_RETURN_NIL);
     }
-
-    emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value)
+static uint16_t makeConstant(Value value)
 {
     int constant = currentChunk()->addConstant(value);
-    if (constant > UINT8_MAX)
+    if (constant > UINT16_MAX)
     {
         error("Too many m_constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return (uint16_t)constant;
+}
+
+// Emits `op` with a one-byte operand, or `longOp` with a two-byte one
+// when the operand doesn't fit.
+static void emitOperand(uint8_t op, uint8_t longOp, int operand)
+{
+    if (operand <= UINT8_MAX)
+    {
+        emitBytes(op, (uint8_t)operand);
+    }
+    else
+    {
+        emitOp(longOp);
+        emitByte((operand >> 8) & 0xff);
+        emitByte(operand & 0xff);
+    }
 }
 
 static void emitConstant(Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitOperand(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
+}
+
+// Emits the operand naming a fresh inline cache for the property
+// instruction just emitted.
+static void emitPropertyCache()
+{
+    int cache = currentChunk()->addPropertyCache();
+    if (cache > UINT16_MAX)
+    {
+        error("Too many property accesses in one chunk.");
+    }
+
+    emitByte((cache >> 8) & 0xff);
+    emitByte(cache & 0xff);
+}
+
+// Emits the operand naming a fresh inline cache for the invoke
+// instruction just emitted.
+static void emitInvokeCache()
+{
+    int cache = currentChunk()->addInvokeCache();
+    if (cache > UINT16_MAX)
+    {
+        error("Too many method calls in one chunk.");
+    }
+
+    emitByte((cache >> 8) & 0xff);
+    emitByte(cache & 0xff);
 }
 
 static void patchJump(int offset)
@@ -239,26 +377,40 @@ static void patchJump(int offset)
 
     currentChunk()->code()[offset]     = (jump >> 8) & 0xff;
     currentChunk()->code()[offset + 1] = jump & 0xff;
+    markJumpTarget();
 }
 
 static void initCompiler(Compiler* compiler, FunctionType type)
 {
-    compiler->enclosing  = current;
-    compiler->function   = nullptr;
-    compiler->type       = type;
-    compiler->localCount = 0;
-    compiler->scopeDepth = 0;
-    compiler->function   = newFunction();
-    current              = compiler;
+    compiler->enclosing       = current;
+    compiler->function        = nullptr;
+    compiler->type            = type;
+    compiler->localCount      = 0;
+    compiler->scopeDepth      = 0;
+    compiler->lastInstruction = -1;
+    compiler->jumpTarget      = -1;
+    compiler->varCount        = 0;
+    compiler->nestedReused    = 0;
+    compiler->function        = newFunction();
+    current                   = compiler;
 
     if (type != TYPE_SCRIPT)
     {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
     }
 
-    Local* local      = &current->locals[current->localCount++];
+    current->locals.resize(1);
+    current->localCount          = 1;
+    current->function->maxLocals = 1;
+
+    Local* local      = &current->locals[0];
     local->depth      = 0;
     local->isCaptured = false;
+    local->isAssigned = false;
+    local->captureSites.clear();
+    local->ordinal = -1;
+    local->callEnd = -1;
+    local->scalar  = nullptr;
     if (type != TYPE_FUNCTION)
     {
         local->name.start  = "this";
@@ -271,13 +423,72 @@ static void initCompiler(Compiler* compiler, FunctionType type)
     }
 }
 
+// Once every assignment to a captured local has been seen, rewrites its
+// captures to copy it if it never changes. Returns whether closures still
+// share it by reference, so it needs closing when it leaves scope.
+static bool settleCaptures(Local* local)
+{
+    if (!local->isCaptured || !local->isAssigned)
+    {
+        for (int site : local->captureSites) currentChunk()->code()[site] = CAPTURE_VALUE;
+        return false;
+    }
+
+    current->function->capturesLocals = true;
+    return true;
+}
+
+// Notes the local in `slot`, leaving scope, as a candidate for scalar
+// replacement if it holds what a call returned and nothing changes it.
+static void noteCallLocal(int slot)
+{
+    Local* local = &current->locals[slot];
+    if (local->callEnd < 0 || local->isCaptured || local->isAssigned) return;
+
+    current->callLocals.push_back({local->name, local->ordinal, slot, local->callEnd, (int)currentChunk()->size()});
+}
+
+// The most values a frame of `function` holds at once. The depth is the
+// same on every path into a jump target, so one pass in code order finds
+// it.
+static int maxStackDepth(ObjFunction* function)
+{
+    Chunk* chunk   = &function->chunk;
+    int    depth   = 1 + function->arity;  // The callee and its arguments.
+    int    deepest = depth;
+    for (int offset = 0; offset < (int)chunk->size(); offset += instructionLength(chunk, offset))
+    {
+        depth += stackEffect(chunk, offset);
+        deepest = std::max(deepest, depth);
+    }
+
+    return deepest;
+}
+
 static ObjFunction* endCompiler()
 {
     emitReturn();
     ObjFunction* function = current->function;
+    for (int i = 0; i < current->localCount; i++)
+    {
+        settleCaptures(&current->locals[i]);
+        noteCallLocal(i);
+    }
+
+    function->maxStack = maxStackDepth(function);
+    if (current->type == TYPE_INITIALIZER) analyzeInitializer(function);
+    writeBarrier((Obj*)function);  // See markCompilerRoots().
+
+    // function() compiles the body again when this finds locals to replace.
+    [[maybe_unused]] bool recompile = false;
+    if (current->type != TYPE_SCRIPT && current->scalars.empty() && !parser.hadError)
+    {
+        current->scalars = findScalarLocals(function, current->callLocals);
+        recompile        = !current->scalars.empty();
+    }
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
+    if (!parser.hadError && !recompile)
     {
         disassembleChunk(currentChunk(), function->name != nullptr ? function->name->chars : "<script>");
     }
@@ -299,13 +510,14 @@ static void endScope()
 
     while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth)
     {
-        if (current->locals[current->localCount - 1].isCaptured)
+        noteCallLocal(current->localCount - 1);
+        if (settleCaptures(&current->locals[current->localCount - 1]))
         {
-            emitByte(OP_CLOSE_UPVALUE);
+            emitOp(OP_CLOSE_UPVALUE);
         }
         else
         {
-            emitByte(OP_POP);
+            emitOp(OP_POP);
         }
 
         current->localCount--;
@@ -318,9 +530,44 @@ static void       declaration();
 static ParseRule* getRule(TokenType type);
 static void       parsePrecedence(Precedence precedence);
 
-static uint8_t identifierConstant(Token* name)
+// The operand naming a property, method or class. Names have a table of
+// their own, so that a chunk full of literals still has room for them.
+static uint8_t identifierName(Token* name)
 {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    ObjString*               string = copyString(name->start, name->length);
+    std::vector<ObjString*>& names  = currentChunk()->names();
+    for (int i = 0; i < (int)names.size(); i++)
+    {
+        if (names[i] == string) return (uint8_t)i;
+    }
+
+    if (names.size() == UINT8_COUNT)
+    {
+        error("Too many names in one chunk.");
+        return 0;
+    }
+
+    return (uint8_t)currentChunk()->addName(string);
+}
+
+// Resolves a global variable's name to its slot in vm.globalValues.
+static uint16_t globalVariable(Token* name)
+{
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT16_MAX)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
+}
+
+static void emitGlobal(uint8_t op, uint16_t slot)
+{
+    emitOp(op);
+    emitByte((slot >> 8) & 0xff);
+    emitByte(slot & 0xff);
 }
 
 static bool identifiersEqual(Token* a, Token* b)
@@ -347,7 +594,7 @@ static int resolveLocal(Compiler* compiler, Token* name)
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
+static int addUpvalue(Compiler* compiler, uint16_t index, bool isLocal, Token* name)
 {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -360,14 +607,13 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
         }
     }
 
-    if (upvalueCount == UINT8_COUNT)
+    if (upvalueCount == UINT16_COUNT)
     {
         error("Too many closure variables in function.");
         return 0;
     }
 
-    compiler->upvalues[upvalueCount].isLocal = isLocal;
-    compiler->upvalues[upvalueCount].index   = index;
+    compiler->upvalues.push_back(Upvalue{index, isLocal, false, *name});
     return compiler->function->upvalueCount++;
 }
 
@@ -379,30 +625,54 @@ static int resolveUpvalue(Compiler* compiler, Token* name)
     if (local != -1)
     {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(compiler, (uint16_t)local, true, name);
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1)
     {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, (uint16_t)upvalue, false, name);
     }
 
     return -1;
 }
 
+// Marks the variable behind upvalue `index` of `compiler` as assigned.
+static void markAssigned(Compiler* compiler, int index)
+{
+    Upvalue* upvalue    = &compiler->upvalues[index];
+    upvalue->isAssigned = true;
+    if (upvalue->isLocal)
+    {
+        compiler->enclosing->locals[upvalue->index].isAssigned = true;
+    }
+    else
+    {
+        markAssigned(compiler->enclosing, upvalue->index);
+    }
+}
+
 static void addLocal(Token name)
 {
-    if (current->localCount == UINT8_COUNT)
+    if (current->localCount == UINT16_COUNT)
     {
         error("Too many local variables in function.");
         return;
     }
 
+    // Locals that went out of scope leave their entries behind for reuse.
+    if (current->localCount == (int)current->locals.size()) current->locals.emplace_back();
+    if (current->localCount == current->function->maxLocals) current->function->maxLocals++;
+
     Local* local      = &current->locals[current->localCount++];
     local->name       = name;
     local->depth      = -1;
     local->isCaptured = false;
+    local->isAssigned = false;
+    local->captureSites.clear();
+    local->ordinal = -1;
+    local->callEnd = -1;
+    local->scalar  = nullptr;
 }
 
 static void declareVariable()
@@ -425,14 +695,14 @@ static void declareVariable()
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage)
+static uint16_t parseVariable(const char* errorMessage)
 {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 static void markInitialized()
@@ -441,14 +711,14 @@ static void markInitialized()
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(uint16_t global)
 {
     if (current->scopeDepth > 0)
     {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList()
@@ -475,7 +745,7 @@ static void and_([[maybe_unused]] bool canAssign)
 {
     int endJump = emitJump(OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
+    emitOp(OP_POP);
     parsePrecedence(PREC_AND);
 
     patchJump(endJump);
@@ -493,16 +763,25 @@ static void binary([[maybe_unused]] bool canAssign)
     // Emit the operator instruction.
     switch (operatorType)
     {
-        case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER: emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS: emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS: emitByte(OP_ADD); break;
-        case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL:
+            emitOp(OP_EQUAL);
+            emitOp(OP_NOT);
+            break;
+        case TOKEN_EQUAL_EQUAL: emitOp(OP_EQUAL); break;
+        case TOKEN_GREATER: emitOp(OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL:
+            emitOp(OP_LESS);
+            emitOp(OP_NOT);
+            break;
+        case TOKEN_LESS: emitOp(OP_LESS); break;
+        case TOKEN_LESS_EQUAL:
+            emitOp(OP_GREATER);
+            emitOp(OP_NOT);
+            break;
+        case TOKEN_PLUS: emitOp(OP_ADD); break;
+        case TOKEN_MINUS: emitOp(OP_SUBTRACT); break;
+        case TOKEN_STAR: emitOp(OP_MULTIPLY); break;
+        case TOKEN_SLASH: emitOp(OP_DIVIDE); break;
         default: return;  // Unreachable.
     }
 }
@@ -513,25 +792,68 @@ static void call([[maybe_unused]] bool canAssign)
     emitBytes(OP_CALL, argCount);
 }
 
+// Returns the slot of the field local for property `name` if the receiver
+// just loaded is a scalar replaced local, or -1.
+static int scalarField(Token* name)
+{
+    if (fusableOp(2) != OP_GET_LOCAL) return -1;
+
+    int    slot  = currentChunk()->code()[current->lastInstruction + 1];
+    Local* local = &current->locals[slot];
+    if (local->scalar == nullptr) return -1;
+
+    const std::vector<std::string>& fields = local->scalar->fields;
+    for (int i = 0; i < (int)fields.size(); i++)
+    {
+        if (fields[i].size() == (size_t)name->length && memcmp(fields[i].data(), name->start, name->length) == 0)
+        {
+            return slot - (int)fields.size() + i;
+        }
+    }
+
+    return -1;
+}
+
 static void dot(bool canAssign)
 {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    uint8_t name  = identifierName(&parser.previous);
+    int     field = scalarField(&parser.previous);
 
     if (canAssign && match(TOKEN_EQUAL))
     {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        if (field >= 0)
+        {
+            emitBytes(OP_SET_SCALAR, (uint8_t)field);
+            emitByte(name);
+        }
+        else
+        {
+            emitBytes(OP_SET_PROPERTY, name);
+        }
+        emitPropertyCache();
     }
     else if (match(TOKEN_LEFT_PAREN))
     {
         uint8_t argCount = argumentList();
         emitBytes(OP_INVOKE, name);
         emitByte(argCount);
+        emitInvokeCache();
+    }
+    else if (field >= 0)
+    {
+        // The field's slot goes first, then the instance's.
+        currentChunk()->code()[current->lastInstruction] = OP_GET_SCALAR;
+        emitByte(currentChunk()->code()[current->lastInstruction + 1]);
+        currentChunk()->code()[current->lastInstruction + 1] = (uint8_t)field;
+        emitByte(name);
+        emitPropertyCache();
     }
     else
     {
         emitBytes(OP_GET_PROPERTY, name);
+        emitPropertyCache();
     }
 }
 
@@ -539,9 +861,9 @@ static void literal([[maybe_unused]] bool canAssign)
 {
     switch (parser.previous.type)
     {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
+        case TOKEN_FALSE: emitOp(OP_FALSE); break;
+        case TOKEN_NIL: emitOp(OP_NIL); break;
+        case TOKEN_TRUE: emitOp(OP_TRUE); break;
         default: return;  // Unreachable.
     }
 }
@@ -564,7 +886,7 @@ static void or_([[maybe_unused]] bool canAssign)
     int endJump  = emitJump(OP_JUMP);
 
     patchJump(elseJump);
-    emitByte(OP_POP);
+    emitOp(OP_POP);
 
     parsePrecedence(PREC_OR);
     patchJump(endJump);
@@ -591,19 +913,28 @@ static void namedVariable(Token name, bool canAssign)
     }
     else
     {
-        arg   = identifierConstant(&name);
+        arg   = globalVariable(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
+    uint8_t op = getOp;
     if (canAssign && match(TOKEN_EQUAL))
     {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        op = setOp;
+        if (op == OP_SET_LOCAL) current->locals[arg].isAssigned = true;
+        if (op == OP_SET_UPVALUE) markAssigned(current, arg);
     }
-    else
+
+    switch (op)
     {
-        emitBytes(getOp, (uint8_t)arg);
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL: emitGlobal(op, (uint16_t)arg); break;
+        case OP_GET_LOCAL: emitOperand(op, OP_GET_LOCAL_LONG, arg); break;
+        case OP_SET_LOCAL: emitOperand(op, OP_SET_LOCAL_LONG, arg); break;
+        case OP_GET_UPVALUE: emitOperand(op, OP_GET_UPVALUE_LONG, arg); break;
+        case OP_SET_UPVALUE: emitOperand(op, OP_SET_UPVALUE_LONG, arg); break;
     }
 }
 
@@ -633,7 +964,7 @@ static void super_([[maybe_unused]] bool canAssign)
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    uint8_t name = identifierName(&parser.previous);
 
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN))
@@ -642,6 +973,7 @@ static void super_([[maybe_unused]] bool canAssign)
         namedVariable(syntheticToken("super"), false);
         emitBytes(OP_SUPER_INVOKE, name);
         emitByte(argCount);
+        emitInvokeCache();
     }
     else
     {
@@ -670,8 +1002,8 @@ static void unary([[maybe_unused]] bool canAssign)
     // Emit the operator instruction.
     switch (operatorType)
     {
-        case TOKEN_BANG: emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG: emitOp(OP_NOT); break;
+        case TOKEN_MINUS: emitOp(OP_NEGATE); break;
         default: return;  // Unreachable.
     }
 }
@@ -764,10 +1096,8 @@ static void block()
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type)
+static ObjFunction* functionBody()
 {
-    Compiler compiler;
-    initCompiler(&compiler, type);
     beginScope();  // [no-end-scope]
 
     // Compile the parameter list.
@@ -781,7 +1111,7 @@ static void function(FunctionType type)
             {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t paramConstant = parseVariable("Expect parameter name.");
+            uint16_t paramConstant = parseVariable("Expect parameter name.");
             defineVariable(paramConstant);
         } while (match(TOKEN_COMMA));
     }
@@ -792,21 +1122,131 @@ static void function(FunctionType type)
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block();
 
-    // Create the function object.
-    ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    return endCompiler();
+}
 
+// Emits the closure of `function`, with the captures in `upvalues`.
+static void emitClosure(ObjFunction* function, const std::vector<Upvalue>& upvalues)
+{
+    // The wide form is needed for the function's constant or for captures
+    // of slots and upvalues past the first 256.
+    uint16_t constant = makeConstant(OBJ_VAL(function));
+    bool     wide     = constant > UINT8_MAX;
     for (int i = 0; i < function->upvalueCount; i++)
     {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        if (upvalues[i].index > UINT8_MAX) wide = true;
+    }
+
+    if (wide)
+    {
+        emitOp(OP_CLOSURE_LONG);
+        emitByte((constant >> 8) & 0xff);
+        emitByte(constant & 0xff);
+    }
+    else
+    {
+        emitBytes(OP_CLOSURE, (uint8_t)constant);
+    }
+
+    // Captures of locals start out by reference; settleCaptures() turns
+    // them into copies once the local turns out never to be assigned.
+    for (int i = 0; i < function->upvalueCount; i++)
+    {
+        const Upvalue* upvalue = &upvalues[i];
+        if (upvalue->isLocal)
+        {
+            current->locals[upvalue->index].captureSites.push_back((int)currentChunk()->size());
+        }
+
+        emitByte(upvalue->isLocal ? CAPTURE_LOCAL : CAPTURE_UPVALUE);
+        if (wide) emitByte((upvalue->index >> 8) & 0xff);
+        emitByte(upvalue->index & 0xff);
+    }
+}
+
+// Takes a function nested in the one being compiled again from its first
+// compile. Its variables are captured again by name, since the locals of
+// the second compile can sit in other slots.
+static void reuseFunction(NestedFunction* nested)
+{
+    parser  = nested->parserEnd;
+    scanner = nested->scannerEnd;
+
+    std::vector<Upvalue> upvalues = nested->upvalues;
+    for (Upvalue& upvalue : upvalues)
+    {
+        int local = resolveLocal(current, &upvalue.name);
+        if (local != -1)
+        {
+            current->locals[local].isCaptured = true;
+            if (upvalue.isAssigned) current->locals[local].isAssigned = true;
+            upvalue.index   = (uint16_t)local;
+            upvalue.isLocal = true;
+        }
+        else
+        {
+            int index = resolveUpvalue(current, &upvalue.name);
+            if (upvalue.isAssigned) markAssigned(current, index);
+            upvalue.index   = (uint16_t)index;
+            upvalue.isLocal = false;
+        }
+    }
+
+    emitClosure(nested->function, upvalues);
+}
+
+static void function(FunctionType type)
+{
+    if (current->nestedReused < current->nested.size() &&
+        current->nested[current->nestedReused].start == parser.current.start)
+    {
+        reuseFunction(&current->nested[current->nestedReused++]);
+        return;
+    }
+
+    // Escape analysis needs the whole function, so replacing instances by
+    // their fields takes a second compile from the same place. The
+    // functions nested in it are compiled only the first time.
+    Parser  parserStart  = parser;
+    Scanner scannerStart = scanner;
+
+    Compiler compiler;
+    initCompiler(&compiler, type);
+    ObjFunction* function = functionBody();
+
+    if (!compiler.scalars.empty())
+    {
+        std::vector<ScalarLocal>    scalars = std::move(compiler.scalars);
+        std::vector<NestedFunction> nested  = std::move(compiler.nested);
+        parser                              = parserStart;
+        scanner                             = scannerStart;
+        compiler                            = Compiler{};
+
+        // The first function's constants keep the nested ones alive until
+        // the new compiler holds them.
+        push(OBJ_VAL(function));
+        initCompiler(&compiler, type);
+        compiler.scalars = std::move(scalars);
+        compiler.nested  = std::move(nested);
+        pop();
+        function = functionBody();
+    }
+
+    emitClosure(function, compiler.upvalues);
+
+    // Only a first compile can be followed by a second.
+    if (current->type != TYPE_SCRIPT && current->scalars.empty())
+    {
+        current->nested.push_back(
+            NestedFunction{parserStart.current.start, function, compiler.upvalues, parser, scanner});
     }
 }
 
 static void method()
 {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    uint8_t name = identifierName(&parser.previous);
+    methodSelector(currentChunk()->names()[name]);
 
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0)
@@ -815,18 +1255,18 @@ static void method()
     }
 
     function(type);
-    emitBytes(OP_METHOD, constant);
+    emitBytes(OP_METHOD, name);
 }
 
 static void classDeclaration()
 {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token   className    = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    uint8_t name         = identifierName(&parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitBytes(OP_CLASS, name);
+    defineVariable(current->scopeDepth > 0 ? 0 : globalVariable(&className));
 
     ClassCompiler classCompiler;
     classCompiler.name          = parser.previous;
@@ -849,7 +1289,7 @@ static void classDeclaration()
         defineVariable(0);
 
         namedVariable(className, false);
-        emitByte(OP_INHERIT);
+        emitOp(OP_INHERIT);
         classCompiler.hasSuperclass = true;
     }
 
@@ -861,7 +1301,7 @@ static void classDeclaration()
     }
 
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emitByte(OP_POP);
+    emitOp(OP_POP);
 
     if (classCompiler.hasSuperclass)
     {
@@ -873,15 +1313,66 @@ static void classDeclaration()
 
 static void funDeclaration()
 {
-    uint8_t global = parseVariable("Expect function name.");
+    uint16_t global = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
+
+    // A local function that refers to itself captures its slot before the
+    // closure is stored there, so it can't take a copy.
+    if (current->scopeDepth > 0)
+    {
+        Local* local      = &current->locals[current->localCount - 1];
+        local->isAssigned = local->isCaptured;
+    }
     defineVariable(global);
 }
 
+// Turns the call that just initialized `local` into OP_NEW_SCALAR.
+static void emitNewScalar(Local* local)
+{
+    int site = currentChunk()->addScalarSite();
+    if (site > UINT16_MAX)
+    {
+        error("Too many instances replaced by fields in one chunk.");
+        return;
+    }
+
+    for (const std::string& field : local->scalar->fields)
+    {
+        ObjString* name = copyString(field.data(), (int)field.size());
+        currentChunk()->scalarSites()[site].fields.push_back(name);
+    }
+
+    uint8_t* code     = currentChunk()->code().data() + current->lastInstruction;
+    uint8_t  argCount = code[1];
+    code[0]           = OP_NEW_SCALAR;
+    code[1]           = (site >> 8) & 0xff;
+    emitByte(site & 0xff);
+    emitByte(argCount);
+}
+
 static void varDeclaration()
 {
-    uint8_t global = parseVariable("Expect variable name.");
+    // A local replaced by its fields has their locals declared before it.
+    int                ordinal = -1;
+    const ScalarLocal* scalar  = nullptr;
+    if (current->scopeDepth > 0)
+    {
+        ordinal = current->varCount++;
+        for (const ScalarLocal& candidate : current->scalars)
+        {
+            if (candidate.ordinal == ordinal) scalar = &candidate;
+        }
+
+        for (size_t i = 0; scalar != nullptr && i < scalar->fields.size(); i++)
+        {
+            emitOp(OP_NIL);
+            addLocal(syntheticToken(""));
+            markInitialized();
+        }
+    }
+
+    uint16_t global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL))
     {
@@ -889,11 +1380,20 @@ static void varDeclaration()
     }
     else
     {
-        emitByte(OP_NIL);
+        emitOp(OP_NIL);
     }
 
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
+    if (current->scopeDepth > 0)
+    {
+        Local* local   = &current->locals[current->localCount - 1];
+        local->ordinal = ordinal;
+        local->callEnd = fusableOp(2) == OP_CALL ? (int)currentChunk()->size() : -1;
+        local->scalar  = local->callEnd >= 0 ? scalar : nullptr;
+        if (local->scalar != nullptr) emitNewScalar(local);
+    }
+
     defineVariable(global);
 }
 
@@ -901,7 +1401,7 @@ static void expressionStatement()
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+    emitOp(OP_POP);
 }
 
 static void forStatement()
@@ -922,7 +1422,7 @@ static void forStatement()
         expressionStatement();
     }
 
-    int loopStart = currentChunk()->size();
+    int loopStart = markJumpTarget();
 
     int exitJump = -1;
     if (!match(TOKEN_SEMICOLON))
@@ -931,17 +1431,16 @@ static void forStatement()
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);  // Condition.
+        exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
     }
 
     if (!match(TOKEN_RIGHT_PAREN))
     {
         int bodyJump = emitJump(OP_JUMP);
 
-        int incrementStart = currentChunk()->size();
+        int incrementStart = markJumpTarget();
         expression();
-        emitByte(OP_POP);
+        emitOp(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         emitLoop(loopStart);
@@ -956,7 +1455,6 @@ static void forStatement()
     if (exitJump != -1)
     {
         patchJump(exitJump);
-        emitByte(OP_POP);  // Condition.
     }
 
     endScope();
@@ -968,14 +1466,12 @@ static void ifStatement()
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");  // [paren]
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    int thenJump = emitJump(OP_POP_JUMP_IF_FALSE);
     statement();
 
     int elseJump = emitJump(OP_JUMP);
 
     patchJump(thenJump);
-    emitByte(OP_POP);
 
     if (match(TOKEN_ELSE)) statement();
     patchJump(elseJump);
@@ -985,7 +1481,7 @@ static void printStatement()
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+    emitOp(OP_PRINT);
 }
 
 static void returnStatement()
@@ -1007,27 +1503,42 @@ static void returnStatement()
         }
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emitByte(OP_RETURN);
+
+        // A call whose result is returned as is becomes a tail call. The
+        // OP_RETURN stays, for callees that aren't closures and for jumps
+        // that land past the call, as in `return a and f();`.
+        int last = current->lastInstruction;
+        if (last >= 0 && last + instructionLength(currentChunk(), last) == (int)currentChunk()->size())
+        {
+            uint8_t& op = currentChunk()->code()[last];
+            switch (op)
+            {
+                case OP_CALL: op = OP_TAIL_CALL; break;
+                case OP_INVOKE: op = OP_TAIL_INVOKE; break;
+                case OP_SUPER_INVOKE: op = OP_TAIL_SUPER_INVOKE; break;
+                default: break;
+            }
+        }
+
+        emitOp(OP_RETURN);
     }
 }
 
 static void whileStatement()
 {
-    int loopStart = currentChunk()->size();
+    int loopStart = markJumpTarget();
 
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
+    int exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
     statement();
 
     emitLoop(loopStart);
 
     patchJump(exitJump);
-    emitByte(OP_POP);
 }
 
 static void synchronize()
@@ -1135,12 +1646,23 @@ ObjFunction* compile(std::string_view source)
     return parser.hadError ? nullptr : function;
 }
 
+bool isCompiling()
+{
+    return current != nullptr;
+}
+
 void markCompilerRoots()
 {
     Compiler* compiler = current;
     while (compiler != nullptr)
     {
+        // The compiler writes to its functions without barriers.
         markObject((Obj*)compiler->function);
+        writeBarrier((Obj*)compiler->function);
+        for (const NestedFunction& nested : compiler->nested)
+        {
+            markObject((Obj*)nested.function);
+        }
         compiler = compiler->enclosing;
     }
 }
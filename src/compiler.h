@@ -8,5 +8,6 @@
 
 ObjFunction* compile(std::string_view source);
 void         markCompilerRoots();
+bool         isCompiling();
 
 #endif
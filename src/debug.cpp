@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name)
 {
@@ -23,16 +24,92 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t constant = (uint16_t)(chunk->code()[offset + 1] << 8);
+    constant |= chunk->code()[offset + 2];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants()[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int nameInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t index = chunk->code()[offset + 1];
+    printf("%-16s %4d '%s'\n", name, index, chunk->names()[index]->chars);
+    return offset + 2;
+}
+
+static int globalInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code()[offset + 1] << 8);
+    slot |= chunk->code()[offset + 2];
+    printf("%-16s %4d '%s'\n", name, slot, globalName(slot)->chars);
+    return offset + 3;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk, int offset)
 {
-    uint8_t constant = chunk->code()[offset + 1];
-    uint8_t argCount = chunk->code()[offset + 2];
-    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    uint8_t  method   = chunk->code()[offset + 1];
+    uint8_t  argCount = chunk->code()[offset + 2];
+    uint16_t cache    = (uint16_t)(chunk->code()[offset + 3] << 8);
+    cache |= chunk->code()[offset + 4];
+    printf("%-16s (%d args) %4d '%s' cache %d\n", name, argCount, method, chunk->names()[method]->chars, cache);
+    return offset + 5;
+}
+
+static int localConstantInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t slot     = chunk->code()[offset + 1];
+    uint8_t constant = chunk->code()[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
     printValue(chunk->constants()[constant]);
     printf("'\n");
     return offset + 3;
 }
 
+static int propertyInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t  property = chunk->code()[offset + 1];
+    uint16_t cache    = (uint16_t)(chunk->code()[offset + 2] << 8);
+    cache |= chunk->code()[offset + 3];
+    printf("%-16s %4d '%s' cache %d\n", name, property, chunk->names()[property]->chars, cache);
+    return offset + 4;
+}
+
+static int localPropertyInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t  slot     = chunk->code()[offset + 1];
+    uint8_t  property = chunk->code()[offset + 2];
+    uint16_t cache    = (uint16_t)(chunk->code()[offset + 3] << 8);
+    cache |= chunk->code()[offset + 4];
+    printf("%-16s %4d %4d '%s' cache %d\n", name, slot, property, chunk->names()[property]->chars, cache);
+    return offset + 5;
+}
+
+static int getScalarInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t  field    = chunk->code()[offset + 1];
+    uint8_t  slot     = chunk->code()[offset + 2];
+    uint8_t  property = chunk->code()[offset + 3];
+    uint16_t cache    = (uint16_t)(chunk->code()[offset + 4] << 8);
+    cache |= chunk->code()[offset + 5];
+    printf("%-16s %4d %4d %4d '%s' cache %d\n", name, field, slot, property, chunk->names()[property]->chars, cache);
+    return offset + 6;
+}
+
+static int newScalarInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t site = (uint16_t)(chunk->code()[offset + 1] << 8);
+    site |= chunk->code()[offset + 2];
+    uint8_t argCount = chunk->code()[offset + 3];
+    printf("%-16s (%d args) site %d:", name, argCount, site);
+    for (ObjString* field : chunk->scalarSites()[site].fields) printf(" %s", field->chars);
+    printf("\n");
+    return offset + 4;
+}
+
 static int simpleInstruction(const char* name, int offset)
 {
     printf("%s\n", name);
@@ -46,6 +123,14 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;  // [debug]
 }
 
+static int shortInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code()[offset + 1] << 8);
+    slot |= chunk->code()[offset + 2];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 {
     uint16_t jump = (uint16_t)(chunk->code()[offset + 1] << 8);
@@ -54,6 +139,16 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static const char* captureKindName(int kind)
+{
+    switch (kind)
+    {
+        case CAPTURE_LOCAL: return "local";
+        case CAPTURE_VALUE: return "value";
+        default: return "upvalue";
+    }
+}
+
 int disassembleInstruction(Chunk* chunk, int offset)
 {
     printf("%04d ", offset);
@@ -76,14 +171,14 @@ int disassembleInstruction(Chunk* chunk, int offset)
         case OP_POP: return simpleInstruction("OP_POP", offset);
         case OP_GET_LOCAL: return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL: return byteInstruction("OP_SET_LOCAL", chunk, offset);
-        case OP_GET_GLOBAL: return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-        case OP_DEFINE_GLOBAL: return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-        case OP_SET_GLOBAL: return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL: return globalInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL: return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL: return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE: return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE: return byteInstruction("OP_SET_UPVALUE", chunk, offset);
-        case OP_GET_PROPERTY: return constantInstruction("OP_GET_PROPERTY", chunk, offset);
-        case OP_SET_PROPERTY: return constantInstruction("OP_SET_PROPERTY", chunk, offset);
-        case OP_GET_SUPER: return constantInstruction("OP_GET_SUPER", chunk, offset);
+        case OP_GET_PROPERTY: return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_SET_PROPERTY: return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_GET_SUPER: return nameInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL: return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER: return simpleInstruction("OP_GREATER", offset);
         case OP_LESS: return simpleInstruction("OP_LESS", offset);
@@ -98,31 +193,183 @@ int disassembleInstruction(Chunk* chunk, int offset)
         case OP_JUMP_IF_FALSE: return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP: return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL: return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL: return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE: return invokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE: return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_TAIL_INVOKE: return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+        case OP_TAIL_SUPER_INVOKE: return invokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
         {
+            bool wide = instruction == OP_CLOSURE_LONG;
             offset++;
-            uint8_t constant = chunk->code()[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
+            int constant = chunk->code()[offset++];
+            if (wide) constant = (constant << 8) | chunk->code()[offset++];
+            printf("%-16s %4d ", wide ? "OP_CLOSURE_LONG" : "OP_CLOSURE", constant);
             printValue(chunk->constants()[constant]);
             printf("\n");
 
             ObjFunction* function = AS_FUNCTION(chunk->constants()[constant]);
             for (int j = 0; j < function->upvalueCount; j++)
             {
-                int isLocal = chunk->code()[offset++];
-                int index   = chunk->code()[offset++];
-                printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+                int capture = offset;
+                int kind  = chunk->code()[offset++];
+                int index = chunk->code()[offset++];
+                if (wide) index = (index << 8) | chunk->code()[offset++];
+                printf("%04d      |                     %s %d\n", capture, captureKindName(kind), index);
             }
 
             return offset;
         }
         case OP_CLOSE_UPVALUE: return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN: return simpleInstruction("OP_RETURN", offset);
-        case OP_CLASS: return constantInstruction("OP_CLASS", chunk, offset);
+        case OP_CLASS: return nameInstruction("OP_CLASS", chunk, offset);
         case OP_INHERIT: return simpleInstruction("OP_INHERIT", offset);
-        case OP_METHOD: return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_METHOD: return nameInstruction("OP_METHOD", chunk, offset);
+        case OP_POP_JUMP_IF_FALSE: return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_LESS_JUMP_IF_FALSE: return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_GET_LOCAL_PROPERTY: return localPropertyInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+        case OP_GET_LOCAL_CONSTANT: return localConstantInstruction("OP_GET_LOCAL_CONSTANT", chunk, offset);
+        case OP_RETURN_NIL: return simpleInstruction("OP_RETURN_NIL", offset);
+        case OP_CONSTANT_LONG: return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+        case OP_GET_LOCAL_LONG: return shortInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_LONG: return shortInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+        case OP_GET_UPVALUE_LONG: return shortInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
+        case OP_SET_UPVALUE_LONG: return shortInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+        case OP_ADD_NUM: return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR: return simpleInstruction("OP_ADD_STR", offset);
+        case OP_CALL_CLOSURE: return byteInstruction("OP_CALL_CLOSURE", chunk, offset);
+        case OP_CALL_NATIVE: return byteInstruction("OP_CALL_NATIVE", chunk, offset);
+        case OP_LOOP_TRACE: return jumpInstruction("OP_LOOP_TRACE", -1, chunk, offset);
+        case OP_NEW_SCALAR: return newScalarInstruction("OP_NEW_SCALAR", chunk, offset);
+        case OP_GET_SCALAR: return getScalarInstruction("OP_GET_SCALAR", chunk, offset);
+        case OP_SET_SCALAR: return localPropertyInstruction("OP_SET_SCALAR", chunk, offset);
         default: printf("Unknown opcode %d\n", instruction); return offset + 1;
     }
 }
+
+void disassembleRegChunk(RegChunk* chunk, const char* name)
+{
+    printf("== %s (%d registers) ==\n", name, chunk->slotCount());
+
+    for (int index = 0; index < chunk->size();)
+    {
+        index = disassembleRegInstruction(chunk, index);
+    }
+}
+
+static void printRegOperand(RegChunk* chunk, char kind, uint16_t operand)
+{
+    if (kind == 'x')
+    {
+        kind = (operand & RK_CONSTANT) ? 'k' : 'r';
+        operand &= ~RK_CONSTANT;
+    }
+
+    switch (kind)
+    {
+        case 'r': printf(" r%d", operand); break;
+        case 'u': printf(" u%d", operand); break;
+        case 'n': printf(" %d", operand); break;
+        case 'g': printf(" '%s'", globalName(operand)->chars); break;
+        case 'k':
+            printf(" '");
+            printValue(chunk->constants()[operand]);
+            printf("'");
+            break;
+        default: break;
+    }
+}
+
+// Each character of `operands` says how to print A, B and C: 'r' register,
+// 'k' constant, 'x' register or constant, 'u' upvalue, 'g' global slot,
+// 'n' plain number and '-' unused.
+static int regInstruction(const char* name, RegChunk* chunk, int index, const char* operands)
+{
+    RegInstruction instruction = chunk->code()[index];
+    printf("%-18s", name);
+    printRegOperand(chunk, operands[0], instruction.a);
+    printRegOperand(chunk, operands[1], instruction.b);
+    printRegOperand(chunk, operands[2], instruction.c);
+    printf("\n");
+    return index + 1;
+}
+
+static int regJumpInstruction(const char* name, RegChunk* chunk, int index, const char* operands)
+{
+    RegInstruction instruction = chunk->code()[index];
+    printf("%-18s", name);
+    printRegOperand(chunk, operands[0], instruction.b);
+    printRegOperand(chunk, operands[1], instruction.c);
+    printf(" -> %d\n", index + 1 + (int16_t)instruction.a);
+    return index + 1;
+}
+
+int disassembleRegInstruction(RegChunk* chunk, int index)
+{
+    printf("%04d ", index);
+    if (index > 0 && chunk->lines()[index] == chunk->lines()[index - 1])
+    {
+        printf("   | ");
+    }
+    else
+    {
+        printf("%4d ", chunk->lines()[index]);
+    }
+
+    uint8_t instruction = chunk->code()[index].op;
+    switch (instruction)
+    {
+        case ROP_MOVE: return regInstruction("ROP_MOVE", chunk, index, "rr-");
+        case ROP_LOADK: return regInstruction("ROP_LOADK", chunk, index, "rk-");
+        case ROP_GET_GLOBAL: return regInstruction("ROP_GET_GLOBAL", chunk, index, "rg-");
+        case ROP_DEFINE_GLOBAL: return regInstruction("ROP_DEFINE_GLOBAL", chunk, index, "gx-");
+        case ROP_SET_GLOBAL: return regInstruction("ROP_SET_GLOBAL", chunk, index, "gx-");
+        case ROP_GET_UPVALUE: return regInstruction("ROP_GET_UPVALUE", chunk, index, "ru-");
+        case ROP_SET_UPVALUE: return regInstruction("ROP_SET_UPVALUE", chunk, index, "ux-");
+        case ROP_GET_PROPERTY: return regInstruction("ROP_GET_PROPERTY", chunk, index, "rxk");
+        case ROP_SET_PROPERTY: return regInstruction("ROP_SET_PROPERTY", chunk, index, "xkx");
+        case ROP_GET_SUPER: return regInstruction("ROP_GET_SUPER", chunk, index, "rxk");
+        case ROP_EQUAL: return regInstruction("ROP_EQUAL", chunk, index, "rxx");
+        case ROP_GREATER: return regInstruction("ROP_GREATER", chunk, index, "rxx");
+        case ROP_LESS: return regInstruction("ROP_LESS", chunk, index, "rxx");
+        case ROP_ADD: return regInstruction("ROP_ADD", chunk, index, "rxx");
+        case ROP_SUBTRACT: return regInstruction("ROP_SUBTRACT", chunk, index, "rxx");
+        case ROP_MULTIPLY: return regInstruction("ROP_MULTIPLY", chunk, index, "rxx");
+        case ROP_DIVIDE: return regInstruction("ROP_DIVIDE", chunk, index, "rxx");
+        case ROP_NOT: return regInstruction("ROP_NOT", chunk, index, "rx-");
+        case ROP_NEGATE: return regInstruction("ROP_NEGATE", chunk, index, "rx-");
+        case ROP_PRINT: return regInstruction("ROP_PRINT", chunk, index, "x--");
+        case ROP_JUMP: return regJumpInstruction("ROP_JUMP", chunk, index, "--");
+        case ROP_LOOP: return regJumpInstruction("ROP_LOOP", chunk, index, "--");
+        case ROP_JUMP_IF_FALSE: return regJumpInstruction("ROP_JUMP_IF_FALSE", chunk, index, "x-");
+        case ROP_LESS_JUMP: return regJumpInstruction("ROP_LESS_JUMP", chunk, index, "xx");
+        case ROP_CALL: return regInstruction("ROP_CALL", chunk, index, "rn-");
+        case ROP_TAIL_CALL: return regInstruction("ROP_TAIL_CALL", chunk, index, "rn-");
+        case ROP_INVOKE: return regInstruction("ROP_INVOKE", chunk, index, "rkn");
+        case ROP_SUPER_INVOKE: return regInstruction("ROP_SUPER_INVOKE", chunk, index, "rkn");
+        case ROP_TAIL_INVOKE: return regInstruction("ROP_TAIL_INVOKE", chunk, index, "rkn");
+        case ROP_TAIL_SUPER_INVOKE: return regInstruction("ROP_TAIL_SUPER_INVOKE", chunk, index, "rkn");
+        case ROP_CLOSURE:
+        {
+            RegInstruction closure = chunk->code()[index];
+            regInstruction("ROP_CLOSURE", chunk, index++, "rk-");
+
+            ObjFunction* function = AS_FUNCTION(chunk->constants()[closure.b]);
+            for (int j = 0; j < function->upvalueCount; j++, index++)
+            {
+                RegInstruction capture = chunk->code()[index];
+                printf("%04d      |                     %s %d\n", index, capture.a ? "local" : "upvalue", capture.b);
+            }
+
+            return index;
+        }
+        case ROP_CAPTURE: return regInstruction("ROP_CAPTURE", chunk, index, "nn-");
+        case ROP_CLOSE_UPVALUE: return regInstruction("ROP_CLOSE_UPVALUE", chunk, index, "r--");
+        case ROP_RETURN: return regInstruction("ROP_RETURN", chunk, index, "x--");
+        case ROP_CLASS: return regInstruction("ROP_CLASS", chunk, index, "rk-");
+        case ROP_INHERIT: return regInstruction("ROP_INHERIT", chunk, index, "xx-");
+        case ROP_METHOD: return regInstruction("ROP_METHOD", chunk, index, "xxk");
+        default: printf("Unknown opcode %d\n", instruction); return index + 1;
+    }
+}
@@ -2,8 +2,11 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "regchunk.h"
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int  disassembleInstruction(Chunk* chunk, int offset);
+void disassembleRegChunk(RegChunk* chunk, const char* name);
+int  disassembleRegInstruction(RegChunk* chunk, int index);
 
 #endif
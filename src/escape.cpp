@@ -0,0 +1,287 @@
+#include <algorithm>
+
+#include "escape.h"
+
+#ifdef DEBUG_PRINT_ESCAPE
+#include <cstdio>
+#endif
+
+// How many values the instruction at `code` pops and pushes. Returns false
+// for jumps and anything else a use of a local is not followed through.
+static bool stackEffect(uint8_t* code, int* pops, int* pushes)
+{
+    *pushes = 1;
+    switch (code[0])
+    {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+        case OP_GET_LOCAL_PROPERTY:
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG: *pops = 0; return true;
+
+        case OP_GET_LOCAL_CONSTANT:
+            *pops   = 0;
+            *pushes = 2;
+            return true;
+
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG:
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE: *pops = 1; return true;
+
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: *pops = 2; return true;
+
+        case OP_CALL: *pops = code[1] + 1; return true;
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE: *pops = code[2] + 1; return true;
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE: *pops = code[2] + 2; return true;
+
+        default: return false;
+    }
+}
+
+// Follows a value from `offset` on, where it has `above` values on top of
+// it, to the instruction that pops it. Returns that instruction's offset
+// and leaves in `above` how many values were on top of the value then.
+// Returns -1 if a jump or the end of the local's scope comes first.
+static int consumer(Chunk* chunk, int offset, int end, int* above)
+{
+    for (; offset < end; offset += instructionLength(chunk, offset))
+    {
+        int pops, pushes;
+        if (!stackEffect(chunk->code().data() + offset, &pops, &pushes)) return -1;
+        if (pops > *above) return offset;
+
+        *above += pushes - pops;
+    }
+
+    return -1;
+}
+
+// Whether a jump lands on `target`. The compiler doesn't fuse across jump
+// targets, so a receiver there can't be turned into OP_GET_SCALAR or
+// OP_SET_SCALAR.
+static bool isJumpTarget(Chunk* chunk, int target)
+{
+    uint8_t* code = chunk->code().data();
+    for (int offset = 0; offset < (int)chunk->size(); offset += instructionLength(chunk, offset))
+    {
+        uint8_t* ip = code + offset;
+        switch (ip[0])
+        {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_LESS_JUMP_IF_FALSE:
+                if (offset + 3 + ((ip[1] << 8) | ip[2]) == target) return true;
+                break;
+
+            case OP_LOOP:
+                if (offset + 3 - ((ip[1] << 8) | ip[2]) == target) return true;
+                break;
+
+            default: break;
+        }
+    }
+
+    return false;
+}
+
+static void addField(std::vector<ObjString*>* fields, ObjString* name)
+{
+    if (std::find(fields->begin(), fields->end(), name) == fields->end()) fields->push_back(name);
+}
+
+// Collects the fields the uses of `local` name. Returns the offset of the
+// first use that lets the instance escape, or -1 if none does.
+static int findEscape(Chunk* chunk, const CallLocal& local, std::vector<ObjString*>* fields)
+{
+    uint8_t* code      = chunk->code().data();
+    Value*   constants = chunk->constants().data();
+
+    for (int offset = local.start; offset < local.end; offset += instructionLength(chunk, offset))
+    {
+        uint8_t* ip = code + offset;
+        switch (ip[0])
+        {
+            case OP_GET_LOCAL_PROPERTY:
+                if (ip[1] == local.slot) addField(fields, chunk->names()[ip[2]]);
+                break;
+
+            case OP_GET_LOCAL:
+            case OP_GET_LOCAL_CONSTANT:
+            {
+                if (ip[1] != local.slot) break;
+
+                // Only the receiver of a property access may take it.
+                int above = ip[0] == OP_GET_LOCAL_CONSTANT ? 1 : 0;
+                int next  = offset + instructionLength(chunk, offset);
+                int use   = consumer(chunk, next, local.end, &above);
+                if (use < 0 || isJumpTarget(chunk, next)) return offset;
+
+                uint8_t* user = code + use;
+                if (user[0] == OP_GET_PROPERTY && above == 0)
+                {
+                    addField(fields, chunk->names()[user[1]]);
+                }
+                else if (user[0] == OP_SET_PROPERTY && above == 1)
+                {
+                    addField(fields, chunk->names()[user[1]]);
+                }
+                else
+                {
+                    return use;
+                }
+                break;
+            }
+
+            case OP_SET_LOCAL:
+                if (ip[1] == local.slot) return offset;
+                break;
+
+            case OP_CLOSURE:
+            {
+                // The compiler doesn't note captured locals, but be sure.
+                ObjFunction* function = AS_FUNCTION(constants[ip[1]]);
+                for (int i = 0; i < function->upvalueCount; i++)
+                {
+                    if (ip[2 + 2 * i] != CAPTURE_UPVALUE && ip[3 + 2 * i] == local.slot) return offset;
+                }
+                break;
+            }
+
+            default: break;
+        }
+    }
+
+    return -1;
+}
+
+std::vector<ScalarLocal> findScalarLocals(ObjFunction* function, const std::vector<CallLocal>& candidates)
+{
+    std::vector<ScalarLocal> scalars;
+    if (candidates.empty()) return scalars;
+
+#ifdef DEBUG_PRINT_ESCAPE
+    printf("== escape analysis of %s ==\n", function->name != nullptr ? function->name->chars : "<script>");
+#endif
+
+    // The field locals have to keep every slot in reach of the short forms.
+    int slots = function->maxLocals;
+    for (const CallLocal& local : candidates)
+    {
+        std::vector<ObjString*> fields;
+        int                     escape = findEscape(&function->chunk, local, &fields);
+        bool                    fits   = fields.size() <= SCALAR_MAX_FIELDS && slots + (int)fields.size() <= UINT8_COUNT;
+
+#ifdef DEBUG_PRINT_ESCAPE
+        printf("%04d '%.*s' ", local.start, local.name.length, local.name.start);
+        if (escape >= 0)
+        {
+            printf("escapes at %04d\n", escape);
+        }
+        else if (!fits)
+        {
+            printf("kept, %d fields\n", (int)fields.size());
+        }
+        else
+        {
+            printf("replaced by %d field locals:", (int)fields.size());
+            for (ObjString* field : fields) printf(" %s", field->chars);
+            printf("\n");
+        }
+#endif
+
+        if (escape >= 0 || !fits) continue;
+
+        ScalarLocal& scalar = scalars.emplace_back();
+        scalar.ordinal      = local.ordinal;
+        for (ObjString* field : fields) scalar.fields.emplace_back(field->chars, field->length);
+        slots += (int)fields.size();
+    }
+
+    return scalars;
+}
+
+void analyzeInitializer(ObjFunction* function)
+{
+    Chunk*   chunk     = &function->chunk;
+    uint8_t* code      = chunk->code().data();
+    Value*   constants = chunk->constants().data();
+
+    // Only `this.name = <parameter or constant>;` statements, up to the
+    // first return of `this`.
+    function->onlyStoresFields = false;
+    function->fieldInits.clear();
+    for (int offset = 0; offset < (int)chunk->size();)
+    {
+        uint8_t*  ip    = code + offset;
+        FieldInit store = {nullptr, 0, NIL_VAL};
+
+        if (ip[0] == OP_GET_LOCAL_CONSTANT && ip[1] == 0)
+        {
+            store.constant = constants[ip[2]];
+            ip += 3;
+        }
+        else if (ip[0] == OP_GET_LOCAL && ip[1] == 0)
+        {
+            ip += 2;
+            switch (ip[0])
+            {
+                case OP_RETURN: function->onlyStoresFields = true; return;
+
+                case OP_GET_LOCAL:
+                    if (ip[1] == 0 || ip[1] > function->arity) return;
+                    store.param = ip[1];
+                    ip += 2;
+                    break;
+
+                case OP_CONSTANT:
+                    store.constant = constants[ip[1]];
+                    ip += 2;
+                    break;
+
+                case OP_NIL: ip += 1; break;
+
+                case OP_TRUE:
+                case OP_FALSE:
+                    store.constant = BOOL_VAL(ip[0] == OP_TRUE);
+                    ip += 1;
+                    break;
+
+                default: return;
+            }
+        }
+        else
+        {
+            return;
+        }
+
+        if (ip[0] != OP_SET_PROPERTY || ip[4] != OP_POP) return;
+
+        store.name = chunk->names()[ip[1]];
+        function->fieldInits.push_back(store);
+        offset = (int)(ip + 5 - code);
+    }
+}
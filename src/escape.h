@@ -0,0 +1,43 @@
+#ifndef clox_escape_h
+#define clox_escape_h
+
+#include <string>
+#include <vector>
+
+#include "object.h"
+#include "scanner.h"
+
+// Escape analysis for scalar replacement of instances. The compiler notes
+// each local whose initializer ends in a call, which might make an
+// instance. If the function's bytecode only ever gets and sets fields of
+// the local, by constant names, nothing else can see the instance, and the
+// compiler compiles the function again with a local per field in its place
+// (see OP_NEW_SCALAR). The instance is still made if the callee turns out
+// to be anything but a class whose initializer only stores fields.
+
+#define SCALAR_MAX_FIELDS 8  // Instances using more fields are left alone.
+
+// A local whose initializer ends in a call, and the code it's in scope for.
+struct CallLocal
+{
+    Token name;
+    int   ordinal;  // Which of the function's local var declarations it is.
+    int   slot;
+    int   start;  // Just after the call.
+    int   end;    // Where it leaves scope.
+};
+
+// A local to replace, with the fields its uses name.
+struct ScalarLocal
+{
+    int                      ordinal;
+    std::vector<std::string> fields;
+};
+
+// Picks the locals among `candidates` whose instance doesn't escape.
+std::vector<ScalarLocal> findScalarLocals(ObjFunction* function, const std::vector<CallLocal>& candidates);
+
+// Fills in function->onlyStoresFields and fieldInits for an initializer.
+void analyzeInitializer(ObjFunction* function);
+
+#endif
@@ -0,0 +1,2417 @@
+#include "jit.h"
+
+#ifdef JIT
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <sys/mman.h>
+#include <vector>
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#if defined(DEBUG_PRINT_CODE) || defined(DEBUG_LOG_JIT)
+#include <cstdio>
+#endif
+
+// Compiled functions share large executable regions. Giving each one its
+// own pages puts every function's entry at the same page offset, and hot
+// functions then evict each other from the instruction cache. Code is
+// never freed, since a function's code is bounded by the source that
+// declared it.
+#define JIT_REGION_SIZE (256 * 1024)
+
+static uint8_t* regionStart = nullptr;
+static size_t   regionUsed  = JIT_REGION_SIZE;
+
+static void* writeCode(const std::vector<uint8_t>& code)
+{
+    size_t size = (code.size() + 15) & ~(size_t)15;
+    if (size > JIT_REGION_SIZE) return nullptr;
+
+    if (regionUsed + size > JIT_REGION_SIZE)
+    {
+        void* memory = mmap(nullptr, JIT_REGION_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) return nullptr;
+
+        regionStart = (uint8_t*)memory;
+        regionUsed  = 0;
+    }
+
+    // Only the region is made writable, and only while nothing runs.
+    if (mprotect(regionStart, JIT_REGION_SIZE, PROT_READ | PROT_WRITE) != 0) return nullptr;
+    uint8_t* start = regionStart + regionUsed;
+    memcpy(start, code.data(), code.size());
+    if (mprotect(regionStart, JIT_REGION_SIZE, PROT_READ | PROT_EXEC) != 0) return nullptr;
+
+    regionUsed += size;
+    return start;
+}
+
+JitCode::JitCode(const std::vector<uint8_t>& code) noexcept
+    : m_code(writeCode(code)), m_size(code.size())
+{
+}
+
+JitCode::~JitCode() = default;
+
+bool JitCode::isValid() const noexcept
+{
+    return m_code != nullptr;
+}
+
+const void* JitCode::entry() const noexcept
+{
+    return m_code;
+}
+
+bool JitCode::run(CallFrame* frame) const noexcept
+{
+    return ((bool (*)(CallFrame*))m_code)(frame);
+}
+
+enum Reg : uint8_t
+{
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15
+};
+
+// The generated code keeps the VM state it touches in callee-saved
+// registers, so it survives the helper calls.
+#define SP     RBX  // Stack top, stored to vm.stackTop around helper calls.
+#define QNAN_R R12  // The QNAN constant, for number checks.
+#define SLOTS  R13  // frame->slots.
+#define FRAME  R14  // The CallFrame.
+#define VMR    R15  // &vm.
+
+// The prologue pads the native frame to keep calls aligned. call() keeps
+// the frame count it expects back in that padding, at [rbp + SPILL].
+#define SPILL (-48)
+
+enum Condition : uint8_t
+{
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A  = 0x7,
+    CC_S  = 0x8,
+    CC_NP = 0xb,
+    CC_G  = 0xf
+};
+
+// Just enough of an x86-64 encoder for the templates. Memory operands are
+// always [base + disp32].
+class Assembler
+{
+private:
+    std::vector<uint8_t> m_code{};
+    std::vector<int>     m_labels{};
+    std::vector<int>     m_fixups{};  // Pairs of code position, label.
+
+    void byte(uint8_t value)
+    {
+        m_code.push_back(value);
+    }
+
+    void dword(uint32_t value)
+    {
+        for (int i = 0; i < 4; i++) byte((value >> (8 * i)) & 0xff);
+    }
+
+    void rex(Reg reg, Reg rm)
+    {
+        byte(0x48 | ((reg >> 3) << 2) | (rm >> 3));
+    }
+
+    void modrmReg(uint8_t opcode, Reg reg, Reg rm)
+    {
+        rex(reg, rm);
+        byte(opcode);
+        byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void modrmMem(uint8_t opcode, Reg reg, Reg base, int32_t disp)
+    {
+        rex(reg, base);
+        byte(opcode);
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP) byte(0x24);  // SIB for rsp and r12.
+        dword((uint32_t)disp);
+    }
+
+    void rel32(int label)
+    {
+        m_fixups.push_back((int)m_code.size());
+        m_fixups.push_back(label);
+        dword(0);
+    }
+
+public:
+    [[nodiscard]] int newLabel()
+    {
+        m_labels.push_back(-1);
+        return (int)m_labels.size() - 1;
+    }
+
+    void bind(int label)
+    {
+        m_labels[label] = (int)m_code.size();
+    }
+
+    // Fills in the jumps and returns the finished code.
+    std::vector<uint8_t>& finish()
+    {
+        for (size_t i = 0; i < m_fixups.size(); i += 2)
+        {
+            int     position = m_fixups[i];
+            int32_t offset   = m_labels[m_fixups[i + 1]] - (position + 4);
+            memcpy(&m_code[position], &offset, 4);
+        }
+
+        return m_code;
+    }
+
+    void movImm(Reg reg, uint64_t value)
+    {
+        if (value <= UINT32_MAX)
+        {
+            // mov r32, imm32 zero-extends.
+            if (reg >= R8) byte(0x41);
+            byte(0xb8 + (reg & 7));
+            dword((uint32_t)value);
+            return;
+        }
+
+        rex(RAX, reg);
+        byte(0xb8 + (reg & 7));
+        for (int i = 0; i < 8; i++) byte((value >> (8 * i)) & 0xff);
+    }
+
+    void movAddress(Reg reg, const void* pointer)
+    {
+        movImm(reg, (uint64_t)(uintptr_t)pointer);
+    }
+
+    void load(Reg reg, Reg base, int32_t disp)
+    {
+        modrmMem(0x8b, reg, base, disp);
+    }
+
+    // movsxd: loads a signed int.
+    void loadInt(Reg reg, Reg base, int32_t disp)
+    {
+        modrmMem(0x63, reg, base, disp);
+    }
+
+    // cmp byte [base + disp], imm8
+    void cmpByte(Reg base, int32_t disp, uint8_t value)
+    {
+        if (base >= R8) byte(0x41);
+        byte(0x80);
+        byte(0xb8 | (base & 7));
+        if ((base & 7) == RSP) byte(0x24);
+        dword((uint32_t)disp);
+        byte(value);
+    }
+
+    void store(Reg base, int32_t disp, Reg reg)
+    {
+        modrmMem(0x89, reg, base, disp);
+    }
+
+    void mov(Reg dst, Reg src)
+    {
+        modrmReg(0x89, src, dst);
+    }
+
+    void add(Reg dst, Reg src)
+    {
+        modrmReg(0x01, src, dst);
+    }
+
+    void andReg(Reg dst, Reg src)
+    {
+        modrmReg(0x21, src, dst);
+    }
+
+    void xorReg(Reg dst, Reg src)
+    {
+        modrmReg(0x31, src, dst);
+    }
+
+    void cmp(Reg a, Reg b)
+    {
+        modrmReg(0x39, b, a);
+    }
+
+    void test(Reg a, Reg b)
+    {
+        modrmReg(0x85, b, a);
+    }
+
+    void shlImm(Reg reg, uint8_t count)
+    {
+        rex(RAX, reg);
+        byte(0xc1);
+        byte(0xe0 | (reg & 7));
+        byte(count);
+    }
+
+    void addImm(Reg reg, int32_t value)
+    {
+        rex(RAX, reg);
+        byte(0x81);
+        byte(0xc0 | (reg & 7));
+        dword((uint32_t)value);
+    }
+
+    // movq xmm, r64
+    void toXmm(uint8_t xmm, Reg reg)
+    {
+        byte(0x66);
+        rex((Reg)xmm, reg);
+        byte(0x0f);
+        byte(0x6e);
+        byte(0xc0 | (xmm << 3) | (reg & 7));
+    }
+
+    // movq r64, xmm
+    void fromXmm(Reg reg, uint8_t xmm)
+    {
+        byte(0x66);
+        rex((Reg)xmm, reg);
+        byte(0x0f);
+        byte(0x7e);
+        byte(0xc0 | (xmm << 3) | (reg & 7));
+    }
+
+    // addsd (0x58), mulsd (0x59), subsd (0x5c) or divsd (0x5e) xmm0, xmm1.
+    void sse(uint8_t opcode)
+    {
+        byte(0xf2);
+        byte(0x0f);
+        byte(opcode);
+        byte(0xc1);
+    }
+
+    void ucomisd(uint8_t a, uint8_t b)
+    {
+        byte(0x66);
+        byte(0x0f);
+        byte(0x2e);
+        byte(0xc0 | (a << 3) | b);
+    }
+
+    // setcc on `reg8`, which must be al, cl or dl.
+    void setcc(Condition condition, Reg reg8)
+    {
+        byte(0x0f);
+        byte(0x90 | condition);
+        byte(0xc0 | reg8);
+    }
+
+    // Zero-extends al into rax.
+    void movzxAl()
+    {
+        byte(0x0f);
+        byte(0xb6);
+        byte(0xc0);
+    }
+
+    void andAlCl()
+    {
+        byte(0x20);
+        byte(0xc8);
+    }
+
+    void orAlCl()
+    {
+        byte(0x08);
+        byte(0xc8);
+    }
+
+    void testAl()
+    {
+        byte(0x84);
+        byte(0xc0);
+    }
+
+    // inc dword [base + disp]
+    void incMem32(Reg base, int32_t disp)
+    {
+        if (base >= R8) byte(0x41);
+        byte(0xff);
+        byte(0x80 | (base & 7));
+        if ((base & 7) == RSP) byte(0x24);
+        dword((uint32_t)disp);
+    }
+
+    // dec dword [base + disp]
+    void decMem32(Reg base, int32_t disp)
+    {
+        if (base >= R8) byte(0x41);
+        byte(0xff);
+        byte(0x88 | (base & 7));
+        if ((base & 7) == RSP) byte(0x24);
+        dword((uint32_t)disp);
+    }
+
+    // dec qword [base + disp]
+    void decMem64(Reg base, int32_t disp)
+    {
+        byte(base >= R8 ? 0x49 : 0x48);
+        byte(0xff);
+        byte(0x88 | (base & 7));
+        if ((base & 7) == RSP) byte(0x24);
+        dword((uint32_t)disp);
+    }
+
+    void jcc(Condition condition, int label)
+    {
+        byte(0x0f);
+        byte(0x80 | condition);
+        rel32(label);
+    }
+
+    void jmp(int label)
+    {
+        byte(0xe9);
+        rel32(label);
+    }
+
+    void call(const void* function)
+    {
+        movAddress(RAX, function);
+        call(RAX);
+    }
+
+    // call reg
+    void call(Reg reg)
+    {
+        if (reg >= R8) byte(0x41);
+        byte(0xff);
+        byte(0xd0 | (reg & 7));
+    }
+
+    // jmp reg
+    void jmp(Reg reg)
+    {
+        if (reg >= R8) byte(0x41);
+        byte(0xff);
+        byte(0xe0 | (reg & 7));
+    }
+
+    void push(Reg reg)
+    {
+        if (reg >= R8) byte(0x41);
+        byte(0x50 + (reg & 7));
+    }
+
+    void pop(Reg reg)
+    {
+        if (reg >= R8) byte(0x41);
+        byte(0x58 + (reg & 7));
+    }
+
+    void ret()
+    {
+        byte(0xc3);
+    }
+};
+
+// A call site's direct call to a compiled callee. It is emitted out of
+// line, after the epilogue, so call sites that never take it stay small.
+struct DirectCall
+{
+    int entry;  // Jumped to with the closure in rax.
+    int slow;   // Where the site calls the helper instead.
+    int done;   // Where the site carries on.
+    int argCount;
+    int next;
+};
+
+struct JitCompiler
+{
+    Assembler    as;
+    ObjFunction* function;
+    uint8_t*     code;
+    Value*       constants;
+    ObjString**  names;
+
+    std::vector<int>        labels;  // One per bytecode offset.
+    std::vector<DirectCall> directCalls;
+    int                     returnLabel;
+    int                     errorLabel;
+    int                     handOverLabel;  // Enters the compiled code in RAX instead.
+};
+
+#define STACK          ((int32_t)offsetof(VM, stack))
+#define STACK_TOP      ((int32_t)offsetof(VM, stackTop))
+#define STACK_CAP      ((int32_t)offsetof(VM, stackCapacity))
+#define FRAMES         ((int32_t)offsetof(VM, frames))
+#define FRAME_COUNT    ((int32_t)offsetof(VM, frameCount))
+#define FRAME_CAP      ((int32_t)offsetof(VM, frameCapacity))
+#define NATIVE_LIMIT   ((int32_t)offsetof(VM, nativeStackLimit))
+#define GLOBAL_VALUES  ((int32_t)offsetof(VM, globalValues))
+#define BUDGET         ((int32_t)offsetof(VM, budget))
+#define INTERRUPT      ((int32_t)offsetof(VM, interrupt))
+#define GC_PHASE       ((int32_t)offsetof(VM, gcPhase))
+#define FRAME_IP       ((int32_t)offsetof(CallFrame, ip))
+#define FRAME_SLOTS    ((int32_t)offsetof(CallFrame, slots))
+#define FRAME_CLOSURE  ((int32_t)offsetof(CallFrame, closure))
+#define CLOSURE_FUNC   ((int32_t)offsetof(ObjClosure, function))
+#define CLOSURE_UPVALS ((int32_t)offsetof(ObjClosure, upvalues))
+#define FUNC_ARITY     ((int32_t)offsetof(ObjFunction, arity))
+#define FUNC_MAX_STACK ((int32_t)offsetof(ObjFunction, maxStack))
+#define FUNC_ENTRY     ((int32_t)offsetof(ObjFunction, jitEntry))
+#define UPVALUE_LOC    ((int32_t)offsetof(ObjUpvalue, location))
+#define NATIVE_FUNC    ((int32_t)offsetof(ObjNative, function))
+#define NATIVE_ARITY   ((int32_t)offsetof(ObjNative, arity))
+#define NATIVE_PURE    ((int32_t)offsetof(ObjNative, pure))
+#define OBJ_TYPE_FIELD ((int32_t)offsetof(Obj, type))
+#define OBJ_OLD        ((int32_t)offsetof(Obj, isOld))
+#define OBJ_REMEMBERED ((int32_t)offsetof(Obj, isRemembered))
+#define FIELDS_CAP     ((int32_t)(offsetof(ObjInstance, fields) + offsetof(Table, capacity)))
+#define FIELDS_ENTRIES ((int32_t)(offsetof(ObjInstance, fields) + offsetof(Table, entries)))
+#define CACHE_FIELD    ((int32_t)offsetof(PropertyCache, field))
+#define CACHE_KLASS    ((int32_t)offsetof(InvokeCache, klasses))
+#define CACHE_METHOD   ((int32_t)offsetof(InvokeCache, methods))
+#define INSTANCE_KLASS ((int32_t)offsetof(ObjInstance, klass))
+#define FIELD_NAME     ((int32_t)offsetof(ObjString, isFieldName))
+#define ENTRY_KEY      ((int32_t)offsetof(Entry, key))
+#define ENTRY_VALUE    ((int32_t)offsetof(Entry, value))
+
+static_assert(sizeof(Entry) == 16, "cachedEntry() scales field indexes by 16.");
+
+static void pushReg(JitCompiler* compiler, Reg reg)
+{
+    compiler->as.store(SP, 0, reg);
+    compiler->as.addImm(SP, sizeof(Value));
+}
+
+static void pushValue(JitCompiler* compiler, Value value)
+{
+    compiler->as.movImm(RAX, value);
+    pushReg(compiler, RAX);
+}
+
+static void jumpIfNotNumber(JitCompiler* compiler, Reg reg, int label)
+{
+    compiler->as.mov(RDX, reg);
+    compiler->as.andReg(RDX, QNAN_R);
+    compiler->as.cmp(RDX, QNAN_R);
+    compiler->as.jcc(CC_E, label);
+}
+
+// Turns the 0 or 1 in al into a Lox boolean in rax.
+static void boolFromAl(JitCompiler* compiler)
+{
+    compiler->as.movzxAl();
+    compiler->as.movImm(RCX, FALSE_VAL);
+    compiler->as.add(RAX, RCX);
+}
+
+// Calls a runtime helper with up to three arguments. The stack top and the
+// ip of the next instruction are written back first, so the helper sees
+// the same state the interpreter would have, and the stack top is reloaded
+// afterwards. A false result leaves the function.
+static void callHelper(JitCompiler* compiler,
+                       int          next,
+                       const void*  helper,
+                       uint64_t     a = 0,
+                       uint64_t     b = 0,
+                       uint64_t     c = 0)
+{
+    Assembler& as = compiler->as;
+    as.store(VMR, STACK_TOP, SP);
+    as.movAddress(RAX, compiler->code + next);
+    as.store(FRAME, FRAME_IP, RAX);
+    as.movImm(RDI, a);
+    as.movImm(RSI, b);
+    as.movImm(RDX, c);
+    as.call(helper);
+    as.testAl();
+    as.jcc(CC_E, compiler->errorLabel);
+    as.load(SP, VMR, STACK_TOP);
+}
+
+static_assert(sizeof(CallFrame) == 32, "reloadFrame() finds the top frame with a shift.");
+
+// Helpers that make calls can grow both stacks, and so move them. After
+// those, the frame and its slots are found again.
+static void reloadFrame(JitCompiler* compiler)
+{
+    Assembler& as = compiler->as;
+    as.load(FRAME, VMR, FRAMES);
+    as.loadInt(RCX, VMR, FRAME_COUNT);
+    as.shlImm(RCX, 5);
+    as.add(FRAME, RCX);
+    as.addImm(FRAME, -(int32_t)sizeof(CallFrame));
+    as.load(SLOTS, FRAME, FRAME_SLOTS);
+}
+
+// Jumps to `stop` once the budget is spent or the script has been
+// interrupted, the check the interpreter makes on back-edges and calls.
+static void checkBudget(JitCompiler* compiler, int stop)
+{
+    Assembler& as = compiler->as;
+    as.decMem64(VMR, BUDGET);
+    as.jcc(CC_S, stop);
+    as.cmpByte(VMR, INTERRUPT, 0);
+    as.jcc(CC_NE, stop);
+}
+
+static void error(JitCompiler* compiler, int next, const char* message)
+{
+    callHelper(compiler, next, (const void*)jitError, (uint64_t)(uintptr_t)message);
+}
+
+// Loads the two operands of a binary instruction into rax and rcx, jumping
+// to `slow` unless both are numbers.
+static void numberOperands(JitCompiler* compiler, int slow)
+{
+    Assembler& as = compiler->as;
+    as.load(RAX, SP, -16);
+    as.load(RCX, SP, -8);
+    jumpIfNotNumber(compiler, RAX, slow);
+    jumpIfNotNumber(compiler, RCX, slow);
+    as.toXmm(0, RAX);
+    as.toXmm(1, RCX);
+}
+
+static void arithmetic(JitCompiler* compiler, uint8_t sseOpcode, int next, bool isAdd)
+{
+    Assembler& as   = compiler->as;
+    int        slow = as.newLabel();
+    int        done = as.newLabel();
+
+    numberOperands(compiler, slow);
+    as.sse(sseOpcode);
+    as.fromXmm(RAX, 0);
+    as.addImm(SP, -(int32_t)sizeof(Value));
+    as.store(SP, -8, RAX);
+    as.jmp(done);
+
+    as.bind(slow);
+    if (isAdd)
+    {
+        callHelper(compiler, next, (const void*)jitAdd);
+    }
+    else
+    {
+        error(compiler, next, "Operands must be numbers.");
+    }
+
+    as.bind(done);
+}
+
+// Jumps to `label` if writeBarrier() would remember the object in rax.
+static void jumpIfUnremembered(JitCompiler* compiler, int label)
+{
+    Assembler& as         = compiler->as;
+    int        remembered = as.newLabel();
+    as.cmpByte(RAX, OBJ_REMEMBERED, 0);
+    as.jcc(CC_NE, remembered);
+    as.cmpByte(RAX, OBJ_OLD, 0);
+    as.jcc(CC_NE, label);
+    as.cmpByte(VMR, GC_PHASE, GC_IDLE);
+    as.jcc(CC_NE, label);
+    as.bind(remembered);
+}
+
+// The inline part of a property cache: leaves in rdx the field entry the
+// cache points to, if the value in rax is an instance whose fields have
+// `name` at that index. Otherwise jumps to `miss`. For a store, instances
+// the write barrier has yet to remember miss as well.
+static void cachedEntry(JitCompiler* compiler, ObjString* name, PropertyCache* cache, int miss, bool isStore = false)
+{
+    Assembler& as = compiler->as;
+    as.movImm(RDX, QNAN | SIGN_BIT);
+    as.mov(RCX, RAX);
+    as.andReg(RCX, RDX);
+    as.cmp(RCX, RDX);
+    as.jcc(CC_NE, miss);
+    as.xorReg(RAX, RDX);  // Now the Obj*.
+    as.cmpByte(RAX, OBJ_TYPE_FIELD, OBJ_INSTANCE);
+    as.jcc(CC_NE, miss);
+
+    if (isStore) jumpIfUnremembered(compiler, miss);
+
+    as.movAddress(RDX, cache);
+    as.loadInt(RCX, RDX, CACHE_FIELD);
+    as.loadInt(RDX, RAX, FIELDS_CAP);
+    as.cmp(RCX, RDX);
+    as.jcc(CC_G, miss);
+
+    as.load(RDX, RAX, FIELDS_ENTRIES);
+    as.shlImm(RCX, 4);
+    as.add(RDX, RCX);
+    as.load(RCX, RDX, ENTRY_KEY);
+    as.movAddress(RAX, name);
+    as.cmp(RCX, RAX);
+    as.jcc(CC_NE, miss);
+}
+
+static void getProperty(JitCompiler* compiler, int next, ObjString* name, PropertyCache* cache)
+{
+    Assembler& as   = compiler->as;
+    int        miss = as.newLabel();
+    int        done = as.newLabel();
+
+    as.load(RAX, SP, -8);
+    cachedEntry(compiler, name, cache, miss);
+    as.load(RAX, RDX, ENTRY_VALUE);
+    as.store(SP, -8, RAX);
+    as.jmp(done);
+
+    as.bind(miss);
+    callHelper(compiler, next, (const void*)jitGetProperty, (uint64_t)(uintptr_t)name, (uint64_t)(uintptr_t)cache);
+    as.bind(done);
+}
+
+static void setProperty(JitCompiler* compiler, int next, ObjString* name, PropertyCache* cache)
+{
+    Assembler& as   = compiler->as;
+    int        miss = as.newLabel();
+    int        done = as.newLabel();
+
+    as.load(RAX, SP, -16);
+    cachedEntry(compiler, name, cache, miss, true);
+    as.load(RAX, SP, -8);
+    as.store(RDX, ENTRY_VALUE, RAX);
+    as.addImm(SP, -(int32_t)sizeof(Value));
+    as.store(SP, -8, RAX);  // Replace the instance.
+    as.jmp(done);
+
+    as.bind(miss);
+    callHelper(compiler, next, (const void*)jitSetProperty, (uint64_t)(uintptr_t)name, (uint64_t)(uintptr_t)cache);
+    as.bind(done);
+}
+
+// GREATER and LESS. `a` and `b` pick the xmm registers to compare so that
+// "above" means the instruction's result is true.
+static void comparison(JitCompiler* compiler, uint8_t a, uint8_t b, int next)
+{
+    Assembler& as   = compiler->as;
+    int        slow = as.newLabel();
+    int        done = as.newLabel();
+
+    numberOperands(compiler, slow);
+    as.ucomisd(a, b);
+    as.setcc(CC_A, RAX);
+    boolFromAl(compiler);
+    as.addImm(SP, -(int32_t)sizeof(Value));
+    as.store(SP, -8, RAX);
+    as.jmp(done);
+
+    as.bind(slow);
+    error(compiler, next, "Operands must be numbers.");
+    as.bind(done);
+}
+
+static void equal(JitCompiler* compiler)
+{
+    Assembler& as      = compiler->as;
+    int        numbers = as.newLabel();
+    int        done    = as.newLabel();
+    int        bits    = as.newLabel();
+
+    as.load(RAX, SP, -16);
+    as.load(RCX, SP, -8);
+    as.addImm(SP, -(int32_t)sizeof(Value));
+    jumpIfNotNumber(compiler, RAX, bits);
+    jumpIfNotNumber(compiler, RCX, bits);
+    as.jmp(numbers);
+
+    // Anything but two numbers is equal when the bits are.
+    as.bind(bits);
+    as.cmp(RAX, RCX);
+    as.setcc(CC_E, RAX);
+    as.jmp(done);
+
+    // Numbers compare as doubles, so NaN != NaN and 0 == -0.
+    as.bind(numbers);
+    as.toXmm(0, RAX);
+    as.toXmm(1, RCX);
+    as.ucomisd(0, 1);
+    as.setcc(CC_E, RAX);
+    as.setcc(CC_NP, RCX);
+    as.andAlCl();
+
+    as.bind(done);
+    boolFromAl(compiler);
+    as.store(SP, -8, RAX);
+}
+
+// Jumps to `label` if the value in rax is nil or false.
+static void jumpIfFalsey(JitCompiler* compiler, int label)
+{
+    Assembler& as = compiler->as;
+    as.movImm(RCX, NIL_VAL);
+    as.cmp(RAX, RCX);
+    as.jcc(CC_E, label);
+    as.movImm(RCX, FALSE_VAL);
+    as.cmp(RAX, RCX);
+    as.jcc(CC_E, label);
+}
+
+// Leaves upvalue `index` of the running closure in rax.
+static void loadUpvalue(JitCompiler* compiler, int index)
+{
+    Assembler& as = compiler->as;
+    as.load(RAX, FRAME, FRAME_CLOSURE);
+    as.load(RAX, RAX, CLOSURE_UPVALS);
+    as.load(RAX, RAX, index * (int32_t)sizeof(ObjUpvalue*));
+}
+
+// Leaves the address of upvalue `index`'s variable in rax.
+static void upvalueLocation(JitCompiler* compiler, int index)
+{
+    loadUpvalue(compiler, index);
+    compiler->as.load(RAX, RAX, UPVALUE_LOC);
+}
+
+// Stores the top of the stack into upvalue `index`, calling the helper
+// for the write barrier when it is needed.
+static void setUpvalue(JitCompiler* compiler, int next, int index)
+{
+    Assembler& as      = compiler->as;
+    int        barrier = as.newLabel();
+    int        done    = as.newLabel();
+
+    loadUpvalue(compiler, index);
+    as.load(RCX, RAX, UPVALUE_LOC);
+    as.load(RDX, SP, -8);
+    as.store(RCX, 0, RDX);
+
+    jumpIfUnremembered(compiler, barrier);
+    as.jmp(done);
+    as.bind(barrier);
+    callHelper(compiler, next, (const void*)jitRememberUpvalue, (uint64_t)index);
+    as.bind(done);
+}
+
+// Pops the frame, leaving the result in place of the callee. Only a
+// function whose locals closures share needs the helper, to close them.
+static void returnValue(JitCompiler* compiler, int next)
+{
+    Assembler& as = compiler->as;
+
+    if (compiler->function->capturesLocals)
+    {
+        callHelper(compiler, next, (const void*)jitReturn);
+        as.jmp(compiler->returnLabel);
+        return;
+    }
+
+    as.load(RAX, SP, -8);
+    as.store(SLOTS, 0, RAX);
+    as.mov(SP, SLOTS);
+    as.addImm(SP, sizeof(Value));
+    as.store(VMR, STACK_TOP, SP);
+    as.decMem32(VMR, FRAME_COUNT);
+    as.jmp(compiler->returnLabel);
+}
+
+// A call the interpreter has seen go to a native. Pure natives with the
+// right arity are called directly: they leave the stacks where they are,
+// so nothing needs storing first or reloading after.
+static void callNative(JitCompiler* compiler, int argCount, int next)
+{
+    Assembler& as   = compiler->as;
+    int        slow = as.newLabel();
+    int        done = as.newLabel();
+
+    as.load(RAX, SP, -(argCount + 1) * (int32_t)sizeof(Value));
+    as.movImm(RDX, QNAN | SIGN_BIT);
+    as.mov(RCX, RAX);
+    as.andReg(RCX, RDX);
+    as.cmp(RCX, RDX);
+    as.jcc(CC_NE, slow);
+    as.xorReg(RAX, RDX);  // Now the Obj*.
+    as.cmpByte(RAX, OBJ_TYPE_FIELD, OBJ_NATIVE);
+    as.jcc(CC_NE, slow);
+    as.cmpByte(RAX, NATIVE_PURE, 1);
+    as.jcc(CC_NE, slow);
+    as.loadInt(RCX, RAX, NATIVE_ARITY);
+    as.movImm(RDX, argCount);
+    as.cmp(RCX, RDX);
+    as.jcc(CC_NE, slow);
+
+    as.mov(RDI, VMR);
+    as.movImm(RSI, argCount);
+    as.mov(RDX, SP);
+    as.addImm(RDX, -argCount * (int32_t)sizeof(Value));
+    as.load(RAX, RAX, NATIVE_FUNC);
+    as.call(RAX);
+    as.addImm(SP, -argCount * (int32_t)sizeof(Value));
+    as.jmp(done);
+
+    as.bind(slow);
+    callHelper(compiler, next, (const void*)jitCall, argCount);
+    reloadFrame(compiler);
+    as.bind(done);
+}
+
+// Calls the closure in rax, if it is compiled, straight to its code. The
+// frame is pushed here once the checks call() would make have passed, and
+// the callee writes its ip before anything can read it. Jumps to `slow`
+// for closures that aren't compiled and calls that would have to grow a
+// stack.
+static void callCompiled(JitCompiler* compiler, int argCount, int next, int slow)
+{
+    Assembler& as       = compiler->as;
+    int        returned = as.newLabel();
+    int32_t    callee   = -(argCount + 1) * (int32_t)sizeof(Value);
+
+    as.load(RCX, RAX, CLOSURE_FUNC);
+    as.load(RDX, RCX, FUNC_ENTRY);
+    as.test(RDX, RDX);
+    as.jcc(CC_E, slow);
+    as.loadInt(RSI, RCX, FUNC_ARITY);
+    as.movImm(RDI, argCount);
+    as.cmp(RSI, RDI);
+    as.jcc(CC_NE, slow);
+
+    // Room for the frame, its values, and the callee's native frame.
+    as.loadInt(RSI, VMR, FRAME_COUNT);
+    as.loadInt(RDI, VMR, FRAME_CAP);
+    as.cmp(RSI, RDI);
+    as.jcc(CC_E, slow);
+    as.loadInt(RDI, RCX, FUNC_MAX_STACK);
+    as.shlImm(RDI, 3);
+    as.add(RDI, SP);
+    as.addImm(RDI, callee);
+    as.loadInt(R8, VMR, STACK_CAP);
+    as.shlImm(R8, 3);
+    as.load(R9, VMR, STACK);
+    as.add(R8, R9);
+    as.cmp(RDI, R8);
+    as.jcc(CC_A, slow);
+    as.load(R8, VMR, NATIVE_LIMIT);
+    as.cmp(RSP, R8);
+    as.jcc(CC_B, slow);
+    checkBudget(compiler, slow);
+
+    as.store(VMR, STACK_TOP, SP);
+    as.movAddress(R8, compiler->code + next);
+    as.store(FRAME, FRAME_IP, R8);
+    as.incMem32(VMR, FRAME_COUNT);
+    as.store(RBP, SPILL, RSI);
+    as.shlImm(RSI, 5);
+    as.load(RDI, VMR, FRAMES);
+    as.add(RDI, RSI);
+    as.store(RDI, FRAME_CLOSURE, RAX);
+    as.mov(R8, SP);
+    as.addImm(R8, callee);
+    as.store(RDI, FRAME_SLOTS, R8);
+    as.call(RDX);
+    as.testAl();
+    as.jcc(CC_E, compiler->errorLabel);
+
+    // A callee that ended in a tail call may have left its frame to a
+    // function still to run.
+    as.loadInt(RCX, VMR, FRAME_COUNT);
+    as.load(RDX, RBP, SPILL);
+    as.cmp(RCX, RDX);
+    as.jcc(CC_E, returned);
+    as.call((const void*)jitResumeCall);
+    as.testAl();
+    as.jcc(CC_E, compiler->errorLabel);
+
+    as.bind(returned);
+    as.load(SP, VMR, STACK_TOP);
+    reloadFrame(compiler);
+}
+
+// Calls whatever is below the arguments through the runtime.
+static void helperCall(JitCompiler* compiler, int argCount, int next)
+{
+    callHelper(compiler, next, (const void*)jitCall, argCount);
+    reloadFrame(compiler);
+}
+
+// A call. Compiled closures are called directly, anything else through
+// the helper.
+static void call(JitCompiler* compiler, int argCount, int next)
+{
+    Assembler& as   = compiler->as;
+    DirectCall direct{as.newLabel(), as.newLabel(), as.newLabel(), argCount, next};
+
+    as.load(RAX, SP, -(argCount + 1) * (int32_t)sizeof(Value));
+    as.movImm(RDX, QNAN | SIGN_BIT);
+    as.mov(RCX, RAX);
+    as.andReg(RCX, RDX);
+    as.cmp(RCX, RDX);
+    as.jcc(CC_NE, direct.slow);
+    as.xorReg(RAX, RDX);  // Now the Obj*.
+    as.cmpByte(RAX, OBJ_TYPE_FIELD, OBJ_CLOSURE);
+    as.jcc(CC_E, direct.entry);
+
+    as.bind(direct.slow);
+    helperCall(compiler, argCount, next);
+    as.bind(direct.done);
+    compiler->directCalls.push_back(direct);
+}
+
+// Leaves in RAX the method the first class in the inline cache has, if
+// the receiver is an instance of it and no field can be shadowing the
+// method. Jumps to `miss` otherwise.
+static void firstCachedMethod(JitCompiler* compiler, int argCount, ObjString* name, InvokeCache* cache, int miss)
+{
+    Assembler& as = compiler->as;
+    as.load(RAX, SP, -(argCount + 1) * (int32_t)sizeof(Value));
+    as.movImm(RDX, QNAN | SIGN_BIT);
+    as.mov(RCX, RAX);
+    as.andReg(RCX, RDX);
+    as.cmp(RCX, RDX);
+    as.jcc(CC_NE, miss);
+    as.xorReg(RAX, RDX);  // Now the Obj*.
+    as.cmpByte(RAX, OBJ_TYPE_FIELD, OBJ_INSTANCE);
+    as.jcc(CC_NE, miss);
+    as.movAddress(RDX, name);
+    as.cmpByte(RDX, FIELD_NAME, 0);
+    as.jcc(CC_NE, miss);
+    as.load(RCX, RAX, INSTANCE_KLASS);
+    as.movAddress(RDX, cache);
+    as.load(RSI, RDX, CACHE_KLASS);
+    as.cmp(RCX, RSI);
+    as.load(RAX, RDX, CACHE_METHOD);  // A load leaves the flags alone.
+    as.jcc(CC_NE, miss);
+}
+
+// A method call. The first class in the inline cache has its method
+// called directly, as long as no field can be shadowing it. Anything else
+// goes through the helper.
+static void invoke(JitCompiler* compiler, int argCount, int next, ObjString* name, InvokeCache* cache)
+{
+    Assembler& as = compiler->as;
+    DirectCall direct{as.newLabel(), as.newLabel(), as.newLabel(), argCount, next};
+
+    firstCachedMethod(compiler, argCount, name, cache, direct.slow);
+    as.jmp(direct.entry);
+
+    as.bind(direct.slow);
+    callHelper(compiler,
+               next,
+               (const void*)jitInvoke,
+               (uint64_t)(uintptr_t)name,
+               argCount,
+               (uint64_t)(uintptr_t)cache);
+    reloadFrame(compiler);
+    as.bind(direct.done);
+    compiler->directCalls.push_back(direct);
+}
+
+// Runs the closure the frame has just been handed over to. A compiled
+// one takes this native frame over too, so tail calls between compiled
+// functions don't nest on the native stack. Others are left to
+// runCompiled().
+static void enterHandedOver(JitCompiler* compiler)
+{
+    Assembler& as = compiler->as;
+    as.load(RAX, FRAME, FRAME_CLOSURE);
+    as.load(RAX, RAX, CLOSURE_FUNC);
+    as.load(RAX, RAX, FUNC_ENTRY);
+    as.test(RAX, RAX);
+    as.jcc(CC_E, compiler->returnLabel);
+    as.jmp(compiler->handOverLabel);
+}
+
+// Hands the frame straight over to the compiled closure in RAX when that
+// needs nothing from the runtime: this function's locals aren't shared,
+// so there are none to close, the arity is right and the callee's values
+// fit on the stack. Jumps to `slow` otherwise.
+static void tailCallCompiled(JitCompiler* compiler, int argCount, int slow)
+{
+    Assembler& as = compiler->as;
+
+    as.load(RCX, RAX, CLOSURE_FUNC);
+    as.load(RDX, RCX, FUNC_ENTRY);
+    as.test(RDX, RDX);
+    as.jcc(CC_E, slow);
+    as.loadInt(RSI, RCX, FUNC_ARITY);
+    as.movImm(RDI, argCount);
+    as.cmp(RSI, RDI);
+    as.jcc(CC_NE, slow);
+    as.loadInt(RDI, RCX, FUNC_MAX_STACK);
+    as.shlImm(RDI, 3);
+    as.add(RDI, SLOTS);
+    as.loadInt(R8, VMR, STACK_CAP);
+    as.shlImm(R8, 3);
+    as.load(R9, VMR, STACK);
+    as.add(R8, R9);
+    as.cmp(RDI, R8);
+    as.jcc(CC_A, slow);
+    checkBudget(compiler, slow);
+
+    as.store(FRAME, FRAME_CLOSURE, RAX);
+    for (int slot = 0; slot <= argCount; slot++)
+    {
+        as.load(RCX, SP, (slot - argCount - 1) * (int32_t)sizeof(Value));
+        as.store(SLOTS, slot * (int32_t)sizeof(Value), RCX);
+    }
+
+    as.mov(SP, SLOTS);
+    as.addImm(SP, (argCount + 1) * (int32_t)sizeof(Value));
+    as.store(VMR, STACK_TOP, SP);
+    as.mov(RAX, RDX);
+    as.jmp(compiler->handOverLabel);
+}
+
+// A call in tail position. A closure takes over the frame: when the
+// function calls itself the code starts over from the top, otherwise the
+// callee runs in its place, as enterHandedOver() does. Other callees get
+// an ordinary call, and the OP_RETURN after it returns the result.
+static void tailCall(JitCompiler* compiler, int argCount, int next)
+{
+    Assembler& as    = compiler->as;
+    int        other = as.newLabel();
+    int        slow  = as.newLabel();
+
+    as.load(RAX, SP, -(argCount + 1) * (int32_t)sizeof(Value));
+    as.movImm(RDX, QNAN | SIGN_BIT);
+    as.mov(RCX, RAX);
+    as.andReg(RCX, RDX);
+    as.cmp(RCX, RDX);
+    as.jcc(CC_NE, other);
+    as.xorReg(RAX, RDX);  // Now the Obj*.
+    as.cmpByte(RAX, OBJ_TYPE_FIELD, OBJ_CLOSURE);
+    as.jcc(CC_NE, other);
+
+    // Shared locals have to be closed first, as in returnValue().
+    if (!compiler->function->capturesLocals)
+    {
+        if (argCount == compiler->function->arity)
+        {
+            int notSelf = as.newLabel();
+            as.load(RCX, RAX, CLOSURE_FUNC);
+            as.movAddress(RDX, compiler->function);
+            as.cmp(RCX, RDX);
+            as.jcc(CC_NE, notSelf);
+
+            as.store(FRAME, FRAME_CLOSURE, RAX);
+            for (int slot = 0; slot <= argCount; slot++)
+            {
+                as.load(RCX, SP, (slot - argCount - 1) * (int32_t)sizeof(Value));
+                as.store(SLOTS, slot * (int32_t)sizeof(Value), RCX);
+            }
+
+            as.mov(SP, SLOTS);
+            as.addImm(SP, (argCount + 1) * (int32_t)sizeof(Value));
+            checkBudget(compiler, slow);
+            as.jmp(compiler->labels[0]);
+
+            as.bind(notSelf);
+        }
+
+        tailCallCompiled(compiler, argCount, slow);
+    }
+
+    as.bind(slow);
+    callHelper(compiler, next, (const void*)jitTailCall, argCount);
+    reloadFrame(compiler);
+    enterHandedOver(compiler);
+
+    as.bind(other);
+    call(compiler, argCount, next);
+}
+
+// A method call in tail position. The method takes over the frame, as in
+// tailCall(), straight away if it is the first in the inline cache and
+// compiled, otherwise through the helper. A field the helper calls as
+// usual leaves the frame at the OP_RETURN that follows.
+static void tailInvoke(JitCompiler* compiler, int argCount, int next, ObjString* name, InvokeCache* cache)
+{
+    Assembler& as   = compiler->as;
+    int        slow = as.newLabel();
+
+    if (!compiler->function->capturesLocals)
+    {
+        firstCachedMethod(compiler, argCount, name, cache, slow);
+        tailCallCompiled(compiler, argCount, slow);
+    }
+
+    as.bind(slow);
+    callHelper(compiler,
+               next,
+               (const void*)jitTailInvoke,
+               (uint64_t)(uintptr_t)name,
+               argCount,
+               (uint64_t)(uintptr_t)cache);
+    reloadFrame(compiler);
+    as.movAddress(RAX, compiler->code + next);
+    as.load(RCX, FRAME, FRAME_IP);
+    as.cmp(RAX, RCX);
+    as.jcc(CC_E, compiler->labels[next]);
+    enterHandedOver(compiler);
+}
+
+static void prologue(JitCompiler* compiler)
+{
+    Assembler& as = compiler->as;
+    as.push(RBP);
+    as.mov(RBP, RSP);
+    as.push(RBX);
+    as.push(R12);
+    as.push(R13);
+    as.push(R14);
+    as.push(R15);
+    as.addImm(RSP, -8);  // Keep the stack 16-byte aligned for calls.
+
+    as.mov(FRAME, RDI);
+    as.movAddress(VMR, &vm);
+    as.load(SLOTS, FRAME, FRAME_SLOTS);
+    as.load(SP, VMR, STACK_TOP);
+    as.movImm(QNAN_R, QNAN);
+}
+
+static void epilogue(JitCompiler* compiler)
+{
+    Assembler& as   = compiler->as;
+    int        exit = as.newLabel();
+
+    as.bind(compiler->returnLabel);
+    as.movImm(RAX, 1);
+    as.jmp(exit);
+
+    as.bind(compiler->errorLabel);
+    as.movImm(RAX, 0);
+
+    as.bind(exit);
+    as.addImm(RSP, 8);
+    as.pop(R15);
+    as.pop(R14);
+    as.pop(R13);
+    as.pop(R12);
+    as.pop(RBX);
+    as.pop(RBP);
+    as.ret();
+
+    // The same, but leaving the frame to the callee's code instead of
+    // returning, which runs in this native frame's place.
+    as.bind(compiler->handOverLabel);
+    as.mov(RDI, FRAME);
+    as.addImm(RSP, 8);
+    as.pop(R15);
+    as.pop(R14);
+    as.pop(R13);
+    as.pop(R12);
+    as.pop(RBX);
+    as.pop(RBP);
+    as.jmp(RAX);
+
+    for (const DirectCall& direct : compiler->directCalls)
+    {
+        as.bind(direct.entry);
+        callCompiled(compiler, direct.argCount, direct.next, direct.slow);
+        as.jmp(direct.done);
+    }
+}
+
+static uint16_t readShort(uint8_t* code)
+{
+    return (uint16_t)((code[0] << 8) | code[1]);
+}
+
+// The operand of an instruction that has a wide form, given the opcode
+// the wide form of it has.
+static int operand(uint8_t* code, uint8_t longOp)
+{
+    return code[0] == longOp ? readShort(code + 1) : code[1];
+}
+
+// Emits the template of the instruction at `offset`. Returns false for
+// instructions the JIT doesn't handle.
+static bool emitInstruction(JitCompiler* compiler, int offset, int next)
+{
+    Assembler&  as        = compiler->as;
+    uint8_t*    code      = compiler->code + offset;
+    Value*      constants = compiler->constants;
+    ObjString** names     = compiler->names;
+
+    switch (code[0])
+    {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: pushValue(compiler, constants[operand(code, OP_CONSTANT_LONG)]); break;
+        case OP_NIL: pushValue(compiler, NIL_VAL); break;
+        case OP_TRUE: pushValue(compiler, TRUE_VAL); break;
+        case OP_FALSE: pushValue(compiler, FALSE_VAL); break;
+        case OP_POP: as.addImm(SP, -(int32_t)sizeof(Value)); break;
+
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+            as.load(RAX, SLOTS, operand(code, OP_GET_LOCAL_LONG) * (int32_t)sizeof(Value));
+            pushReg(compiler, RAX);
+            break;
+
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+            as.load(RAX, SP, -8);
+            as.store(SLOTS, operand(code, OP_SET_LOCAL_LONG) * (int32_t)sizeof(Value), RAX);
+            break;
+
+        case OP_GET_LOCAL_CONSTANT:
+            as.load(RAX, SLOTS, code[1] * (int32_t)sizeof(Value));
+            pushReg(compiler, RAX);
+            pushValue(compiler, constants[code[2]]);
+            break;
+
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        {
+            int     slot    = readShort(code + 1);
+            int32_t address = slot * (int32_t)sizeof(Value);
+            int     defined = as.newLabel();
+
+            as.load(RCX, VMR, GLOBAL_VALUES);
+            as.load(RAX, RCX, address);
+            as.movImm(RDX, UNDEFINED_VAL);
+            as.cmp(RAX, RDX);
+            as.jcc(CC_NE, defined);
+            callHelper(compiler, next, (const void*)jitUndefinedVariable, slot);
+
+            as.bind(defined);
+            if (code[0] == OP_GET_GLOBAL)
+            {
+                pushReg(compiler, RAX);
+            }
+            else
+            {
+                as.load(RAX, SP, -8);
+                as.store(RCX, address, RAX);
+            }
+            break;
+        }
+
+        case OP_DEFINE_GLOBAL:
+            as.load(RCX, VMR, GLOBAL_VALUES);
+            as.addImm(SP, -(int32_t)sizeof(Value));
+            as.load(RAX, SP, 0);
+            as.store(RCX, readShort(code + 1) * (int32_t)sizeof(Value), RAX);
+            break;
+
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+            upvalueLocation(compiler, operand(code, OP_GET_UPVALUE_LONG));
+            as.load(RAX, RAX, 0);
+            pushReg(compiler, RAX);
+            break;
+
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG: setUpvalue(compiler, next, operand(code, OP_SET_UPVALUE_LONG)); break;
+
+        case OP_GET_LOCAL_PROPERTY:
+            as.load(RAX, SLOTS, code[1] * (int32_t)sizeof(Value));
+            pushReg(compiler, RAX);
+            getProperty(compiler,
+                        next,
+                        names[code[2]],
+                        &compiler->function->chunk.propertyCaches()[readShort(code + 3)]);
+            break;
+
+        case OP_GET_PROPERTY:
+            getProperty(compiler,
+                        next,
+                        names[code[1]],
+                        &compiler->function->chunk.propertyCaches()[readShort(code + 2)]);
+            break;
+
+        case OP_GET_SCALAR:
+        {
+            int instance  = as.newLabel();
+            int undefined = as.newLabel();
+            int done      = as.newLabel();
+
+            as.load(RAX, SLOTS, code[2] * (int32_t)sizeof(Value));
+            as.movImm(RCX, UNDEFINED_VAL);
+            as.cmp(RAX, RCX);
+            as.jcc(CC_NE, instance);
+            as.load(RAX, SLOTS, code[1] * (int32_t)sizeof(Value));
+            as.cmp(RAX, RCX);
+            as.jcc(CC_E, undefined);
+            pushReg(compiler, RAX);
+            as.jmp(done);
+
+            as.bind(undefined);
+            callHelper(compiler, next, (const void*)jitUndefinedProperty, (uint64_t)(uintptr_t)names[code[3]]);
+
+            as.bind(instance);
+            pushReg(compiler, RAX);
+            getProperty(compiler,
+                        next,
+                        names[code[3]],
+                        &compiler->function->chunk.propertyCaches()[readShort(code + 4)]);
+            as.bind(done);
+            break;
+        }
+
+        case OP_SET_PROPERTY:
+            setProperty(compiler,
+                        next,
+                        names[code[1]],
+                        &compiler->function->chunk.propertyCaches()[readShort(code + 2)]);
+            break;
+
+        case OP_SET_SCALAR:
+        {
+            int instance = as.newLabel();
+            int done     = as.newLabel();
+
+            as.load(RAX, SP, -16);
+            as.movImm(RCX, UNDEFINED_VAL);
+            as.cmp(RAX, RCX);
+            as.jcc(CC_NE, instance);
+            as.load(RAX, SP, -8);
+            as.store(SLOTS, code[1] * (int32_t)sizeof(Value), RAX);
+            as.addImm(SP, -(int32_t)sizeof(Value));
+            as.store(SP, -8, RAX);  // Replace the instance.
+            as.jmp(done);
+
+            as.bind(instance);
+            setProperty(compiler,
+                        next,
+                        names[code[2]],
+                        &compiler->function->chunk.propertyCaches()[readShort(code + 3)]);
+            as.bind(done);
+            break;
+        }
+
+        case OP_GET_SUPER:
+            callHelper(compiler, next, (const void*)jitGetSuper, (uint64_t)(uintptr_t)names[code[1]]);
+            break;
+
+        case OP_EQUAL: equal(compiler); break;
+        case OP_GREATER: comparison(compiler, 0, 1, next); break;
+        case OP_LESS: comparison(compiler, 1, 0, next); break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR: arithmetic(compiler, 0x58, next, true); break;
+        case OP_SUBTRACT: arithmetic(compiler, 0x5c, next, false); break;
+        case OP_MULTIPLY: arithmetic(compiler, 0x59, next, false); break;
+        case OP_DIVIDE: arithmetic(compiler, 0x5e, next, false); break;
+
+        case OP_NOT:
+        {
+            as.load(RAX, SP, -8);
+            as.movImm(RCX, NIL_VAL);
+            as.cmp(RAX, RCX);
+            as.setcc(CC_E, RDX);
+            as.movImm(RCX, FALSE_VAL);
+            as.cmp(RAX, RCX);
+            as.setcc(CC_E, RAX);
+            as.mov(RCX, RDX);
+            as.orAlCl();
+            boolFromAl(compiler);
+            as.store(SP, -8, RAX);
+            break;
+        }
+
+        case OP_NEGATE:
+        {
+            int slow = as.newLabel();
+            int done = as.newLabel();
+
+            as.load(RAX, SP, -8);
+            jumpIfNotNumber(compiler, RAX, slow);
+            as.movImm(RCX, SIGN_BIT);
+            as.xorReg(RAX, RCX);
+            as.store(SP, -8, RAX);
+            as.jmp(done);
+
+            as.bind(slow);
+            error(compiler, next, "Operand must be a number.");
+            as.bind(done);
+            break;
+        }
+
+        case OP_PRINT: callHelper(compiler, next, (const void*)jitPrint); break;
+
+        case OP_JUMP: as.jmp(compiler->labels[jumpTarget(&compiler->function->chunk, offset)]); break;
+
+        case OP_LOOP:
+        case OP_LOOP_TRACE:
+        {
+            int stop = as.newLabel();
+            checkBudget(compiler, stop);
+            as.jmp(compiler->labels[jumpTarget(&compiler->function->chunk, offset)]);
+
+            as.bind(stop);
+            callHelper(compiler, next, (const void*)jitPreempt);
+            break;
+        }
+
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+            if (code[0] == OP_POP_JUMP_IF_FALSE) as.addImm(SP, -(int32_t)sizeof(Value));
+            as.load(RAX, SP, code[0] == OP_POP_JUMP_IF_FALSE ? 0 : -8);
+            jumpIfFalsey(compiler, compiler->labels[jumpTarget(&compiler->function->chunk, offset)]);
+            break;
+
+        case OP_LESS_JUMP_IF_FALSE:
+        {
+            int slow   = as.newLabel();
+            int target = compiler->labels[jumpTarget(&compiler->function->chunk, offset)];
+
+            numberOperands(compiler, slow);
+            as.addImm(SP, -2 * (int32_t)sizeof(Value));
+            as.ucomisd(1, 0);
+            as.jcc(CC_BE, target);  // Unordered counts as not less.
+            as.jmp(compiler->labels[next]);
+
+            as.bind(slow);
+            error(compiler, next, "Operands must be numbers.");
+            break;
+        }
+
+        case OP_CALL:
+        case OP_CALL_CLOSURE: call(compiler, code[1], next); break;
+        case OP_CALL_NATIVE: callNative(compiler, code[1], next); break;
+        case OP_TAIL_CALL: tailCall(compiler, code[1], next); break;
+
+        case OP_NEW_SCALAR:
+            callHelper(compiler,
+                       next,
+                       (const void*)jitNewScalar,
+                       (uint64_t)(uintptr_t)&compiler->function->chunk.scalarSites()[readShort(code + 1)],
+                       code[3]);
+            reloadFrame(compiler);
+            break;
+
+        case OP_INVOKE:
+            invoke(compiler,
+                   code[2],
+                   next,
+                   names[code[1]],
+                   &compiler->function->chunk.invokeCaches()[readShort(code + 3)]);
+            break;
+
+        case OP_SUPER_INVOKE:
+            callHelper(compiler,
+                       next,
+                       (const void*)jitSuperInvoke,
+                       (uint64_t)(uintptr_t)names[code[1]],
+                       code[2],
+                       (uint64_t)(uintptr_t)&compiler->function->chunk.invokeCaches()[readShort(code + 3)]);
+            reloadFrame(compiler);
+            break;
+
+        case OP_TAIL_INVOKE:
+            tailInvoke(compiler,
+                       code[2],
+                       next,
+                       names[code[1]],
+                       &compiler->function->chunk.invokeCaches()[readShort(code + 3)]);
+            break;
+
+        // The method always takes over the frame.
+        case OP_TAIL_SUPER_INVOKE:
+            callHelper(compiler,
+                       next,
+                       (const void*)jitTailSuperInvoke,
+                       (uint64_t)(uintptr_t)names[code[1]],
+                       code[2],
+                       (uint64_t)(uintptr_t)&compiler->function->chunk.invokeCaches()[readShort(code + 3)]);
+            reloadFrame(compiler);
+            enterHandedOver(compiler);
+            break;
+
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+        {
+            bool wide = code[0] == OP_CLOSURE_LONG;
+            callHelper(compiler,
+                       next,
+                       (const void*)jitClosure,
+                       (uint64_t)(uintptr_t)AS_FUNCTION(constants[operand(code, OP_CLOSURE_LONG)]),
+                       (uint64_t)(uintptr_t)(code + (wide ? 3 : 2)),
+                       wide);
+            break;
+        }
+
+        case OP_CLOSE_UPVALUE: callHelper(compiler, next, (const void*)jitCloseUpvalue); break;
+
+        case OP_RETURN_NIL:
+        case OP_RETURN:
+            if (code[0] == OP_RETURN_NIL) pushValue(compiler, NIL_VAL);
+            returnValue(compiler, next);
+            break;
+
+        case OP_CLASS:
+            callHelper(compiler, next, (const void*)jitClass, (uint64_t)(uintptr_t)names[code[1]]);
+            break;
+
+        case OP_INHERIT: callHelper(compiler, next, (const void*)jitInherit); break;
+
+        case OP_METHOD:
+            callHelper(compiler, next, (const void*)jitMethod, (uint64_t)(uintptr_t)names[code[1]]);
+            break;
+
+        default: return false;
+    }
+
+    return true;
+}
+
+bool compileJit(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    int    size  = (int)chunk->size();
+
+    JitCompiler compiler;
+    compiler.function    = function;
+    compiler.code        = chunk->code().data();
+    compiler.constants   = chunk->constants().data();
+    compiler.names       = chunk->names().data();
+    compiler.returnLabel   = compiler.as.newLabel();
+    compiler.errorLabel    = compiler.as.newLabel();
+    compiler.handOverLabel = compiler.as.newLabel();
+
+    // One label per offset, plus one for the end for instructions that
+    // fall through to the next.
+    for (int offset = 0; offset <= size; offset++)
+    {
+        compiler.labels.push_back(compiler.as.newLabel());
+    }
+
+    prologue(&compiler);
+    for (int offset = 0; offset < size;)
+    {
+        int next = offset + instructionLength(chunk, offset);
+        compiler.as.bind(compiler.labels[offset]);
+        if (!emitInstruction(&compiler, offset, next)) return false;
+        offset = next;
+    }
+
+    compiler.as.bind(compiler.labels[size]);
+    epilogue(&compiler);
+
+    std::vector<uint8_t>& machineCode = compiler.as.finish();
+
+    auto jitCode = std::make_unique<JitCode>(machineCode);
+    if (!jitCode->isValid()) return false;
+
+#ifdef DEBUG_PRINT_CODE
+    printf("== jit %s: %zu bytes ==\n", function->name->chars, machineCode.size());
+#endif
+
+    function->jitEntry = jitCode->entry();
+    function->jitCode  = std::move(jitCode);
+    return true;
+}
+
+// The tracing JIT. A hot loop is recorded while it runs one iteration; the
+// recording is a straight line through the loop body that follows the
+// branches the way they went. The compiled trace keeps every value in its
+// stack slot, so a guard that fails can hand the interpreter the exact
+// state it would have had at that instruction.
+
+#define JIT_MAX_ABORTS 4     // Failed recordings before a loop is left alone.
+#define JIT_MAX_TRACE  1000  // Longest trace, in instructions.
+
+// One recorded instruction.
+struct TraceStep
+{
+    uint8_t* ip;
+    int      depth;  // Values above frame->slots before the instruction.
+    bool     flag;   // Branches: whether it jumped. Property access: whether
+                     // it found a field. OP_ADD: whether it added numbers.
+                     // OP_NEW_SCALAR: whether the site's class filled the
+                     // field locals. OP_CALL: whether it called a closure.
+};
+
+struct Recorder
+{
+    ObjFunction*           function;
+    int                    frameIndex;  // Calls can move the frames.
+    uint8_t*               header;
+    uint8_t*               loop;
+    std::vector<TraceStep> steps;
+
+    const char* abortReason;
+    uint8_t*    resume;  // Where the interpreter carries on after an abort.
+    bool        error;
+};
+
+// A guard's way back to the interpreter.
+struct TraceExit
+{
+    int      label;
+    uint8_t* ip;
+    int      depth;
+};
+
+struct TraceCompiler
+{
+    JitCompiler            compiler;
+    std::vector<bool>      isNumber;  // Per stack slot, known from the trace so far.
+    std::vector<TraceExit> exits;
+};
+
+static LoopTrace* findTrace(ObjFunction* function, uint8_t* loop)
+{
+    for (LoopTrace& trace : function->traces)
+    {
+        if (trace.loop == loop) return &trace;
+    }
+
+    LoopTrace& trace = function->traces.emplace_back();
+    trace.loop       = loop;
+    return &trace;
+}
+
+static bool isFalsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static Value peek(int distance)
+{
+    return vm.stackTop[-1 - distance];
+}
+
+#define ABORT(reason)                         \
+    do                                        \
+    {                                         \
+        recorder->abortReason = (reason);     \
+        recorder->resume      = step->ip;     \
+        return false;                         \
+    } while (false)
+
+#define HELPER(call)                 \
+    do                               \
+    {                                \
+        if (!(call))                 \
+        {                            \
+            recorder->error = true;  \
+            return false;            \
+        }                            \
+    } while (false)
+
+// Executes the instruction at step->ip as run() would and fills in the
+// rest of the step. Returns false if recording has to stop: after a
+// runtime error, or with an abort reason, in which case the instruction
+// has not run.
+static bool recordInstruction(Recorder* recorder, TraceStep* step, uint8_t** next)
+{
+    CallFrame*  frame     = &vm.frames[recorder->frameIndex];
+    Chunk*      chunk     = &recorder->function->chunk;
+    Value*      constants = chunk->constants().data();
+    ObjString** names     = chunk->names().data();
+    Value*      slots     = frame->slots;
+    uint8_t*    ip        = step->ip;
+
+    *next     = ip + instructionLength(chunk, (int)(ip - chunk->code().data()));
+    frame->ip = *next;  // Where the helpers expect it.
+
+    switch (ip[0])
+    {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: push(constants[operand(ip, OP_CONSTANT_LONG)]); break;
+        case OP_NIL: push(NIL_VAL); break;
+        case OP_TRUE: push(TRUE_VAL); break;
+        case OP_FALSE: push(FALSE_VAL); break;
+        case OP_POP: pop(); break;
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG: push(slots[operand(ip, OP_GET_LOCAL_LONG)]); break;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG: slots[operand(ip, OP_SET_LOCAL_LONG)] = peek(0); break;
+
+        case OP_GET_LOCAL_CONSTANT:
+            push(slots[ip[1]]);
+            push(constants[ip[2]]);
+            break;
+
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        {
+            Value* global = &vm.globalValues[readShort(ip + 1)];
+            if (IS_UNDEFINED(*global)) ABORT("undefined variable");
+
+            if (ip[0] == OP_GET_GLOBAL)
+            {
+                push(*global);
+            }
+            else
+            {
+                *global = peek(0);
+            }
+            break;
+        }
+
+        case OP_DEFINE_GLOBAL: vm.globalValues[readShort(ip + 1)] = pop(); break;
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG: push(*frame->closure->upvalues[operand(ip, OP_GET_UPVALUE_LONG)]->location); break;
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG:
+        {
+            ObjUpvalue* upvalue = frame->closure->upvalues[operand(ip, OP_SET_UPVALUE_LONG)];
+            storeUpvalue(upvalue, peek(0));
+            writeBarrier((Obj*)upvalue);
+            break;
+        }
+
+        case OP_GET_PROPERTY:
+        case OP_GET_LOCAL_PROPERTY:
+        {
+            bool       isLocal  = ip[0] == OP_GET_LOCAL_PROPERTY;
+            Value      receiver = isLocal ? slots[ip[1]] : peek(0);
+            ObjString* name     = names[ip[isLocal ? 2 : 1]];
+            if (!IS_INSTANCE(receiver)) ABORT("property of a non-instance");
+
+            step->flag = tableGetEntry(&AS_INSTANCE(receiver)->fields, name) != nullptr;
+            if (isLocal) push(receiver);
+            HELPER(jitGetProperty(name, &chunk->propertyCaches()[readShort(ip + (isLocal ? 3 : 2))]));
+            break;
+        }
+
+        case OP_SET_PROPERTY:
+        {
+            ObjString* name = names[ip[1]];
+            if (!IS_INSTANCE(peek(1))) ABORT("property of a non-instance");
+
+            step->flag = tableGetEntry(&AS_INSTANCE(peek(1))->fields, name) != nullptr;
+            HELPER(jitSetProperty(name, &chunk->propertyCaches()[readShort(ip + 2)]));
+            break;
+        }
+
+        // Traces only follow instances replaced by their fields.
+        case OP_GET_SCALAR:
+            if (!IS_UNDEFINED(slots[ip[2]])) ABORT("instance not replaced by fields");
+            if (IS_UNDEFINED(slots[ip[1]])) ABORT("undefined property");
+            push(slots[ip[1]]);
+            break;
+
+        case OP_SET_SCALAR:
+        {
+            if (!IS_UNDEFINED(peek(1))) ABORT("instance not replaced by fields");
+
+            Value value     = pop();
+            slots[ip[1]]    = value;
+            vm.stackTop[-1] = value;  // Replace the instance.
+            break;
+        }
+
+        case OP_GET_SUPER: HELPER(jitGetSuper(names[ip[1]])); break;
+
+        case OP_EQUAL:
+        {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(valuesEqual(a, b)));
+            break;
+        }
+
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        {
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) ABORT("operands are not numbers");
+
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            switch (ip[0])
+            {
+                case OP_GREATER: push(BOOL_VAL(a > b)); break;
+                case OP_LESS: push(BOOL_VAL(a < b)); break;
+                case OP_SUBTRACT: push(NUMBER_VAL(a - b)); break;
+                case OP_MULTIPLY: push(NUMBER_VAL(a * b)); break;
+                default: push(NUMBER_VAL(a / b)); break;
+            }
+            break;
+        }
+
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            step->flag = IS_NUMBER(peek(0)) && IS_NUMBER(peek(1));
+            if (step->flag)
+            {
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a + b));
+            }
+            else
+            {
+                HELPER(jitAdd());
+            }
+            break;
+
+        case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
+
+        case OP_NEGATE:
+            if (!IS_NUMBER(peek(0))) ABORT("operand is not a number");
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            break;
+
+        case OP_PRINT: HELPER(jitPrint()); break;
+        case OP_JUMP: *next = ip + 3 + readShort(ip + 1); break;
+
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+            step->flag = isFalsey(peek(0));
+            if (ip[0] == OP_POP_JUMP_IF_FALSE) pop();
+            if (step->flag) *next = ip + 3 + readShort(ip + 1);
+            break;
+
+        case OP_LESS_JUMP_IF_FALSE:
+        {
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) ABORT("operands are not numbers");
+
+            double b   = AS_NUMBER(pop());
+            double a   = AS_NUMBER(pop());
+            step->flag = !(a < b);
+            if (step->flag) *next = ip + 3 + readShort(ip + 1);
+            break;
+        }
+
+        case OP_LOOP:
+        case OP_LOOP_TRACE:
+            // A for loop's increment clause jumps back to the condition,
+            // which comes before the header. Anything that jumps back into
+            // the body is a loop of its own.
+            *next = ip + 3 - readShort(ip + 1);
+            if (*next >= recorder->header) ABORT("inner loop");
+            break;
+
+        case OP_CALL:
+        case OP_CALL_CLOSURE:
+        case OP_CALL_NATIVE:
+            step->flag = IS_CLOSURE(peek(ip[1]));
+            HELPER(jitCall(ip[1]));
+            break;
+
+        case OP_NEW_SCALAR:
+        {
+            ScalarSite* site   = &chunk->scalarSites()[readShort(ip + 1)];
+            Value       callee = peek(ip[3]);
+            HELPER(jitNewScalar(site, ip[3]));
+            step->flag = IS_CLASS(callee) && AS_CLASS(callee) == site->klass;
+            break;
+        }
+
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        {
+            ObjString*   name  = names[ip[1]];
+            InvokeCache* cache = &chunk->invokeCaches()[readShort(ip + 3)];
+            HELPER(ip[0] == OP_INVOKE ? jitInvoke(name, ip[2], cache) : jitSuperInvoke(name, ip[2], cache));
+            break;
+        }
+
+        case OP_CLOSURE: HELPER(jitClosure(AS_FUNCTION(constants[ip[1]]), ip + 2, false)); break;
+        case OP_CLOSURE_LONG: HELPER(jitClosure(AS_FUNCTION(constants[readShort(ip + 1)]), ip + 3, true)); break;
+        case OP_CLOSE_UPVALUE: HELPER(jitCloseUpvalue()); break;
+
+        case OP_TAIL_CALL:
+        case OP_TAIL_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+        case OP_RETURN:
+        case OP_RETURN_NIL: ABORT("return from inside the loop");
+
+        default: ABORT("unsupported instruction");
+    }
+
+    if (*next > recorder->loop)
+    {
+        recorder->abortReason = "left the loop";
+        recorder->resume      = *next;
+        return false;
+    }
+
+    return true;
+}
+
+#undef ABORT
+#undef HELPER
+
+static int32_t slotOffset(int slot)
+{
+    return slot * (int32_t)sizeof(Value);
+}
+
+// Points SP at the top of the recorded stack, so the baseline templates
+// and their helpers can be reused.
+static void materializeStack(JitCompiler* compiler, int depth)
+{
+    compiler->as.mov(SP, SLOTS);
+    compiler->as.addImm(SP, slotOffset(depth));
+}
+
+// Returns the label of the side exit that resumes at `step`. Guards of the
+// same instruction share it.
+static int sideExit(TraceCompiler* trace, TraceStep* step)
+{
+    if (!trace->exits.empty() && trace->exits.back().ip == step->ip) return trace->exits.back().label;
+
+    int label = trace->compiler.as.newLabel();
+    trace->exits.push_back({label, step->ip, step->depth});
+    return label;
+}
+
+static void guardNumber(TraceCompiler* trace, TraceStep* step, int slot)
+{
+    if (trace->isNumber[slot]) return;
+
+    trace->compiler.as.load(RAX, SLOTS, slotOffset(slot));
+    jumpIfNotNumber(&trace->compiler, RAX, sideExit(trace, step));
+    trace->isNumber[slot] = true;
+}
+
+// Loads the operands of a binary instruction on numbers into xmm0 and xmm1.
+static void guardNumberOperands(TraceCompiler* trace, TraceStep* step)
+{
+    Assembler& as = trace->compiler.as;
+    guardNumber(trace, step, step->depth - 2);
+    guardNumber(trace, step, step->depth - 1);
+    as.load(RAX, SLOTS, slotOffset(step->depth - 2));
+    as.load(RCX, SLOTS, slotOffset(step->depth - 1));
+    as.toXmm(0, RAX);
+    as.toXmm(1, RCX);
+}
+
+static void storeConstant(TraceCompiler* trace, int slot, Value value)
+{
+    trace->compiler.as.movImm(RAX, value);
+    trace->compiler.as.store(SLOTS, slotOffset(slot), RAX);
+    trace->isNumber[slot] = IS_NUMBER(value);
+}
+
+static void copySlot(TraceCompiler* trace, int from, int to)
+{
+    trace->compiler.as.load(RAX, SLOTS, slotOffset(from));
+    trace->compiler.as.store(SLOTS, slotOffset(to), RAX);
+    trace->isNumber[to] = trace->isNumber[from];
+}
+
+// Side exits unless `slot` holds UNDEFINED_VAL, or unless it doesn't.
+static void guardUndefined(TraceCompiler* trace, TraceStep* step, int slot, bool isUndefined)
+{
+    Assembler& as = trace->compiler.as;
+    as.load(RAX, SLOTS, slotOffset(slot));
+    as.movImm(RCX, UNDEFINED_VAL);
+    as.cmp(RAX, RCX);
+    as.jcc(isUndefined ? CC_NE : CC_E, sideExit(trace, step));
+}
+
+// OP_NEW_SCALAR with the class it saw while recording: fills the field
+// locals straight from the arguments and the initializer's constants.
+static void emitNewScalar(TraceCompiler* trace, TraceStep* step)
+{
+    Assembler&  as       = trace->compiler.as;
+    ScalarSite* site     = &trace->compiler.function->chunk.scalarSites()[readShort(step->ip + 1)];
+    int         argCount = step->ip[3];
+    int         callee   = step->depth - argCount - 1;
+    int         count    = (int)site->fields.size();
+
+    as.load(RAX, SLOTS, slotOffset(callee));
+    as.movImm(RCX, OBJ_VAL(site->klass));
+    as.cmp(RAX, RCX);
+    as.jcc(CC_NE, sideExit(trace, step));
+
+    for (int i = 0; i < count; i++)
+    {
+        // The last store of the field wins, as it would in the instance.
+        const FieldInit* init = nullptr;
+        if (site->klass->initializer != nullptr)
+        {
+            for (const FieldInit& store : site->klass->initializer->function->fieldInits)
+            {
+                if (store.name == site->fields[i]) init = &store;
+            }
+        }
+
+        if (init == nullptr)
+        {
+            storeConstant(trace, callee - count + i, UNDEFINED_VAL);
+        }
+        else if (init->param != 0)
+        {
+            copySlot(trace, callee + init->param, callee - count + i);
+        }
+        else
+        {
+            storeConstant(trace, callee - count + i, init->constant);
+        }
+    }
+
+    storeConstant(trace, callee, UNDEFINED_VAL);
+}
+
+// Runs the baseline template of the step on a stack top made for the
+// occasion. It has no guards of its own and knows nothing about types.
+static void emitBaselineStep(TraceCompiler* trace, TraceStep* step, int depthAfter)
+{
+    JitCompiler* compiler    = &trace->compiler;
+    uint8_t      instruction = step->ip[0];
+    int          offset      = (int)(step->ip - compiler->code);
+
+    materializeStack(compiler, step->depth);
+    emitInstruction(compiler, offset, offset + instructionLength(&compiler->function->chunk, offset));
+
+    // Calls can run code that changes our locals through upvalues.
+    if (instruction == OP_CALL || instruction == OP_CALL_CLOSURE || instruction == OP_CALL_NATIVE ||
+        instruction == OP_INVOKE || instruction == OP_SUPER_INVOKE || instruction == OP_NEW_SCALAR)
+    {
+        trace->isNumber.assign(trace->isNumber.size(), false);
+    }
+    else if (depthAfter > 0)
+    {
+        trace->isNumber[depthAfter - 1] = false;
+    }
+}
+
+static void emitTraceStep(TraceCompiler* trace, TraceStep* step, int depthAfter)
+{
+    JitCompiler* compiler  = &trace->compiler;
+    Assembler&   as        = compiler->as;
+    uint8_t*     ip        = step->ip;
+    Value*       constants = compiler->constants;
+    ObjString**  names     = compiler->names;
+    int          depth     = step->depth;
+
+    switch (ip[0])
+    {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: storeConstant(trace, depth, constants[operand(ip, OP_CONSTANT_LONG)]); break;
+        case OP_NIL: storeConstant(trace, depth, NIL_VAL); break;
+        case OP_TRUE: storeConstant(trace, depth, TRUE_VAL); break;
+        case OP_FALSE: storeConstant(trace, depth, FALSE_VAL); break;
+        case OP_POP: break;
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG: copySlot(trace, operand(ip, OP_GET_LOCAL_LONG), depth); break;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG: copySlot(trace, depth - 1, operand(ip, OP_SET_LOCAL_LONG)); break;
+
+        case OP_GET_LOCAL_CONSTANT:
+            copySlot(trace, ip[1], depth);
+            storeConstant(trace, depth + 1, constants[ip[2]]);
+            break;
+
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        {
+            // Adding anything but numbers goes through the helper.
+            bool isAdd = ip[0] == OP_ADD || ip[0] == OP_ADD_NUM || ip[0] == OP_ADD_STR;
+            if (isAdd && !step->flag)
+            {
+                emitBaselineStep(trace, step, depthAfter);
+                break;
+            }
+
+            guardNumberOperands(trace, step);
+            switch (ip[0])
+            {
+                case OP_SUBTRACT: as.sse(0x5c); break;
+                case OP_MULTIPLY: as.sse(0x59); break;
+                case OP_DIVIDE: as.sse(0x5e); break;
+                default: as.sse(0x58); break;
+            }
+            as.fromXmm(RAX, 0);
+            as.store(SLOTS, slotOffset(depth - 2), RAX);
+            trace->isNumber[depth - 2] = true;
+            break;
+        }
+
+        case OP_GREATER:
+        case OP_LESS:
+            guardNumberOperands(trace, step);
+            if (ip[0] == OP_GREATER)
+            {
+                as.ucomisd(0, 1);
+            }
+            else
+            {
+                as.ucomisd(1, 0);
+            }
+            as.setcc(CC_A, RAX);
+            boolFromAl(compiler);
+            as.store(SLOTS, slotOffset(depth - 2), RAX);
+            trace->isNumber[depth - 2] = false;
+            break;
+
+        case OP_NEGATE:
+            guardNumber(trace, step, depth - 1);
+            as.load(RAX, SLOTS, slotOffset(depth - 1));
+            as.movImm(RCX, SIGN_BIT);
+            as.xorReg(RAX, RCX);
+            as.store(SLOTS, slotOffset(depth - 1), RAX);
+            break;
+
+        case OP_GET_PROPERTY:
+        case OP_GET_LOCAL_PROPERTY:
+        {
+            // A field was found while recording, so guard on the cache
+            // hitting. Methods take the baseline template.
+            if (!step->flag)
+            {
+                emitBaselineStep(trace, step, depthAfter);
+                break;
+            }
+
+            bool isLocal = ip[0] == OP_GET_LOCAL_PROPERTY;
+            int  slot    = isLocal ? depth : depth - 1;
+            as.load(RAX, SLOTS, slotOffset(isLocal ? ip[1] : depth - 1));
+            cachedEntry(compiler,
+                        names[ip[isLocal ? 2 : 1]],
+                        &compiler->function->chunk.propertyCaches()[readShort(ip + (isLocal ? 3 : 2))],
+                        sideExit(trace, step));
+            as.load(RAX, RDX, ENTRY_VALUE);
+            as.store(SLOTS, slotOffset(slot), RAX);
+            trace->isNumber[slot] = false;
+            break;
+        }
+
+        case OP_SET_PROPERTY:
+            if (!step->flag)
+            {
+                emitBaselineStep(trace, step, depthAfter);
+                break;
+            }
+
+            as.load(RAX, SLOTS, slotOffset(depth - 2));
+            cachedEntry(compiler,
+                        names[ip[1]],
+                        &compiler->function->chunk.propertyCaches()[readShort(ip + 2)],
+                        sideExit(trace, step),
+                        true);
+            as.load(RAX, SLOTS, slotOffset(depth - 1));
+            as.store(RDX, ENTRY_VALUE, RAX);
+            as.store(SLOTS, slotOffset(depth - 2), RAX);
+            trace->isNumber[depth - 2] = trace->isNumber[depth - 1];
+            break;
+
+        case OP_NEW_SCALAR:
+            if (step->flag)
+            {
+                emitNewScalar(trace, step);
+            }
+            else
+            {
+                emitBaselineStep(trace, step, depthAfter);
+            }
+            break;
+
+        case OP_GET_SCALAR:
+            guardUndefined(trace, step, ip[2], true);
+            if (!trace->isNumber[ip[1]]) guardUndefined(trace, step, ip[1], false);
+            copySlot(trace, ip[1], depth);
+            break;
+
+        case OP_SET_SCALAR:
+            guardUndefined(trace, step, depth - 2, true);
+            copySlot(trace, depth - 1, ip[1]);
+            copySlot(trace, depth - 1, depth - 2);
+            break;
+
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_LOOP_TRACE: break;
+
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        {
+            // Numbers are always true.
+            if (trace->isNumber[depth - 1]) break;
+
+            int exit = sideExit(trace, step);
+            as.load(RAX, SLOTS, slotOffset(depth - 1));
+            if (!step->flag)
+            {
+                jumpIfFalsey(compiler, exit);
+                break;
+            }
+
+            int falsey = as.newLabel();
+            jumpIfFalsey(compiler, falsey);
+            as.jmp(exit);
+            as.bind(falsey);
+            break;
+        }
+
+        case OP_LESS_JUMP_IF_FALSE:
+            guardNumberOperands(trace, step);
+            as.ucomisd(1, 0);
+            as.jcc(step->flag ? CC_A : CC_BE, sideExit(trace, step));
+            break;
+
+        // A site that called something other than a closure while it was
+        // recorded skips the checks for a direct call.
+        case OP_CALL:
+        case OP_CALL_CLOSURE:
+            if (step->flag)
+            {
+                emitBaselineStep(trace, step, depthAfter);
+                break;
+            }
+
+            materializeStack(compiler, depth);
+            helperCall(compiler, ip[1], (int)(ip - compiler->code) + 2);
+            trace->isNumber.assign(trace->isNumber.size(), false);  // As in emitBaselineStep().
+            break;
+
+        default: emitBaselineStep(trace, step, depthAfter); break;
+    }
+}
+
+static bool compileTrace(Recorder* recorder, LoopTrace* trace)
+{
+    ObjFunction* function = recorder->function;
+    Chunk*       chunk    = &function->chunk;
+
+    TraceCompiler tracer;
+    JitCompiler*  compiler = &tracer.compiler;
+    compiler->function     = function;
+    compiler->code         = chunk->code().data();
+    compiler->constants    = chunk->constants().data();
+    compiler->names        = chunk->names().data();
+    compiler->returnLabel   = compiler->as.newLabel();
+    compiler->errorLabel    = compiler->as.newLabel();
+    compiler->handOverLabel = compiler->as.newLabel();
+
+    int maxDepth = 0;
+    for (TraceStep& step : recorder->steps) maxDepth = std::max(maxDepth, step.depth);
+    tracer.isNumber.resize(maxDepth + 2);
+
+    Assembler& as    = compiler->as;
+    int        start = as.newLabel();
+    prologue(compiler);
+    as.bind(start);
+
+    // What's known about types holds for one iteration; the next one
+    // starts over.
+    std::vector<TraceStep>& steps = recorder->steps;
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        int depthAfter = i + 1 < steps.size() ? steps[i + 1].depth : steps[0].depth;
+        emitTraceStep(&tracer, &steps[i], depthAfter);
+    }
+
+    // The interpreter stops the script at the loop instruction, so that's
+    // where the trace leaves once the budget runs out.
+    int stop = as.newLabel();
+    tracer.exits.push_back({stop, recorder->loop, steps[0].depth});
+    checkBudget(compiler, stop);
+    as.jmp(start);
+
+    for (TraceExit& exit : tracer.exits)
+    {
+        as.bind(exit.label);
+        as.mov(RAX, SLOTS);
+        as.addImm(RAX, slotOffset(exit.depth));
+        as.store(VMR, STACK_TOP, RAX);
+        as.movAddress(RAX, exit.ip);
+        as.store(FRAME, FRAME_IP, RAX);
+        as.jmp(compiler->returnLabel);
+    }
+    epilogue(compiler);
+
+    std::vector<uint8_t>& machineCode = as.finish();
+
+    auto code = std::make_unique<JitCode>(machineCode);
+    if (!code->isValid()) return false;
+
+    trace->code = std::move(code);
+    return true;
+}
+
+#ifdef DEBUG_LOG_JIT
+static int lineOf(ObjFunction* function, uint8_t* ip)
+{
+    return function->chunk.lines()[ip - function->chunk.code().data()];
+}
+#endif
+
+bool recordTrace(CallFrame* frame, uint8_t* loop)
+{
+    ObjFunction* function = frame->closure->function;
+    LoopTrace*   trace    = findTrace(function, loop);
+    if (trace->aborts >= JIT_MAX_ABORTS) return true;
+
+    int      frameIndex = (int)(frame - vm.frames);
+    Recorder recorder{function, frameIndex, frame->ip, loop, {}, nullptr, nullptr, false};
+    for (uint8_t* ip = frame->ip; ip != loop;)
+    {
+        TraceStep step{ip, (int)(vm.stackTop - vm.frames[frameIndex].slots), false};
+        if (recorder.steps.size() == JIT_MAX_TRACE)
+        {
+            recorder.abortReason = "trace too long";
+            recorder.resume      = ip;
+            break;
+        }
+
+        if (!recordInstruction(&recorder, &step, &ip)) break;
+        recorder.steps.push_back(step);
+    }
+
+    if (recorder.error) return false;
+
+    // The iteration may have run code that recorded other loops of this
+    // function, or even this one, so look the trace up again.
+    frame = &vm.frames[frameIndex];
+    trace = findTrace(function, loop);
+    if (recorder.abortReason == nullptr)
+    {
+        frame->ip = recorder.header;
+        if (trace->code != nullptr) return true;
+        if (compileTrace(&recorder, trace))
+        {
+            *loop = OP_LOOP_TRACE;
+#ifdef DEBUG_LOG_JIT
+            printf("-- trace %s line %d: %zu instructions\n",
+                   function->name == nullptr ? "script" : function->name->chars,
+                   lineOf(function, recorder.header),
+                   recorder.steps.size());
+#endif
+            return true;
+        }
+
+        recorder.abortReason = "out of code memory";
+    }
+    else
+    {
+        frame->ip = recorder.resume;
+    }
+
+    trace->aborts++;
+#ifdef DEBUG_LOG_JIT
+    printf("-- trace %s line %d: aborted at line %d, %s\n",
+           function->name == nullptr ? "script" : function->name->chars,
+           lineOf(function, recorder.header),
+           lineOf(function, recorder.resume == nullptr ? recorder.header : recorder.resume),
+           recorder.abortReason);
+#endif
+    return true;
+}
+
+bool runTrace(CallFrame* frame, uint8_t* loop)
+{
+    return findTrace(frame->closure->function, loop)->code->run(frame);
+}
+
+#endif
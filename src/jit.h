@@ -0,0 +1,108 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+
+#ifdef JIT
+
+#include <cstddef>
+#include <memory>
+
+#include "chunk.h"
+#include "value.h"
+
+struct CallFrame;
+struct ObjClass;
+struct ObjFunction;
+struct ObjString;
+
+// Machine code for one function, made by the baseline JIT. The code is a
+// run of per-opcode templates: simple instructions work on the VM stack
+// directly, the rest call back into the runtime helpers below.
+class JitCode
+{
+private:
+    void*  m_code{nullptr};
+    size_t m_size{0};
+
+public:
+    explicit JitCode(const std::vector<uint8_t>& code) noexcept;
+    ~JitCode();
+
+    JitCode(const JitCode&)            = delete;
+    JitCode& operator=(const JitCode&) = delete;
+
+    [[nodiscard]] bool isValid() const noexcept;
+
+    // The machine code, which takes the frame to run as its one argument.
+    [[nodiscard]] const void* entry() const noexcept;
+
+    // Runs the function in `frame`, the top frame, until it returns. Leaves
+    // the result on the stack in place of the callee, as the interpreter
+    // does. Returns false after a runtime error.
+    bool run(CallFrame* frame) const noexcept;
+};
+
+// A loop the tracing JIT has tried to record, found by the address of the
+// OP_LOOP instruction that closes it.
+struct LoopTrace
+{
+    uint8_t*                 loop{nullptr};
+    int                      aborts{0};
+    std::unique_ptr<JitCode> code{};  // The compiled trace, if recording worked.
+};
+
+// Native stack left below the deepest compiled call, for the runtime and
+// the compiled code's own frames. See enterFrame().
+#define JIT_STACK_RESERVE (256 * 1024)
+
+// Loops are counted in a small table hashed by the loop header's address.
+#define HOT_LOOP_SLOTS 64
+#define HOT_LOOP(ip)   ((uintptr_t)(ip) & (HOT_LOOP_SLOTS - 1))
+
+// Called from OP_LOOP once a loop gets hot, with frame->ip at the loop
+// header. Executes one iteration while recording it, and compiles the
+// recording if the iteration made it back to `loop`. Either way frame->ip
+// and vm.stackTop are left where the interpreter should carry on. Returns
+// false after a runtime error.
+bool recordTrace(CallFrame* frame, uint8_t* loop);
+
+// Runs the compiled trace of `loop` until one of its guards fails, then
+// leaves frame->ip at the instruction the guard was protecting. Returns
+// false after a runtime error.
+bool runTrace(CallFrame* frame, uint8_t* loop);
+
+// Generates function->jitCode. Returns false if the function uses an
+// instruction the JIT doesn't handle.
+bool compileJit(ObjFunction* function);
+
+// Runtime helpers called from JIT code. They work on vm.stackTop and the
+// top frame, and return false after reporting a runtime error.
+bool jitError(const char* message);
+bool jitPreempt();
+bool jitUndefinedVariable(int slot);
+bool jitUndefinedProperty(ObjString* name);
+bool jitGetProperty(ObjString* name, PropertyCache* cache);
+bool jitSetProperty(ObjString* name, PropertyCache* cache);
+bool jitGetSuper(ObjString* name);
+bool jitAdd();
+bool jitPrint();
+bool jitCall(int argCount);
+bool jitResumeCall();
+bool jitNewScalar(ScalarSite* site, int argCount);
+bool jitTailCall(int argCount);
+bool jitInvoke(ObjString* name, int argCount, InvokeCache* cache);
+bool jitSuperInvoke(ObjString* name, int argCount, InvokeCache* cache);
+bool jitTailInvoke(ObjString* name, int argCount, InvokeCache* cache);
+bool jitTailSuperInvoke(ObjString* name, int argCount, InvokeCache* cache);
+bool jitClosure(ObjFunction* function, uint8_t* captures, bool wide);
+bool jitCloseUpvalue();
+bool jitRememberUpvalue(int index);
+bool jitReturn();
+bool jitClass(ObjString* name);
+bool jitInherit();
+bool jitMethod(ObjString* name);
+
+#endif
+
+#endif
@@ -1,12 +1,37 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <string>
 #include <iterator>
 #include <iostream>
 
+#include "memory.h"
 #include "vm.h"
 
+static bool gcStats = false;  // --gc-stats
+
+static void printPauses(const char* kind, const GcPauses& pauses)
+{
+    fprintf(stderr,
+            "%s collections: %zu, total %.3f ms, max %.3f ms\n",
+            kind,
+            pauses.count,
+            pauses.totalNs / 1e6,
+            pauses.maxNs / 1e6);
+}
+
+static void printGcStats()
+{
+    if (!gcStats) return;
+
+    printPauses("minor", vm.minorPauses);
+    printPauses("slice", vm.slicePauses);
+    printPauses("major", vm.majorPauses);
+    printPauses("sweep", vm.sweepPauses);
+    fprintf(stderr, "p99 pause: under %.3f ms\n", pausePercentile(0.99) / 1e6);
+}
+
 static void repl()
 {
     std::string line;
@@ -47,6 +72,7 @@ static void runFile(const char* path)
 {
     std::string     source = readFile(path);
     InterpretResult result = interpret(source);
+    printGcStats();
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
@@ -56,9 +82,52 @@ int main(int argc, const char* argv[])
 {
     initVM();
 
+    for (; argc > 1 && strncmp(argv[1], "--", 2) == 0; argc--, argv++)
+    {
+        if (strcmp(argv[1], "--register") == 0)
+        {
+            vm.engine = ENGINE_REGISTER;
+        }
+        else if (strcmp(argv[1], "--gc-stats") == 0)
+        {
+            gcStats = true;
+        }
+        else if (strcmp(argv[1], "--gc-slice") == 0 && argc > 2)
+        {
+            vm.sliceBudget = atoi(argv[2]);
+            argc--;
+            argv++;
+        }
+        else if (strcmp(argv[1], "--gc-pause") == 0 && argc > 2)
+        {
+            vm.pauseTarget = strtoull(argv[2], nullptr, 10) * 1000;  // Given in microseconds.
+            argc--;
+            argv++;
+        }
+        else if (strcmp(argv[1], "--gc-concurrent") == 0)
+        {
+#ifdef NAN_BOXING
+            vm.markConcurrently = true;
+#else
+            fprintf(stderr, "--gc-concurrent needs NAN_BOXING, see storeEntryValue().\n");
+#endif
+        }
+        else if (strcmp(argv[1], "--gc-threads") == 0 && argc > 2)
+        {
+            vm.markThreads = atoi(argv[2]);
+            argc--;
+            argv++;
+        }
+        else
+        {
+            break;
+        }
+    }
+
     if (argc == 1)
     {
         repl();
+        printGcStats();
     }
     else if (argc == 2)
     {
@@ -66,7 +135,7 @@ int main(int argc, const char* argv[])
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--register] [--gc-stats] [--gc-slice objects] [--gc-pause microseconds] [--gc-concurrent] [--gc-threads count] [path]\n");
         exit(64);
     }
 
@@ -1,4 +1,14 @@
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <climits>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "compiler.h"
 #include "memory.h"
@@ -11,21 +21,82 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize)
-{
-    vm.bytesAllocated += newSize - oldSize;
+static void startMarking();
+static void markSlice(int budget);
+static void pollMarker();
+static void sweepChunk();
 
-    if (newSize > oldSize)
+// Frees `pointer` once marking is over, and moves its contents to a new
+// block if it is only being resized.
+static void* retireBlock(void* pointer, size_t oldSize, size_t newSize)
+{
+    if (vm.retiredCapacity < vm.retiredCount + 1)
     {
+        vm.retiredCapacity = GROW_CAPACITY(vm.retiredCapacity);
+        vm.retired         = (void**)realloc(vm.retired, sizeof(void*) * vm.retiredCapacity);
+
+        if (vm.retired == nullptr) exit(1);
+    }
+
+    vm.retired[vm.retiredCount++] = pointer;
+    if (newSize == 0) return nullptr;
+
+    void* result = malloc(newSize);
+    if (result == nullptr) exit(1);
+    memcpy(result, pointer, std::min(oldSize, newSize));
+    return result;
+}
+
+// Does whatever collecting is due once memory has been allocated.
+static void collectIfDue()
+{
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+    // Mostly minor collections and small slices of major ones, which also
+    // put the write barriers to the test.
+    static int stressCount = 0;
+    if (vm.gcPhase == GC_MARKING)
+    {
+        markSlice(4);
+    }
+    else if (vm.gcPhase == GC_CONCURRENT)
+    {
+        pollMarker();
+    }
+    else if (++stressCount % 16 == 0)
+    {
+        startMarking();
+    }
+    else
+    {
+        collectYoung();
+    }
 #endif
 
-        if (vm.bytesAllocated > vm.nextGC)
-        {
-            collectGarbage();
-        }
+    if (vm.gcPhase == GC_MARKING)
+    {
+        if (vm.bytesAllocated > vm.nextSlice) markSlice(vm.sliceBudget);
+    }
+    else if (vm.gcPhase == GC_CONCURRENT)
+    {
+        if (vm.bytesAllocated > vm.nextSlice) pollMarker();
+    }
+    else if (vm.bytesAllocated > vm.nextGC)
+    {
+        startMarking();
+    }
+    else if (vm.bytesAllocated > vm.nurseryLimit)
+    {
+        collectYoung();
     }
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+{
+    vm.bytesAllocated += newSize - oldSize;
+    if (newSize > oldSize) collectIfDue();
+
+    // The helper thread may be reading the old block.
+    if (vm.gcPhase == GC_CONCURRENT && pointer != nullptr) return retireBlock(pointer, oldSize, newSize);
 
     if (newSize == 0)
     {
@@ -38,10 +109,78 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
     return result;
 }
 
+// The size class of an object of `size` bytes, which is past the last one
+// for objects too big to keep cells of.
+static size_t cellClass(size_t size)
+{
+    return (size - 1) / GC_CELL_BYTES;
+}
+
+void* allocateCell(size_t size)
+{
+    vm.bytesAllocated += size;
+    collectIfDue();
+
+    size_t sizeClass = cellClass(size);
+    if (sizeClass < GC_CELL_CLASSES)
+    {
+        // The dead objects of the last major collection are only freed once
+        // there is a need for their cells.
+        if (vm.freeCells[sizeClass] == nullptr) sweepChunk();
+
+        void* cell = vm.freeCells[sizeClass];
+        if (cell != nullptr)
+        {
+            vm.freeCells[sizeClass] = *(void**)cell;
+            return cell;
+        }
+        size = (sizeClass + 1) * GC_CELL_BYTES;
+    }
+
+    void* cell = malloc(size);
+    if (cell == nullptr) exit(1);
+    return cell;
+}
+
+void freeCell(void* cell, size_t size)
+{
+    vm.bytesAllocated -= size;
+
+    size_t sizeClass = cellClass(size);
+    if (sizeClass >= GC_CELL_CLASSES)
+    {
+        free(cell);
+        return;
+    }
+
+    *(void**)cell           = vm.freeCells[sizeClass];
+    vm.freeCells[sizeClass] = cell;
+}
+
+// One of the threads tracing the heap in parallel. Each blackens the
+// objects on its own gray stack, and when others are idle, moves half of
+// them to its shared stack for those to steal.
+struct MarkWorker
+{
+    std::vector<Obj*>   gray;
+    std::mutex          lock;  // Guards `shared`.
+    std::vector<Obj*>   shared;
+    std::atomic<size_t> sharedCount{0};  // For a quick look without the lock.
+};
+
+// The worker the current thread is, while tracing in parallel.
+static thread_local MarkWorker* markWorker = nullptr;
+
 void markObject(Obj* object)
 {
     if (object == nullptr) return;
-    if (object->isMarked) return;
+
+    // Other threads may be setting mark bits at the same time.
+    std::atomic_ref isMarked(object->isMarked);
+    if (isMarked.load(std::memory_order_relaxed)) return;
+
+    // A minor collection leaves the old generation be.
+    if (object->isOld && vm.collectingYoung) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -49,7 +188,19 @@ void markObject(Obj* object)
     printf("\n");
 #endif
 
-    object->isMarked = true;
+    if (markWorker == nullptr)
+    {
+        grayObject(object);
+    }
+    else if (!isMarked.exchange(true, std::memory_order_relaxed))
+    {
+        markWorker->gray.push_back(object);
+    }
+}
+
+void grayObject(Obj* object)
+{
+    std::atomic_ref(object->isMarked).store(true, std::memory_order_relaxed);
 
     if (vm.grayCapacity < vm.grayCount + 1)
     {
@@ -62,6 +213,36 @@ void markObject(Obj* object)
     vm.grayStack[vm.grayCount++] = object;
 }
 
+void rememberObject(Obj* object)
+{
+    // Barriers run in the middle of stores, so this mustn't collect.
+    if (vm.rememberedCapacity < vm.rememberedCount + 1)
+    {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered         = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+
+        if (vm.remembered == nullptr) exit(1);
+    }
+
+    object->isRemembered                = true;
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+void markNewObject(Obj* object)
+{
+    // The helper thread owns the gray stack, so it gets the object when
+    // the remembered ones are handed to it, or the last pause does.
+    if (vm.gcPhase == GC_CONCURRENT)
+    {
+        std::atomic_ref(object->isMarked).store(true, std::memory_order_relaxed);
+        rememberObject(object);
+    }
+    else
+    {
+        grayObject(object);
+    }
+}
+
 void markValue(Value value)
 {
     if (!IS_OBJ(value)) return;
@@ -76,6 +257,14 @@ static void markArray(ValueArray* array)
     }
 }
 
+// Reads a field the program may be storing to while the helper thread
+// marks, which the program does with a release store.
+template <typename T>
+static T acquire(T& field)
+{
+    return std::atomic_ref(field).load(std::memory_order_acquire);
+}
+
 static void blackenObject(Obj* object)
 {
 #ifdef DEBUG_LOG_GC
@@ -98,7 +287,15 @@ static void blackenObject(Obj* object)
         {
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name);
-            markTable(&klass->methods);
+            markObject((Obj*)acquire(klass->initializer));
+
+            // See addMethod().
+            int          methodCount = acquire(klass->methodCount);
+            ClassMethod* methods     = acquire(klass->methods);
+            for (int i = 0; i < methodCount; i++)
+            {
+                markObject((Obj*)acquire(methods[i].closure));
+            }
             break;
         }
 
@@ -108,7 +305,16 @@ static void blackenObject(Obj* object)
             markObject((Obj*)closure->function);
             for (int i = 0; i < closure->upvalueCount; i++)
             {
-                markObject((Obj*)closure->upvalues[i]);
+                // See copyCapture().
+                ObjUpvalue* upvalue = acquire(closure->upvalues[i]);
+                if (isCell(closure, upvalue))
+                {
+                    markValue(upvalue->closed);
+                }
+                else
+                {
+                    markObject((Obj*)upvalue);
+                }
             }
             break;
         }
@@ -117,7 +323,30 @@ static void blackenObject(Obj* object)
         {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
+            markObject((Obj*)acquire(function->closure));
             markArray(&function->chunk.constants());
+            for (ObjString* name : function->chunk.names()) markObject((Obj*)name);
+            for (PropertyCache& cache : function->chunk.propertyCaches())
+            {
+                markObject((Obj*)acquire(cache.klass));
+                markObject((Obj*)acquire(cache.method));
+            }
+
+            for (InvokeCache& cache : function->chunk.invokeCaches())
+            {
+                int count = acquire(cache.count);
+                for (int i = 0; i < count; i++)
+                {
+                    markObject((Obj*)cache.klasses[i]);
+                    markObject((Obj*)cache.methods[i]);
+                }
+            }
+
+            for (ScalarSite& site : function->chunk.scalarSites())
+            {
+                for (ObjString* field : site.fields) markObject((Obj*)field);
+                markObject((Obj*)acquire(site.klass));
+            }
             break;
         }
 
@@ -129,9 +358,9 @@ static void blackenObject(Obj* object)
             break;
         }
 
-        case OBJ_UPVALUE: markValue(((ObjUpvalue*)object)->closed); break;
+        case OBJ_UPVALUE: markValue(acquire(((ObjUpvalue*)object)->closed)); break;
 
-        case OBJ_NATIVE:
+        case OBJ_NATIVE: markObject((Obj*)((ObjNative*)object)->name); break;
         case OBJ_STRING: break;
     }
 }
@@ -149,7 +378,8 @@ static void freeObject(Obj* object)
         case OBJ_CLASS:
         {
             ObjClass* klass = (ObjClass*)object;
-            freeTable(&klass->methods);
+            removeMethods(klass);
+            FREE_ARRAY(ClassMethod, klass->methods, klass->methodCapacity);
             FREE(ObjClass, object);
             break;
         }  // [braces]
@@ -158,6 +388,7 @@ static void freeObject(Obj* object)
         {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
+            if (closure->cells != nullptr) FREE_ARRAY(ObjUpvalue, closure->cells, closure->upvalueCount);
             FREE(ObjClosure, object);
             break;
         }
@@ -204,18 +435,167 @@ static void markRoots()
         markObject((Obj*)vm.frames[i].closure);
     }
 
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != nullptr; upvalue = upvalue->next)
+    for (int i = 0; i < vm.openUpvalueTop; i++)
+    {
+        markObject((Obj*)vm.openUpvalues[i]);
+    }
+
+    markTable(&vm.globalSlots);
+    for (int i = 0; i < vm.globalCount; i++)
+    {
+        markValue(vm.globalValues[i]);
+    }
+
+    for (int i = 0; i < vm.selectorCount; i++)
     {
-        markObject((Obj*)upvalue);
+        markObject((Obj*)vm.selectors[i]);
     }
 
-    markTable(&vm.globals);
     markCompilerRoots();
     markObject((Obj*)vm.initString);
 }
 
+// A worker with more gray objects than this shares some if others are
+// idle.
+#define GC_SHARE_THRESHOLD 32
+
+// Made once and never freed: the helper thread may still be tracing when
+// the program exits after a runtime error.
+static MarkWorker*           markWorkers = nullptr;
+static int                   roundWorkers;  // Workers taking part in this round.
+static std::atomic<int>      idleWorkers;
+static std::atomic<int>      busyHelpers;  // Helper threads yet to finish this round.
+static std::atomic<unsigned> markRound{0};
+static int                   helperCount = 0;
+
+static void shareGray(MarkWorker* self)
+{
+    size_t half = self->gray.size() / 2;
+
+    std::lock_guard guard(self->lock);
+    self->shared.insert(self->shared.end(), self->gray.begin(), self->gray.begin() + half);
+    self->gray.erase(self->gray.begin(), self->gray.begin() + half);
+    self->sharedCount.store(self->shared.size(), std::memory_order_relaxed);
+}
+
+// Moves half of the objects `victim` shares, rounding up, to `self`.
+static bool stealGray(MarkWorker* self, MarkWorker* victim)
+{
+    if (victim->sharedCount.load(std::memory_order_relaxed) == 0) return false;
+
+    std::lock_guard guard(victim->lock);
+    size_t count = victim->shared.size();
+    if (count == 0) return false;
+
+    size_t take = (count + 1) / 2;
+    self->gray.insert(self->gray.end(), victim->shared.end() - take, victim->shared.end());
+    victim->shared.resize(count - take);
+    victim->sharedCount.store(count - take, std::memory_order_relaxed);
+    return true;
+}
+
+// Finds `self` more gray objects, its own shared ones first. Returns false
+// once every worker is out of them. A worker only goes idle with nothing
+// left to share, and only busy ones share, so that is when all are idle.
+static bool findGray(MarkWorker* self, int index)
+{
+    for (;;)
+    {
+        for (int i = 0; i < roundWorkers; i++)
+        {
+            if (stealGray(self, &markWorkers[(index + i) % roundWorkers])) return true;
+        }
+
+        idleWorkers.fetch_add(1, std::memory_order_acq_rel);
+        for (bool found = false; !found;)
+        {
+            if (idleWorkers.load(std::memory_order_acquire) == roundWorkers) return false;
+
+            std::this_thread::yield();
+            for (int i = 0; i < roundWorkers && !found; i++)
+            {
+                found = markWorkers[i].sharedCount.load(std::memory_order_relaxed) > 0;
+            }
+        }
+        idleWorkers.fetch_sub(1, std::memory_order_acq_rel);
+    }
+}
+
+static void traceAsWorker(int index)
+{
+    MarkWorker* self = &markWorkers[index];
+    markWorker       = self;
+    do
+    {
+        while (!self->gray.empty())
+        {
+            Obj* object = self->gray.back();
+            self->gray.pop_back();
+            blackenObject(object);
+
+            if (self->gray.size() > GC_SHARE_THRESHOLD && self->sharedCount.load(std::memory_order_relaxed) == 0 &&
+                idleWorkers.load(std::memory_order_relaxed) > 0)
+            {
+                shareGray(self);
+            }
+        }
+    } while (findGray(self, index));
+    markWorker = nullptr;
+}
+
+// Helper threads wait for the next round, then take part if there are
+// workers enough for them. They are never stopped.
+static void markHelper(int index, unsigned round)
+{
+    for (;;)
+    {
+        markRound.wait(round, std::memory_order_acquire);
+        round = markRound.load(std::memory_order_acquire);
+        if (index < roundWorkers) traceAsWorker(index);
+
+        busyHelpers.fetch_sub(1, std::memory_order_release);
+        busyHelpers.notify_one();
+    }
+}
+
+// Traces from the gray stack with vm.markThreads workers, the calling
+// thread being the first. How pauses scale with the thread count is
+// unmeasured: it has only been run on a single core, where extra workers
+// take turns and make pauses no shorter.
+static void traceInParallel()
+{
+    if (markWorkers == nullptr) markWorkers = new MarkWorker[GC_MAX_MARK_THREADS];
+
+    int workers = std::min(vm.markThreads, GC_MAX_MARK_THREADS);
+    for (; helperCount < workers - 1; helperCount++)
+    {
+        std::thread(markHelper, helperCount + 1, markRound.load(std::memory_order_relaxed)).detach();
+    }
+
+    markWorkers[0].gray.assign(vm.grayStack, vm.grayStack + vm.grayCount);
+    vm.grayCount = 0;
+
+    roundWorkers = workers;
+    idleWorkers.store(0, std::memory_order_relaxed);
+    busyHelpers.store(helperCount, std::memory_order_relaxed);
+    markRound.fetch_add(1, std::memory_order_release);
+    markRound.notify_all();
+
+    traceAsWorker(0);
+    for (int busy; (busy = busyHelpers.load(std::memory_order_acquire)) != 0;)
+    {
+        busyHelpers.wait(busy, std::memory_order_acquire);
+    }
+}
+
 static void traceReferences()
 {
+    if (vm.markThreads > 1)
+    {
+        traceInParallel();
+        return;
+    }
+
     while (vm.grayCount > 0)
     {
         Obj* object = vm.grayStack[--vm.grayCount];
@@ -223,49 +603,262 @@ static void traceReferences()
     }
 }
 
-static void sweep()
+// Ends a major collection by moving both generations, marks and all, to
+// vm.unswept, for allocations to sweep a chunk at a time. Until then, the
+// live objects there stay marked, which minor collections take to mean
+// traced already. That is only so of old objects, whose stores are
+// remembered, so the young ones are made old here.
+static void startSweeping()
 {
-    Obj* previous = nullptr;
-    Obj* object   = vm.objects;
-    while (object != nullptr)
+    Obj* last = nullptr;
+    for (Obj* object = vm.youngObjects; object != nullptr; object = object->next)
     {
+        object->isOld = true;
+        last          = object;
+    }
+
+    if (last != nullptr)
+    {
+        last->next      = vm.objects;
+        vm.objects      = vm.youngObjects;
+        vm.youngObjects = nullptr;
+    }
+
+    vm.unswept = vm.objects;
+    vm.objects = nullptr;
+}
+
+// Frees up to `count` unmarked objects off vm.unswept, and moves the
+// marked ones back to vm.objects.
+static void sweep(size_t count)
+{
+    for (; count > 0 && vm.unswept != nullptr; count--)
+    {
+        Obj* object = vm.unswept;
+        vm.unswept  = object->next;
         if (object->isMarked)
         {
             object->isMarked = false;
-            previous         = object;
-            object           = object->next;
+            object->next     = vm.objects;
+            vm.objects       = object;
         }
         else
         {
-            Obj* unreached = object;
-            object         = object->next;
-            if (previous != nullptr)
-            {
-                previous->next = object;
-            }
-            else
-            {
-                vm.objects = object;
-            }
+            freeObject(object);
+        }
+    }
+}
 
-            freeObject(unreached);
+// Frees the young objects nothing reached and promotes the rest, in
+// place, to the old generation.
+static void sweepYoung()
+{
+    Obj* object = vm.youngObjects;
+    while (object != nullptr)
+    {
+        Obj* next = object->next;
+        if (object->isMarked)
+        {
+            object->isMarked = false;
+            object->isOld    = true;
+            object->next     = vm.objects;
+            vm.objects       = object;
+        }
+        else
+        {
+            freeObject(object);
         }
+        object = next;
     }
+
+    vm.youngObjects = nullptr;
 }
 
-void collectGarbage()
+static void forgetRemembered()
+{
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        vm.remembered[i]->isRemembered = false;
+    }
+
+    vm.rememberedCount = 0;
+}
+
+// The nursery grows with the heap: a small one promotes most of whatever
+// big structure is being built when it fills up.
+static void resetNursery()
+{
+    vm.nurseryLimit = vm.bytesAllocated + std::max((size_t)GC_NURSERY_SIZE, vm.nextGC / 4);
+}
+
+static uint64_t nanosecondsSince(std::chrono::steady_clock::time_point start)
+{
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+// The bucket of vm.pauseHistogram for a pause of `ns`: the top four bits
+// of the duration pick it.
+static int pauseBucket(uint64_t ns)
+{
+    if (ns < 8) return (int)ns;
+
+    int exponent = (int)std::bit_width(ns) - 1;
+    return (exponent - 2) * 8 + (int)((ns >> (exponent - 3)) & 7);
+}
+
+// The shortest pause too long for `bucket`.
+static uint64_t bucketEnd(int bucket)
+{
+    if (bucket < 8) return (uint64_t)bucket + 1;
+
+    int exponent = bucket / 8 + 2;
+    return (uint64_t)(8 + bucket % 8 + 1) << (exponent - 3);
+}
+
+static void recordPause(GcPauses* pauses, std::chrono::steady_clock::time_point start)
+{
+    uint64_t ns = nanosecondsSince(start);
+    pauses->count++;
+    pauses->totalNs += ns;
+    pauses->maxNs = std::max(pauses->maxNs, ns);
+    vm.pauseHistogram[pauseBucket(ns)]++;
+}
+
+uint64_t pausePercentile(double fraction)
+{
+    size_t total = 0;
+    for (size_t count : vm.pauseHistogram) total += count;
+    if (total == 0) return 0;
+
+    size_t wanted = std::max((size_t)1, (size_t)(fraction * (double)total + 0.5));
+    size_t seen   = 0;
+    for (int bucket = 0; bucket < GC_PAUSE_BUCKETS; bucket++)
+    {
+        seen += vm.pauseHistogram[bucket];
+        if (seen >= wanted) return bucketEnd(bucket);
+    }
+
+    return bucketEnd(GC_PAUSE_BUCKETS - 1);
+}
+
+// Collects only the objects allocated since the last collection. The
+// survivors are promoted, so the young generation is empty afterwards.
+// Objects can't move, as the runtime and compiled code hold raw pointers
+// to them, so the generations are lists rather than spaces.
+void collectYoung()
 {
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    printf("-- minor gc begin\n");
     size_t before = vm.bytesAllocated;
 #endif
 
+    auto start         = std::chrono::steady_clock::now();
+    vm.collectingYoung = true;
+
+    markRoots();
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        blackenObject(vm.remembered[i]);
+    }
+    forgetRemembered();
+
+    traceReferences();
+    tableRemoveWhite(&vm.strings);
+    sweepYoung();
+
+    vm.collectingYoung = false;
+    resetNursery();
+    recordPause(&vm.minorPauses, start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zd bytes (from %zd to %zd) next at %zd\n",
+           before - vm.bytesAllocated,
+           before,
+           vm.bytesAllocated,
+           vm.nurseryLimit);
+#endif
+}
+
+// Sweeps the next chunk of vm.unswept. With none left, the size of the
+// live heap is known, and the next major collection is scheduled by it.
+static void sweepChunk()
+{
+    if (vm.unswept == nullptr) return;
+
+    auto start = std::chrono::steady_clock::now();
+    sweep(GC_SWEEP_CHUNK);
+    if (vm.unswept == nullptr) vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    recordPause(&vm.sweepPauses, start);
+}
+
+// Set by the helper thread once it runs out of gray objects.
+static std::atomic<bool> markerDone{true};
+
+// How many objects were remembered when the helper thread was last given
+// them to blacken.
+static int lastHandoff;
+
+// Drains the gray stack on a helper thread, which owns it until
+// joinMarker(). The thread is detached so that exiting on a runtime error
+// doesn't wait for it.
+static void startMarker()
+{
+    markerDone.store(false, std::memory_order_relaxed);
+    std::thread([] {
+        traceReferences();
+        markerDone.store(true, std::memory_order_release);
+        markerDone.notify_one();
+    }).detach();
+}
+
+static void joinMarker()
+{
+    markerDone.wait(false, std::memory_order_acquire);
+}
+
+static void freeRetired()
+{
+    for (int i = 0; i < vm.retiredCount; i++)
+    {
+        free(vm.retired[i]);
+    }
+
+    vm.retiredCount = 0;
+}
+
+// The last pause of a major collection. Marks what the roots, which
+// change without barriers, and the objects stored into while marking lead
+// to, then sweeps.
+static void finishMarking(std::chrono::steady_clock::time_point start)
+{
+    joinMarker();
+    vm.gcPhase = GC_MARKING;
+    freeRetired();
+
     markRoots();
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        // The unmarked ones are traced if anything reaches them.
+        if (vm.remembered[i]->isMarked) blackenObject(vm.remembered[i]);
+    }
     traceReferences();
     tableRemoveWhite(&vm.strings);
-    sweep();
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+#ifdef DEBUG_LOG_GC
+    size_t before = vm.bytesAllocated;
+#endif
+
+    // Every old object is traced, and some of the remembered ones are
+    // about to be freed.
+    forgetRemembered();
+    startSweeping();
+
+    vm.gcPhase = GC_IDLE;
+    vm.nextGC  = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    resetNursery();
+    recordPause(&vm.majorPauses, start);
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -277,15 +870,152 @@ void collectGarbage()
 #endif
 }
 
-void freeObjects()
+// Starts a major collection by marking the roots. The rest of the heap is
+// marked while the program runs, a slice at a time or on the helper
+// thread, and is kept from losing anything by the write barrier. Objects
+// allocated meanwhile start out marked, so they live through the
+// collection.
+static void startMarking()
+{
+    if (vm.sliceBudget <= 0)
+    {
+        collectGarbage();
+        return;
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+
+    // What is left of the last sweep goes first: its marks would pass for
+    // this collection's.
+    auto start = std::chrono::steady_clock::now();
+    sweep(SIZE_MAX);
+
+    vm.gcPhase = GC_MARKING;
+    markRoots();
+
+    // The compiler grows the arrays of its functions as it goes, which the
+    // helper thread can't be reading.
+    if (vm.markConcurrently && !isCompiling())
+    {
+        vm.gcPhase  = GC_CONCURRENT;
+        lastHandoff = INT_MAX;
+        startMarker();
+    }
+
+    vm.nextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+    recordPause(&vm.slicePauses, start);
+}
+
+// Blackens up to `budget` gray objects, fewer if vm.pauseTarget runs out
+// first, and finishes the collection once there are none left.
+static void markSlice(int budget)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int work = 0; vm.grayCount > 0 && work < budget; work++)
+    {
+        blackenObject(vm.grayStack[--vm.grayCount]);
+
+        // Reading the clock costs more than blackening an object.
+        if (vm.pauseTarget != 0 && work % 64 == 63 && nanosecondsSince(start) > vm.pauseTarget) break;
+    }
+
+    vm.nextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+
+    // Marking that can't keep up with the program is finished in one
+    // pause before the heap grows too far.
+    if (vm.grayCount == 0 || vm.bytesAllocated > vm.nextGC * GC_HEAP_GROW_FACTOR)
+    {
+        finishMarking(start);
+    }
+    else
+    {
+        recordPause(&vm.slicePauses, start);
+    }
+}
+
+// Checks on the helper thread. Once it runs out of gray objects, it gets
+// the marked objects stored into meanwhile to blacken, for as long as
+// there are fewer of those each time. Otherwise, or if there are few
+// enough for one short pause, or the compiler is running, the last pause
+// blackens them.
+static void pollMarker()
+{
+    vm.nextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+
+    // Marking that can't keep up with the program is waited for before the
+    // heap grows too far.
+    bool behind = vm.bytesAllocated > vm.nextGC * GC_HEAP_GROW_FACTOR;
+    if (!behind && !markerDone.load(std::memory_order_acquire)) return;
+
+    auto start = std::chrono::steady_clock::now();
+    if (behind || isCompiling() || vm.rememberedCount <= vm.sliceBudget || vm.rememberedCount >= lastHandoff)
+    {
+        finishMarking(start);
+        return;
+    }
+
+    joinMarker();
+    freeRetired();
+    lastHandoff = vm.rememberedCount;
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        Obj* object          = vm.remembered[i];
+        object->isRemembered = false;
+        if (object->isMarked) grayObject(object);
+    }
+    vm.rememberedCount = 0;
+
+    startMarker();
+    recordPause(&vm.slicePauses, start);
+}
+
+void collectGarbage()
+{
+    auto start = std::chrono::steady_clock::now();
+    if (vm.gcPhase == GC_IDLE)
+    {
+#ifdef DEBUG_LOG_GC
+        printf("-- gc begin\n");
+#endif
+        sweep(SIZE_MAX);  // See startMarking().
+    }
+
+    finishMarking(start);
+}
+
+static void freeList(Obj* object)
 {
-    Obj* object = vm.objects;
     while (object != nullptr)
     {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
+}
+
+void freeObjects()
+{
+    joinMarker();
+    vm.gcPhase = GC_IDLE;
+    freeRetired();
+
+    freeList(vm.objects);
+    freeList(vm.youngObjects);
+    freeList(vm.unswept);
+
+    for (void* cell : vm.freeCells)
+    {
+        while (cell != nullptr)
+        {
+            void* next = *(void**)cell;
+            free(cell);
+            cell = next;
+        }
+    }
 
     free(vm.grayStack);
+    free(vm.remembered);
+    free(vm.retired);
 }
@@ -5,6 +5,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) (type*)reallocate(nullptr, 0, sizeof(type) * (count))
 
@@ -12,9 +13,25 @@
     do                                         \
     {                                          \
         std::destroy_at<type>((type*)pointer); \
-        reallocate(pointer, sizeof(type), 0);  \
+        freeCell(pointer, sizeof(type));       \
     } while (false)
 
+// The fewest bytes allocated between minor collections.
+#define GC_NURSERY_SIZE (256 * 1024)
+
+// While a major collection marks, a slice of it runs each time this many
+// bytes are allocated, blackening up to vm.sliceBudget gray objects. When
+// the helper thread marks, that is when the program checks on it.
+#define GC_SLICE_BYTES  (64 * 1024)
+#define GC_SLICE_BUDGET 4096
+
+// After a major collection, an allocation that finds no free cell of its
+// size sweeps this many objects first.
+#define GC_SWEEP_CHUNK 256
+
+// The most threads that may trace the heap together.
+#define GC_MAX_MARK_THREADS 64
+
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity)*2)
 
 #define GROW_ARRAY(type, pointer, oldCount, newCount) \
@@ -23,9 +40,32 @@
 #define FREE_ARRAY(type, pointer, oldCount) reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateCell(size_t size);  // The memory for a new object.
+void  freeCell(void* cell, size_t size);
 void  markObject(Obj* object);
+void  grayObject(Obj* object);     // Marks `object` without looking at it.
+void  markNewObject(Obj* object);  // Keeps an object allocated while marking alive.
 void  markValue(Value value);
-void  collectGarbage();
+void  rememberObject(Obj* object);
+void  collectYoung();
+void  collectGarbage();  // A whole major collection, or the rest of one, in one pause.
 void  freeObjects();
 
+// The pause time, in nanoseconds, that `fraction` of all pauses are
+// shorter than, to within an eighth.
+uint64_t pausePercentile(double fraction);
+
+// Call after storing a value into `object`. A minor collection only
+// traces old objects that are remembered, so an old object has to be
+// before it can hold the only reference to a young one. Likewise, any
+// object stored into while a major collection marks is traced again at
+// its end if it was marked already. That goes by the phase rather than
+// the object's mark, which the helper thread may be setting. Objects are
+// remembered whatever was stored, which keeps the check in compiled code
+// to a few flags.
+static inline void writeBarrier(Obj* object)
+{
+    if (!object->isRemembered && (object->isOld || vm.gcPhase != GC_IDLE)) rememberObject(object);
+}
+
 #endif
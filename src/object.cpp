@@ -13,13 +13,19 @@
 template<typename T>
 static Obj* allocateObject(size_t size, ObjType type)
 {
-    T*   tmp         = (T*)reallocate(nullptr, 0, size);
-    Obj* object      = (Obj*)std::construct_at<T>(tmp);
-    object->type     = type;
-    object->isMarked = false;
+    T*   tmp             = (T*)allocateCell(size);
+    Obj* object          = (Obj*)std::construct_at<T>(tmp);
+    object->type         = type;
+    object->isMarked     = false;
+    object->isOld        = false;
+    object->isRemembered = false;
 
-    object->next = vm.objects;
-    vm.objects   = object;
+    object->next    = vm.youngObjects;
+    vm.youngObjects = object;
+    vm.objectsAllocated++;
+
+    // See startMarking().
+    if (vm.gcPhase != GC_IDLE) markNewObject(object);
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zd for %d\n", (void*)object, size, type);
@@ -39,13 +45,22 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method)
 ObjClass* newClass(ObjString* name)
 {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
-    klass->name     = name;  // [klass]
-    initTable(&klass->methods);
+    klass->name           = name;  // [klass]
+    klass->methods        = nullptr;
+    klass->methodCount    = 0;
+    klass->methodCapacity = 0;
+    klass->dispatchBase   = 0;
+    klass->initializer    = nullptr;
+    klass->fieldCount     = 0;
     return klass;
 }
 
 ObjClosure* newClosure(ObjFunction* function)
 {
+    // Closures of a function that captures nothing can't be told apart, so
+    // every declaration shares one.
+    if (function->closure != nullptr) return function->closure;
+
     ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
     for (int i = 0; i < function->upvalueCount; i++)
     {
@@ -56,6 +71,12 @@ ObjClosure* newClosure(ObjFunction* function)
     closure->function     = function;
     closure->upvalues     = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    closure->cells        = nullptr;
+    if (function->upvalueCount == 0)
+    {
+        std::atomic_ref(function->closure).store(closure, std::memory_order_release);  // See blackenObject().
+        writeBarrier((Obj*)function);
+    }
     return closure;
 }
 
@@ -63,9 +84,20 @@ ObjFunction* newFunction()
 {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 
-    function->arity        = 0;
-    function->upvalueCount = 0;
-    function->name         = nullptr;
+    function->arity            = 0;
+    function->upvalueCount     = 0;
+    function->maxLocals        = 0;
+    function->maxStack         = 0;
+    function->capturesLocals   = false;
+    function->name             = nullptr;
+    function->regChunk         = nullptr;
+    function->closure          = nullptr;
+    function->onlyStoresFields = false;
+#ifdef JIT
+    function->callCount = 0;
+    function->jitCode   = nullptr;
+    function->jitEntry  = nullptr;
+#endif
     initChunk(&function->chunk);
     return function;
 }
@@ -75,22 +107,36 @@ ObjInstance* newInstance(ObjClass* klass)
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass       = klass;
     initTable(&instance->fields);
+
+    // Instances of a class tend to end up with the same fields.
+    if (klass->fieldCount > 0)
+    {
+        push(OBJ_VAL(instance));
+        tableReserve(&instance->fields, klass->fieldCount);
+        pop();
+    }
+
     return instance;
 }
 
-ObjNative* newNative(NativeFn function)
+ObjNative* newNative(NativeFn function, ObjString* name, int arity, bool pure)
 {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function  = function;
+    native->name      = name;
+    native->arity     = arity;
+    native->pure      = pure;
     return native;
 }
 
 static ObjString* allocateString(char* chars, int length, uint32_t hash)
 {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length    = length;
-    string->chars     = chars;
-    string->hash      = hash;
+    ObjString* string   = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    string->length      = length;
+    string->chars       = chars;
+    string->hash        = hash;
+    string->isFieldName = false;
+    string->selector    = -1;
 
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
@@ -143,7 +189,6 @@ ObjUpvalue* newUpvalue(Value* slot)
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed     = NIL_VAL;
     upvalue->location   = slot;
-    upvalue->next       = nullptr;
     return upvalue;
 }
 
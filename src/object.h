@@ -1,8 +1,13 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include <atomic>
+#include <memory>
+
 #include "common.h"
 #include "chunk.h"
+#include "jit.h"
+#include "regchunk.h"
 #include "table.h"
 #include "value.h"
 
@@ -21,7 +26,7 @@
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
-#define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 
@@ -41,24 +46,64 @@ struct Obj
 {
     ObjType     type;
     bool        isMarked;
+    bool        isOld;         // Survived a collection, so on vm.objects or vm.unswept.
+    bool        isRemembered;  // In vm.remembered.
     struct Obj* next;
 };
 
+// One field an initializer stores: its parameter `param`, or `constant`
+// when `param` is 0.
+struct FieldInit
+{
+    ObjString* name;
+    int        param;
+    Value      constant;
+};
+
 struct ObjFunction
 {
     Obj        obj;
     int        arity;
     int        upvalueCount;
+    int        maxLocals;       // Most locals in scope at once.
+    int        maxStack;        // Most values its frame holds at once, locals and temporaries, for sizing frames.
+    bool       capturesLocals;  // Whether closures share its locals, so returns must close them.
     Chunk      chunk;
     ObjString* name;
+
+    ObjClosure* closure;  // The one closure of a function without upvalues, once made.
+
+    // Set for an initializer that does nothing but store parameters and
+    // constants in fields of `this`, with those stores in order.
+    bool                   onlyStoresFields;
+    std::vector<FieldInit> fieldInits;
+
+    std::unique_ptr<RegChunk> regChunk;  // Generated on the first call under ENGINE_REGISTER.
+
+#ifdef JIT
+    int                      callCount;
+    std::unique_ptr<JitCode> jitCode;   // Generated after JIT_THRESHOLD calls.
+    const void*              jitEntry;  // The start of jitCode's machine code, which compiled callers call.
+    std::vector<LoopTrace>   traces;    // Loops the tracing JIT has recorded.
+#endif
 };
 
-using NativeFn = Value (*)(int argCount, Value* args);
+struct VM;
+
+// A native reads its arguments from `args` and stores its result in
+// args[-1], the callee's slot, where the GC can see it. It returns false
+// after reporting a runtime error with nativeError().
+using NativeFn = bool (*)(VM& context, int argCount, Value* args);
+
+#define NATIVE_VARIADIC (-1)
 
 struct ObjNative
 {
-    Obj      obj;
-    NativeFn function;
+    Obj        obj;
+    NativeFn   function;
+    ObjString* name;
+    int        arity;  // Checked by the caller, unless NATIVE_VARIADIC.
+    bool       pure;   // Never allocates or fails, so calls skip the VM bookkeeping.
 };
 
 struct ObjString
@@ -67,27 +112,60 @@ struct ObjString
     int      length;
     char*    chars;
     uint32_t hash;
+    bool     isFieldName;  // Set once some instance has a field with this name.
+    int      selector;     // Same for the name in every class, or -1 if no method has this name.
 };
 struct ObjUpvalue
 {
-    Obj         obj;
-    Value*      location;
-    Value       closed;
-    ObjUpvalue* next;
+    Obj    obj;
+    Value* location;
+    Value  closed;
 };
+
+// Stores through the upvalue. Once it is closed, the helper thread may be
+// marking the value, as in storeEntryValue().
+static inline void storeUpvalue(ObjUpvalue* upvalue, Value value)
+{
+#ifdef NAN_BOXING
+    std::atomic_ref(*upvalue->location).store(value, std::memory_order_release);
+#else
+    *upvalue->location = value;
+#endif
+}
 struct ObjClosure
 {
     Obj          obj;
     ObjFunction* function;
     ObjUpvalue** upvalues;
     int          upvalueCount;
+    ObjUpvalue*  cells;  // Closed copies of CAPTURE_VALUE captures, made on the first.
+};
+
+// Whether `upvalue` is one of the closure's own cells rather than an
+// object of its own. The helper thread asks too, see copyCapture().
+static inline bool isCell(ObjClosure* closure, ObjUpvalue* upvalue)
+{
+    ObjUpvalue* cells = std::atomic_ref(closure->cells).load(std::memory_order_acquire);
+    return cells != nullptr && upvalue >= cells && upvalue < cells + closure->upvalueCount;
+}
+
+// One of a class's methods, its own or inherited.
+struct ClassMethod
+{
+    int         selector;
+    ObjClosure* closure;
 };
 
 struct ObjClass
 {
-    Obj        obj;
-    ObjString* name;
-    Table      methods;
+    Obj          obj;
+    ObjString*   name;
+    ClassMethod* methods;       // Packed, for the collector; lookups go through vm.dispatch.
+    int          methodCount;
+    int          methodCapacity;
+    int          dispatchBase;  // Where the class's row starts in vm.dispatch.
+    ObjClosure*  initializer;   // The "init" method, or nullptr.
+    int          fieldCount;    // Most fields an instance has had, to size new ones.
 };
 
 struct ObjInstance
@@ -109,7 +187,7 @@ ObjClass*       newClass(ObjString* name);
 ObjClosure*     newClosure(ObjFunction* function);
 ObjFunction*    newFunction();
 ObjInstance*    newInstance(ObjClass* klass);
-ObjNative*      newNative(NativeFn function);
+ObjNative*      newNative(NativeFn function, ObjString* name, int arity, bool pure);
 ObjString*      takeString(char* chars, int length);
 ObjString*      copyString(const char* chars, int length);
 ObjUpvalue*     newUpvalue(Value* slot);
@@ -0,0 +1,33 @@
+#include "regchunk.h"
+
+int RegChunk::write(RegInstruction instruction, int line) noexcept
+{
+    m_code.push_back(instruction);
+    m_lines.push_back(line);
+    return (int)m_code.size() - 1;
+}
+
+size_t RegChunk::size() const noexcept
+{
+    return m_code.size();
+}
+
+std::vector<RegInstruction>& RegChunk::code() noexcept
+{
+    return m_code;
+}
+
+std::vector<int>& RegChunk::lines() noexcept
+{
+    return m_lines;
+}
+
+ValueArray& RegChunk::constants() noexcept
+{
+    return m_constants;
+}
+
+int& RegChunk::slotCount() noexcept
+{
+    return m_slotCount;
+}
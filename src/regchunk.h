@@ -0,0 +1,83 @@
+#ifndef clox_regchunk_h
+#define clox_regchunk_h
+
+#include "common.h"
+#include "value.h"
+
+// Operands of the register engine are frame slots. Operands marked "RK"
+// below may instead name a constant: the index is then or'ed with
+// RK_CONSTANT. Jump offsets ("sA") are signed and count instructions from
+// the one after the jump.
+#define RK_CONSTANT 0x8000
+
+enum RegOpCode
+{
+    ROP_MOVE,               // R[A] = R[B]
+    ROP_LOADK,              // R[A] = K[B]
+    ROP_GET_GLOBAL,         // R[A] = globals[B]
+    ROP_DEFINE_GLOBAL,      // globals[A] = RK[B]
+    ROP_SET_GLOBAL,         // globals[A] = RK[B]
+    ROP_GET_UPVALUE,        // R[A] = upvalues[B]
+    ROP_SET_UPVALUE,        // upvalues[A] = RK[B]
+    ROP_GET_PROPERTY,       // R[A] = RK[B].K[C]
+    ROP_SET_PROPERTY,       // RK[A].K[B] = RK[C]
+    ROP_GET_SUPER,          // R[A] = method K[C] of class RK[B], bound to R[A]
+    ROP_EQUAL,              // R[A] = RK[B] == RK[C]
+    ROP_GREATER,            // R[A] = RK[B] > RK[C]
+    ROP_LESS,               // R[A] = RK[B] < RK[C]
+    ROP_ADD,                // R[A] = RK[B] + RK[C]
+    ROP_SUBTRACT,           // R[A] = RK[B] - RK[C]
+    ROP_MULTIPLY,           // R[A] = RK[B] * RK[C]
+    ROP_DIVIDE,             // R[A] = RK[B] / RK[C]
+    ROP_NOT,                // R[A] = !RK[B]
+    ROP_NEGATE,             // R[A] = -RK[B]
+    ROP_PRINT,              // print RK[A]
+    ROP_JUMP,               // pc += sA
+    ROP_LOOP,               // pc += sA, backwards, checking the budget
+    ROP_JUMP_IF_FALSE,      // if (!RK[B]) pc += sA
+    ROP_LESS_JUMP,          // if (!(RK[B] < RK[C])) pc += sA
+    ROP_CALL,               // R[A] = R[A](R[A+1] .. R[A+B])
+    ROP_TAIL_CALL,          // return R[A](R[A+1] .. R[A+B]), in this frame
+    ROP_INVOKE,             // R[A] = R[A].K[B](R[A+1] .. R[A+C])
+    ROP_SUPER_INVOKE,       // R[A] = super(R[A+C+1]).K[B] with R[A] as this
+    ROP_TAIL_INVOKE,        // return R[A].K[B](R[A+1] .. R[A+C]), in this frame
+    ROP_TAIL_SUPER_INVOKE,  // return super(R[A+C+1]).K[B] with R[A] as this, in this frame
+    ROP_CLOSURE,            // R[A] = closure(K[B]), followed by one ROP_CAPTURE per upvalue
+    ROP_CAPTURE,            // pseudo-instruction: A = CaptureKind, B = index
+    ROP_CLOSE_UPVALUE,      // close upvalues at or above R[A]
+    ROP_RETURN,             // return RK[A]
+    ROP_CLASS,              // R[A] = class K[B]
+    ROP_INHERIT,            // copy the methods of class RK[A] into class RK[B]
+    ROP_METHOD              // RK[A].methods[K[C]] = RK[B]
+};
+
+struct RegInstruction
+{
+    uint8_t  op;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+};
+
+class RegChunk
+{
+private:
+    std::vector<RegInstruction> m_code{};
+    std::vector<int>            m_lines{};
+    ValueArray                  m_constants{};
+    int                         m_slotCount{0};
+
+public:
+    RegChunk() = default;
+
+    int write(RegInstruction instruction, int line) noexcept;
+
+    [[nodiscard]] size_t size() const noexcept;
+
+    [[nodiscard]] std::vector<RegInstruction>& code() noexcept;
+    [[nodiscard]] std::vector<int>&            lines() noexcept;
+    [[nodiscard]] ValueArray&                  constants() noexcept;
+    [[nodiscard]] int&                         slotCount() noexcept;
+};
+
+#endif
@@ -0,0 +1,538 @@
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "regcompiler.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include <cstdio>
+#include "debug.h"
+#endif
+
+// Where one slot of the stack machine's operand stack currently lives.
+// Loading a local or a constant doesn't emit anything; the operand just
+// names the register or constant until something forces it into its own
+// slot. A slot is "materialized" when it is the register of its own
+// position.
+struct Operand
+{
+    bool     isConstant;
+    uint16_t index;  // Register or constant index.
+};
+
+struct RegCompiler
+{
+    Chunk*    chunk;
+    RegChunk* regChunk;
+
+    std::vector<Operand> stack;
+
+    std::vector<bool> isTarget;  // Per stack-code offset: some jump lands here.
+    std::vector<int>  startOf;   // Register-code index of each stack-code offset.
+
+    std::vector<std::pair<int, int>> jumps;  // Instruction and stack-code target of every jump.
+
+    int producer;  // Instruction that computed the top operand, if nothing came after it.
+    int line;
+
+    uint16_t nilConstant;
+    uint16_t trueConstant;
+    uint16_t falseConstant;
+    uint16_t firstName;  // The constant holding the chunk's name 0.
+};
+
+// Reads the global slot operand of a *_GLOBAL instruction.
+static uint16_t globalOperand(uint8_t* code)
+{
+    return (uint16_t)((code[1] << 8) | code[2]);
+}
+
+// Reads the operand of an instruction that has a wide form, given the
+// opcode of the wide form.
+static uint16_t operand(uint8_t* code, uint8_t longOp)
+{
+    return code[0] == longOp ? (uint16_t)((code[1] << 8) | code[2]) : code[1];
+}
+
+// The constant of the name a property, method or class instruction picks
+// from the chunk's names.
+static uint16_t nameConstant(RegCompiler* compiler, uint8_t name)
+{
+    return (uint16_t)(compiler->firstName + name);
+}
+
+// Reads the slot or upvalue index of one capture of a closure instruction.
+static uint16_t captureIndex(uint8_t* capture, bool wide)
+{
+    return wide ? (uint16_t)((capture[1] << 8) | capture[2]) : capture[1];
+}
+
+static uint16_t rk(Operand operand)
+{
+    return operand.isConstant ? (uint16_t)(operand.index | RK_CONSTANT) : operand.index;
+}
+
+static int emit(RegCompiler* compiler, RegOpCode op, int a, int b = 0, int c = 0)
+{
+    compiler->producer = -1;
+    return compiler->regChunk->write({(uint8_t)op, (uint16_t)a, (uint16_t)b, (uint16_t)c}, compiler->line);
+}
+
+static void push(RegCompiler* compiler, Operand operand)
+{
+    compiler->stack.push_back(operand);
+
+    int depth = (int)compiler->stack.size();
+    if (depth > compiler->regChunk->slotCount()) compiler->regChunk->slotCount() = depth;
+}
+
+static Operand pop(RegCompiler* compiler)
+{
+    Operand operand = compiler->stack.back();
+    compiler->stack.pop_back();
+    return operand;
+}
+
+static int top(RegCompiler* compiler)
+{
+    return (int)compiler->stack.size() - 1;
+}
+
+// Emits an instruction that writes a new operand on top of the stack.
+static void pushResult(RegCompiler* compiler, RegOpCode op, int b = 0, int c = 0)
+{
+    int slot = (int)compiler->stack.size();
+    int code = emit(compiler, op, slot, b, c);
+    push(compiler, Operand{false, (uint16_t)slot});
+    compiler->producer = code;
+}
+
+static bool isMaterialized(RegCompiler* compiler, int slot)
+{
+    Operand operand = compiler->stack[slot];
+    return !operand.isConstant && operand.index == slot;
+}
+
+static void materialize(RegCompiler* compiler, int slot)
+{
+    if (isMaterialized(compiler, slot)) return;
+
+    Operand operand = compiler->stack[slot];
+    emit(compiler, operand.isConstant ? ROP_LOADK : ROP_MOVE, slot, operand.index);
+    compiler->stack[slot] = Operand{false, (uint16_t)slot};
+}
+
+// Jump targets, calls and anything else that looks at the frame expect
+// every value to sit in its own slot.
+static void materializeAll(RegCompiler* compiler)
+{
+    for (int slot = 0; slot < (int)compiler->stack.size(); slot++)
+    {
+        materialize(compiler, slot);
+    }
+}
+
+// Flushes the operands still reading register `slot` before it changes.
+static void protect(RegCompiler* compiler, int slot)
+{
+    for (int i = 0; i < (int)compiler->stack.size(); i++)
+    {
+        Operand operand = compiler->stack[i];
+        if (i != slot && !operand.isConstant && operand.index == slot)
+        {
+            materialize(compiler, i);
+        }
+    }
+}
+
+static bool isReferenced(RegCompiler* compiler, int slot)
+{
+    for (int i = 0; i < (int)compiler->stack.size(); i++)
+    {
+        Operand operand = compiler->stack[i];
+        if (i != slot && !operand.isConstant && operand.index == slot) return true;
+    }
+
+    return false;
+}
+
+static void getLocal(RegCompiler* compiler, int slot)
+{
+    materialize(compiler, slot);
+    push(compiler, Operand{false, (uint16_t)slot});
+}
+
+static void setLocal(RegCompiler* compiler, int slot)
+{
+    int     valueSlot = top(compiler);
+    Operand value     = compiler->stack[valueSlot];
+
+    // "a = b + c" computed b + c into a temporary right before this. Have
+    // that instruction write the local instead of copying it over.
+    if (compiler->producer == (int)compiler->regChunk->size() - 1 && isMaterialized(compiler, valueSlot) &&
+        !isReferenced(compiler, slot))
+    {
+        compiler->regChunk->code().back().a = (uint16_t)slot;
+        compiler->stack[slot]               = Operand{false, (uint16_t)slot};
+        compiler->stack[valueSlot]          = Operand{false, (uint16_t)slot};
+        compiler->producer                  = -1;
+        return;
+    }
+
+    protect(compiler, slot);
+    value = compiler->stack[valueSlot];
+    if (value.isConstant || value.index != slot)
+    {
+        emit(compiler, value.isConstant ? ROP_LOADK : ROP_MOVE, slot, value.index);
+    }
+
+    compiler->stack[slot] = Operand{false, (uint16_t)slot};
+}
+
+static void emitJump(RegCompiler* compiler, RegOpCode op, int offset, int b = 0, int c = 0)
+{
+    int target = jumpTarget(compiler->chunk, offset);
+    int jump   = emit(compiler, op, 0, b, c);
+    compiler->jumps.emplace_back(jump, target);
+}
+
+static bool patchJump(RegCompiler* compiler, int jump, int target)
+{
+    int distance = compiler->startOf[target] - (jump + 1);
+    if (compiler->startOf[target] < 0 || distance < INT16_MIN || distance > INT16_MAX) return false;
+
+    compiler->regChunk->code()[jump].a = (uint16_t)(int16_t)distance;
+    return true;
+}
+
+static void binary(RegCompiler* compiler, RegOpCode op)
+{
+    Operand b = pop(compiler);
+    Operand a = pop(compiler);
+    pushResult(compiler, op, rk(a), rk(b));
+}
+
+static void translate(RegCompiler* compiler, int offset)
+{
+    Chunk*   chunk = compiler->chunk;
+    uint8_t* code  = chunk->code().data() + offset;
+
+    switch (code[0])
+    {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: push(compiler, Operand{true, operand(code, OP_CONSTANT_LONG)}); break;
+        case OP_NIL: push(compiler, Operand{true, compiler->nilConstant}); break;
+        case OP_TRUE: push(compiler, Operand{true, compiler->trueConstant}); break;
+        case OP_FALSE: push(compiler, Operand{true, compiler->falseConstant}); break;
+        case OP_POP: pop(compiler); break;
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG: getLocal(compiler, operand(code, OP_GET_LOCAL_LONG)); break;
+
+        case OP_GET_LOCAL_CONSTANT:
+            getLocal(compiler, code[1]);
+            push(compiler, Operand{true, code[2]});
+            break;
+
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG: setLocal(compiler, operand(code, OP_SET_LOCAL_LONG)); break;
+        case OP_GET_GLOBAL: pushResult(compiler, ROP_GET_GLOBAL, globalOperand(code)); break;
+        case OP_DEFINE_GLOBAL: emit(compiler, ROP_DEFINE_GLOBAL, globalOperand(code), rk(pop(compiler))); break;
+        case OP_SET_GLOBAL:
+            emit(compiler, ROP_SET_GLOBAL, globalOperand(code), rk(compiler->stack.back()));
+            break;
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG: pushResult(compiler, ROP_GET_UPVALUE, operand(code, OP_GET_UPVALUE_LONG)); break;
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG:
+            emit(compiler, ROP_SET_UPVALUE, operand(code, OP_SET_UPVALUE_LONG), rk(compiler->stack.back()));
+            break;
+
+        // Register code never replaces instances by their fields, so the
+        // scalar forms always find a real instance.
+        case OP_GET_LOCAL_PROPERTY:
+        case OP_GET_SCALAR:
+        {
+            int local = code[0] == OP_GET_SCALAR ? 2 : 1;
+            getLocal(compiler, code[local]);
+            pushResult(compiler, ROP_GET_PROPERTY, rk(pop(compiler)), nameConstant(compiler, code[local + 1]));
+            break;
+        }
+
+        case OP_GET_PROPERTY:
+            pushResult(compiler, ROP_GET_PROPERTY, rk(pop(compiler)), nameConstant(compiler, code[1]));
+            break;
+
+        case OP_SET_PROPERTY:
+        case OP_SET_SCALAR:
+        {
+            Operand value    = pop(compiler);
+            Operand instance = pop(compiler);
+            uint8_t name     = code[code[0] == OP_SET_SCALAR ? 2 : 1];
+            emit(compiler, ROP_SET_PROPERTY, rk(instance), nameConstant(compiler, name), rk(value));
+
+            // The assigned value replaces the instance. Usually it is popped
+            // right away and doesn't need moving down.
+            int slot = (int)compiler->stack.size();
+            if (!value.isConstant && value.index == slot + 1)
+            {
+                int  next   = offset + instructionLength(chunk, offset);
+                bool popped = chunk->code()[next] == OP_POP && !compiler->isTarget[next];
+                if (!popped) emit(compiler, ROP_MOVE, slot, value.index);
+                value.index = (uint16_t)slot;
+            }
+
+            push(compiler, value);
+            break;
+        }
+
+        case OP_GET_SUPER:
+        {
+            Operand superclass = pop(compiler);
+            int     slot       = top(compiler);
+            materialize(compiler, slot);  // The receiver.
+            emit(compiler, ROP_GET_SUPER, slot, rk(superclass), nameConstant(compiler, code[1]));
+            break;
+        }
+
+        case OP_EQUAL: binary(compiler, ROP_EQUAL); break;
+        case OP_GREATER: binary(compiler, ROP_GREATER); break;
+        case OP_LESS: binary(compiler, ROP_LESS); break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR: binary(compiler, ROP_ADD); break;
+        case OP_SUBTRACT: binary(compiler, ROP_SUBTRACT); break;
+        case OP_MULTIPLY: binary(compiler, ROP_MULTIPLY); break;
+        case OP_DIVIDE: binary(compiler, ROP_DIVIDE); break;
+        case OP_NOT: pushResult(compiler, ROP_NOT, rk(pop(compiler))); break;
+        case OP_NEGATE: pushResult(compiler, ROP_NEGATE, rk(pop(compiler))); break;
+        case OP_PRINT: emit(compiler, ROP_PRINT, rk(pop(compiler))); break;
+
+        case OP_JUMP:
+            materializeAll(compiler);
+            emitJump(compiler, ROP_JUMP, offset);
+            break;
+
+        case OP_JUMP_IF_FALSE:
+            materializeAll(compiler);
+            emitJump(compiler, ROP_JUMP_IF_FALSE, offset, top(compiler));
+            break;
+
+        case OP_POP_JUMP_IF_FALSE:
+        {
+            Operand condition = pop(compiler);
+            materializeAll(compiler);
+            emitJump(compiler, ROP_JUMP_IF_FALSE, offset, rk(condition));
+            break;
+        }
+
+        case OP_LESS_JUMP_IF_FALSE:
+        {
+            Operand b = pop(compiler);
+            Operand a = pop(compiler);
+            materializeAll(compiler);
+            emitJump(compiler, ROP_LESS_JUMP, offset, rk(a), rk(b));
+            break;
+        }
+
+        case OP_LOOP:
+        case OP_LOOP_TRACE:
+        {
+            materializeAll(compiler);
+            int jump = emit(compiler, ROP_LOOP, 0);
+            compiler->jumps.emplace_back(jump, jumpTarget(chunk, offset));
+            break;
+        }
+
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_CLOSURE:
+        case OP_CALL_NATIVE:
+        case OP_NEW_SCALAR:
+        {
+            int argCount = code[0] == OP_NEW_SCALAR ? code[3] : code[1];
+            materializeAll(compiler);
+            int slot = top(compiler) - argCount;
+            emit(compiler, code[0] == OP_TAIL_CALL ? ROP_TAIL_CALL : ROP_CALL, slot, argCount);
+            compiler->stack.resize(slot);
+            push(compiler, Operand{false, (uint16_t)slot});
+            break;
+        }
+
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        {
+            materializeAll(compiler);
+            int slot = top(compiler) - code[2];
+            emit(compiler,
+                 code[0] == OP_TAIL_INVOKE ? ROP_TAIL_INVOKE : ROP_INVOKE,
+                 slot,
+                 nameConstant(compiler, code[1]),
+                 code[2]);
+            compiler->stack.resize(slot);
+            push(compiler, Operand{false, (uint16_t)slot});
+            break;
+        }
+
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+        {
+            materializeAll(compiler);
+            int slot = top(compiler) - code[2] - 1;
+            emit(compiler,
+                 code[0] == OP_TAIL_SUPER_INVOKE ? ROP_TAIL_SUPER_INVOKE : ROP_SUPER_INVOKE,
+                 slot,
+                 nameConstant(compiler, code[1]),
+                 code[2]);
+            compiler->stack.resize(slot);
+            push(compiler, Operand{false, (uint16_t)slot});
+            break;
+        }
+
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+        {
+            bool         wide     = code[0] == OP_CLOSURE_LONG;
+            int          constant = operand(code, OP_CLOSURE_LONG);
+            ObjFunction* function = AS_FUNCTION(chunk->constants()[constant]);
+            uint8_t*     captures = code + (wide ? 3 : 2);
+            int          size     = wide ? 3 : 2;
+
+            // Captured locals have to live in their slots for the upvalue to
+            // point at them.
+            for (int i = 0; i < function->upvalueCount; i++)
+            {
+                uint8_t* capture = captures + size * i;
+                int      index   = captureIndex(capture, wide);
+                if (capture[0] && index < (int)compiler->stack.size()) materialize(compiler, index);
+            }
+
+            int slot = (int)compiler->stack.size();
+            emit(compiler, ROP_CLOSURE, slot, constant);
+            for (int i = 0; i < function->upvalueCount; i++)
+            {
+                uint8_t* capture = captures + size * i;
+                emit(compiler, ROP_CAPTURE, capture[0], captureIndex(capture, wide));
+            }
+
+            push(compiler, Operand{false, (uint16_t)slot});
+            break;
+        }
+
+        case OP_CLOSE_UPVALUE:
+            materialize(compiler, top(compiler));
+            emit(compiler, ROP_CLOSE_UPVALUE, top(compiler));
+            pop(compiler);
+            break;
+
+        case OP_RETURN:
+            emit(compiler, ROP_RETURN, rk(pop(compiler)));
+            break;
+
+        case OP_RETURN_NIL:
+            emit(compiler, ROP_RETURN, compiler->nilConstant | RK_CONSTANT);
+            break;
+
+        case OP_CLASS:
+        {
+            int slot = (int)compiler->stack.size();
+            emit(compiler, ROP_CLASS, slot, nameConstant(compiler, code[1]));
+            push(compiler, Operand{false, (uint16_t)slot});
+            break;
+        }
+
+        case OP_INHERIT:
+        {
+            Operand subclass = pop(compiler);
+            emit(compiler, ROP_INHERIT, rk(compiler->stack.back()), rk(subclass));
+            break;
+        }
+
+        case OP_METHOD:
+        {
+            Operand method = pop(compiler);
+            emit(compiler, ROP_METHOD, rk(compiler->stack.back()), rk(method), nameConstant(compiler, code[1]));
+            break;
+        }
+    }
+}
+
+bool compileRegisters(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    int    size  = (int)chunk->size();
+
+    auto        regChunk = std::make_unique<RegChunk>();
+    RegCompiler compiler{};
+    compiler.chunk    = chunk;
+    compiler.regChunk = regChunk.get();
+    compiler.isTarget.assign(size + 1, false);
+    compiler.startOf.assign(size + 1, -1);
+    compiler.producer = -1;
+
+    // The register code shares the function's constants, plus the literals
+    // that the stack code pushed with their own opcodes.
+    regChunk->constants()  = chunk->constants();
+    compiler.nilConstant   = (uint16_t)regChunk->constants().size();
+    compiler.trueConstant  = compiler.nilConstant + 1;
+    compiler.falseConstant = compiler.nilConstant + 2;
+    regChunk->constants().push_back(NIL_VAL);
+    regChunk->constants().push_back(BOOL_VAL(true));
+    regChunk->constants().push_back(BOOL_VAL(false));
+
+    // Names become constants too.
+    compiler.firstName = (uint16_t)regChunk->constants().size();
+    for (ObjString* name : chunk->names()) regChunk->constants().push_back(OBJ_VAL(name));
+    if (regChunk->constants().size() > RK_CONSTANT) return false;
+
+    for (int offset = 0; offset < size; offset += instructionLength(chunk, offset))
+    {
+        switch (chunk->code()[offset])
+        {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_LESS_JUMP_IF_FALSE:
+            case OP_LOOP:
+            case OP_LOOP_TRACE: compiler.isTarget[jumpTarget(chunk, offset)] = true; break;
+            default: break;
+        }
+    }
+
+    // The callee and its parameters are already in place.
+    for (int slot = 0; slot <= function->arity; slot++)
+    {
+        push(&compiler, Operand{false, (uint16_t)slot});
+    }
+
+    for (int offset = 0; offset < size; offset += instructionLength(chunk, offset))
+    {
+        compiler.line = chunk->lines()[offset + instructionLength(chunk, offset) - 1];
+
+        // The stack compiler keeps the depth the same on every path into a
+        // jump target, including after unconditional jumps and returns, so
+        // the operand stack just carries on through unreachable code. Every
+        // path into a target leaves each value in its own slot.
+        if (compiler.isTarget[offset])
+        {
+            materializeAll(&compiler);
+            compiler.producer = -1;
+        }
+
+        compiler.startOf[offset] = (int)regChunk->size();
+        translate(&compiler, offset);
+    }
+
+    for (auto [jump, target] : compiler.jumps)
+    {
+        if (!patchJump(&compiler, jump, target)) return false;
+    }
+
+    if (regChunk->slotCount() >= RK_CONSTANT) return false;
+
+#ifdef DEBUG_PRINT_CODE
+    disassembleRegChunk(regChunk.get(), function->name != nullptr ? function->name->chars : "<script>");
+#endif
+
+    function->regChunk = std::move(regChunk);
+    return true;
+}
@@ -0,0 +1,10 @@
+#ifndef clox_regcompiler_h
+#define clox_regcompiler_h
+
+#include "object.h"
+
+// Generates function->regChunk from the function's stack bytecode. Returns
+// false if the function can't be expressed in register code.
+bool compileRegisters(ObjFunction* function);
+
+#endif
@@ -9,13 +9,6 @@
 #include "common.h"
 #include "scanner.h"
 
-struct Scanner
-{
-    const char* start;
-    const char* current;
-    int         line;
-};
-
 Scanner scanner;
 
 void initScanner(std::string_view source)
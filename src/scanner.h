@@ -62,6 +62,16 @@ struct Token
     int         line;
 };
 
+struct Scanner
+{
+    const char* start;
+    const char* current;
+    int         line;
+};
+
+// Copied and restored by the compiler to compile a function a second time.
+extern Scanner scanner;
+
 void  initScanner(std::string_view source);
 Token scanToken();
 
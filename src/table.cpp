@@ -1,3 +1,4 @@
+#include <atomic>
 #include <cstdlib>
 #include <cstring>
 
@@ -5,6 +6,7 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
 
 #define TABLE_MAX_LOAD 0.75
 
@@ -66,6 +68,15 @@ bool tableGet(Table* table, ObjString* key, Value* value)
     return true;
 }
 
+// Like tableGet(), but returns the entry holding the key, or nullptr.
+Entry* tableGetEntry(Table* table, ObjString* key)
+{
+    if (table->count == 0) return nullptr;
+
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    return entry->key == nullptr ? nullptr : entry;
+}
+
 static void adjustCapacity(Table* table, int capacity)
 {
     Entry* entries = ALLOCATE(Entry, capacity + 1);
@@ -87,9 +98,11 @@ static void adjustCapacity(Table* table, int capacity)
         table->count++;
     }
 
+    // The entries are published before the capacity, for markTable() on
+    // the helper thread.
     FREE_ARRAY(Entry, table->entries, table->capacity + 1);
-    table->entries  = entries;
-    table->capacity = capacity;
+    std::atomic_ref(table->entries).store(entries, std::memory_order_release);
+    std::atomic_ref(table->capacity).store(capacity, std::memory_order_release);
 }
 
 bool tableSet(Table* table, ObjString* key, Value value)
@@ -105,11 +118,19 @@ bool tableSet(Table* table, ObjString* key, Value value)
     bool isNewKey = entry->key == nullptr;
     if (isNewKey && IS_NIL(entry->value)) table->count++;
 
-    entry->key   = key;
-    entry->value = value;
+    storeEntry(entry, key, value);
     return isNewKey;
 }
 
+// Makes room for `count` entries up front, so adding them won't grow the
+// table.
+void tableReserve(Table* table, int count)
+{
+    int capacity = GROW_CAPACITY(0);
+    while (count > capacity * TABLE_MAX_LOAD) capacity = GROW_CAPACITY(capacity);
+    if (capacity - 1 > table->capacity) adjustCapacity(table, capacity - 1);
+}
+
 bool tableDelete(Table* table, ObjString* key)
 {
     if (table->count == 0) return false;
@@ -119,8 +140,7 @@ bool tableDelete(Table* table, ObjString* key)
     if (entry->key == nullptr) return false;
 
     // Place a tombstone in the entry.
-    entry->key   = nullptr;
-    entry->value = BOOL_VAL(true);
+    storeEntry(entry, nullptr, BOOL_VAL(true));
 
     return true;
 }
@@ -168,19 +188,31 @@ void tableRemoveWhite(Table* table)
     for (int i = 0; i <= table->capacity; i++)
     {
         Entry* entry = &table->entries[i];
-        if (entry->key != nullptr && !entry->key->obj.isMarked)
+        if (entry->key == nullptr || entry->key->obj.isMarked) continue;
+
+        // A minor collection doesn't mark the old strings it keeps.
+        if (!entry->key->obj.isOld || !vm.collectingYoung)
         {
             tableDelete(table, entry->key);
         }
     }
 }
 
+// The helper thread may run this while the table grows. Reading the
+// capacity first, it can get the new entries with the old capacity, but
+// not the other way around, and old entries aren't freed until it is done.
 void markTable(Table* table)
 {
-    for (int i = 0; i <= table->capacity; i++)
+    int    capacity = std::atomic_ref(table->capacity).load(std::memory_order_acquire);
+    Entry* entries  = std::atomic_ref(table->entries).load(std::memory_order_acquire);
+    for (int i = 0; i <= capacity; i++)
     {
-        Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
+        Entry* entry = &entries[i];
+        markObject((Obj*)std::atomic_ref(entry->key).load(std::memory_order_acquire));
+#ifdef NAN_BOXING
+        markValue(std::atomic_ref(entry->value).load(std::memory_order_acquire));
+#else
         markValue(entry->value);
+#endif
     }
 }
@@ -1,6 +1,8 @@
 #ifndef clox_table_h
 #define clox_table_h
 
+#include <atomic>
+
 #include "common.h"
 #include "value.h"
 
@@ -10,6 +12,26 @@ struct Entry
     Value      value;
 };
 
+// With --gc-concurrent, markTable() may read an entry on the helper thread
+// while the program stores into it. Stores release, so that the helper
+// sees the header of an object it finds there, and markTable() acquires.
+// Values are only this cheap to store atomically when NaN boxed, which is
+// why that flag needs NAN_BOXING.
+static inline void storeEntryValue(Entry* entry, Value value)
+{
+#ifdef NAN_BOXING
+    std::atomic_ref(entry->value).store(value, std::memory_order_release);
+#else
+    entry->value = value;
+#endif
+}
+
+static inline void storeEntry(Entry* entry, ObjString* key, Value value)
+{
+    std::atomic_ref(entry->key).store(key, std::memory_order_release);
+    storeEntryValue(entry, value);
+}
+
 struct Table
 {
     int    count;
@@ -20,7 +42,9 @@ struct Table
 void       initTable(Table* table);
 void       freeTable(Table* table);
 bool       tableGet(Table* table, ObjString* key, Value* value);
+Entry*     tableGetEntry(Table* table, ObjString* key);
 bool       tableSet(Table* table, ObjString* key, Value value);
+void       tableReserve(Table* table, int count);
 bool       tableDelete(Table* table, ObjString* key);
 void       tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
@@ -14,16 +14,18 @@ struct ObjString;
 #define SIGN_BIT ((uint64_t)0x8000000000000000)
 #define QNAN     ((uint64_t)0x7ffc000000000000)
 
-#define TAG_NIL   1  // 01.
-#define TAG_FALSE 2  // 10.
-#define TAG_TRUE  3  // 11.
+#define TAG_NIL       1  // 001.
+#define TAG_FALSE     2  // 010.
+#define TAG_TRUE      3  // 011.
+#define TAG_UNDEFINED 4  // 100.
 
 using Value = uint64_t;
 
-#define IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
-#define IS_NIL(value)    ((value) == NIL_VAL)
-#define IS_NUMBER(value) (((value)&QNAN) != QNAN)
-#define IS_OBJ(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_NUMBER(value)    (((value)&QNAN) != QNAN)
+#define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 
 #define AS_BOOL(value)   ((value) == TRUE_VAL)
 #define AS_NUMBER(value) valueToNum(value)
@@ -33,6 +35,7 @@ using Value = uint64_t;
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj)    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
@@ -57,7 +60,8 @@ enum ValueType
     VAL_BOOL,
     VAL_NIL,  // [user-types]
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_UNDEFINED  // Never seen by Lox code; marks unset global slots.
 };
 
 struct Value
@@ -71,10 +75,11 @@ struct Value
     } as;  // [as]
 };
 
-#define IS_BOOL(value)   ((value).type == VAL_BOOL)
-#define IS_NIL(value)    ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
-#define IS_OBJ(value)    ((value).type == VAL_OBJ)
+#define IS_BOOL(value)      ((value).type == VAL_BOOL)
+#define IS_NIL(value)       ((value).type == VAL_NIL)
+#define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
+#define IS_OBJ(value)       ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_OBJ(value)    ((value).as.obj)
 #define AS_BOOL(value)   ((value).as.boolean)
@@ -84,6 +89,7 @@ struct Value
 #define NIL_VAL           (Value{VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) (Value{VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)   (Value{VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL     (Value{VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <climits>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
@@ -9,20 +11,27 @@
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
+#include "regcompiler.h"
 #include "vm.h"
 
+#ifdef JIT
+#include <pthread.h>
+#endif
+
 VM vm;  // [one]
 
-static Value clockNative([[maybe_unused]] int argCount, [[maybe_unused]] Value* args)
+static bool clockNative([[maybe_unused]] VM& context, [[maybe_unused]] int argCount, Value* args)
 {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
 }
 
 static void resetStack()
 {
-    vm.stackTop     = vm.stack;
-    vm.frameCount   = 0;
-    vm.openUpvalues = nullptr;
+    std::fill_n(vm.openUpvalues, vm.openUpvalueTop, nullptr);
+    vm.stackTop       = vm.stack;
+    vm.frameCount     = 0;
+    vm.openUpvalueTop = 0;
 }
 
 static void runtimeError(const char* format, ...)
@@ -39,8 +48,19 @@ static void runtimeError(const char* format, ...)
         ObjFunction* function = frame->closure->function;
         // -1 because the IP is sitting on the next instruction to be
         // executed.
-        size_t instruction = frame->ip - function->chunk.code().data() - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines()[instruction]);
+        int line;
+        if (vm.engine == ENGINE_REGISTER)
+        {
+            RegChunk* chunk = function->regChunk.get();
+            line            = chunk->lines()[frame->pc - chunk->code().data() - 1];
+        }
+        else
+        {
+            size_t instruction = frame->ip - function->chunk.code().data() - 1;
+            line               = function->chunk.lines()[instruction];
+        }
+
+        fprintf(stderr, "[line %d] in ", line);
         if (function->name == nullptr)
         {
             fprintf(stderr, "script\n");
@@ -54,11 +74,48 @@ static void runtimeError(const char* format, ...)
     resetStack();
 }
 
-static void defineNative(const char* name, NativeFn function)
+// Reports a runtime error on behalf of a native, which can then return
+// the result.
+bool nativeError(const char* format, ...)
+{
+    char    message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    runtimeError("%s", message);
+    return false;
+}
+
+void interruptVM()
+{
+    vm.interrupt.store(true, std::memory_order_relaxed);
+}
+
+static void stopScript()
+{
+    vm.interrupt.store(false, std::memory_order_relaxed);
+    vm.preempted = true;
+    resetStack();
+}
+
+// Checked on loop back-edges and on entering a function, which is all a
+// script needs to run forever. Returns true, with the stack unwound, once
+// the budget is spent or another thread has called interruptVM().
+static inline bool preempt()
+{
+    if (--vm.budget >= 0 && !vm.interrupt.load(std::memory_order_relaxed)) return false;
+
+    stopScript();
+    return true;
+}
+
+static void defineNative(const char* name, NativeFn function, int arity, bool pure)
 {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJ_VAL(newNative(function, AS_STRING(vm.stack[0]), arity, pure)));
+    int slot              = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues[slot] = vm.stack[1];
     pop();
     pop();
 }
@@ -67,30 +124,166 @@ void initVM()
 {
     std::construct_at(&vm);
 
+    vm.frames        = nullptr;
+    vm.frameCapacity = 0;
+    vm.frameLimit    = FRAMES_MAX;
+    vm.stack          = nullptr;
+    vm.stackCapacity  = 0;
+    vm.stackLimit     = STACK_MAX;
+    vm.openUpvalues   = nullptr;
+    vm.openUpvalueTop = 0;
+
     resetStack();
-    vm.objects        = nullptr;
-    vm.bytesAllocated = 0;
-    vm.nextGC         = 1024 * 1024;
+    vm.engine           = ENGINE_STACK;
+    vm.budget           = INT64_MAX;
+    vm.interrupt        = false;
+    vm.preempted        = false;
+    vm.cacheHits        = 0;
+    vm.cacheMisses      = 0;
+    vm.objects          = nullptr;
+    vm.youngObjects     = nullptr;
+    vm.unswept          = nullptr;
+    vm.bytesAllocated   = 0;
+    vm.objectsAllocated = 0;
+    vm.nextGC           = 1024 * 1024;
+    vm.nurseryLimit     = GC_NURSERY_SIZE;
+    vm.nextSlice        = 0;
+    vm.gcPhase          = GC_IDLE;
+    vm.sliceBudget      = GC_SLICE_BUDGET;
+    vm.pauseTarget      = 0;
+    vm.markConcurrently = false;
+    vm.markThreads      = 1;
 
     vm.grayCount    = 0;
     vm.grayCapacity = 0;
     vm.grayStack    = nullptr;
 
-    initTable(&vm.globals);
+    vm.remembered         = nullptr;
+    vm.rememberedCount    = 0;
+    vm.rememberedCapacity = 0;
+    vm.collectingYoung    = false;
+    vm.retired            = nullptr;
+    vm.retiredCount       = 0;
+    vm.retiredCapacity    = 0;
+    vm.minorPauses        = {};
+    vm.slicePauses        = {};
+    vm.majorPauses        = {};
+    vm.sweepPauses        = {};
+    std::fill_n(vm.freeCells, GC_CELL_CLASSES, nullptr);
+    std::fill_n(vm.pauseHistogram, GC_PAUSE_BUCKETS, 0);
+
+    initTable(&vm.globalSlots);
+    vm.globalValues   = nullptr;
+    vm.globalNames    = nullptr;
+    vm.globalCount    = 0;
+    vm.globalCapacity = 0;
+
+    vm.selectors        = nullptr;
+    vm.selectorCount    = 0;
+    vm.selectorCapacity = 0;
+    vm.dispatch         = nullptr;
+    vm.dispatchCapacity = 0;
+    vm.dispatchFree     = 0;
+
     initTable(&vm.strings);
 
+    // The first stack segment only needs to hold the script's frame; the
+    // stacks grow when calls nest deeper.
+    vm.stackCapacity = 2 * UINT8_COUNT;
+    vm.stack         = ALLOCATE(Value, vm.stackCapacity);
+    vm.openUpvalues  = ALLOCATE(ObjUpvalue*, vm.stackCapacity);
+    std::fill_n(vm.openUpvalues, vm.stackCapacity, nullptr);
+    resetStack();
+
     vm.initString = nullptr;
     vm.initString = copyString("init", 4);
 
-    defineNative("clock", clockNative);
+    defineNative("clock", clockNative, 0, true);
 }
 
 void freeVM()
 {
-    freeTable(&vm.globals);
+    FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
+    FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+    FREE_ARRAY(ObjUpvalue*, vm.openUpvalues, vm.stackCapacity);
+    vm.frames         = nullptr;
+    vm.frameCapacity  = 0;
+    vm.stack          = nullptr;
+    vm.stackCapacity  = 0;
+    vm.openUpvalues   = nullptr;
+    vm.openUpvalueTop = 0;
+    freeTable(&vm.globalSlots);
+    FREE_ARRAY(Value, vm.globalValues, vm.globalCapacity);
+    FREE_ARRAY(ObjString*, vm.globalNames, vm.globalCapacity);
+    vm.globalValues   = nullptr;
+    vm.globalNames    = nullptr;
+    vm.globalCount    = 0;
+    vm.globalCapacity = 0;
+    FREE_ARRAY(ObjString*, vm.selectors, vm.selectorCapacity);
+    vm.selectors        = nullptr;
+    vm.selectorCount    = 0;
+    vm.selectorCapacity = 0;
     freeTable(&vm.strings);
     vm.initString = nullptr;
     freeObjects();
+
+    // Only now, as freeing the classes clears their entries.
+    FREE_ARRAY(DispatchEntry, vm.dispatch, vm.dispatchCapacity);
+    vm.dispatch         = nullptr;
+    vm.dispatchCapacity = 0;
+    vm.dispatchFree     = 0;
+}
+
+// Returns the slot in vm.globalValues that holds the global with this name,
+// adding an undefined one the first time the name is seen. The compiler
+// resolves global names this way, so the slots never move while code runs.
+int globalSlot(ObjString* name)
+{
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(OBJ_VAL(name));
+    if (vm.globalCapacity < vm.globalCount + 1)
+    {
+        int oldCapacity   = vm.globalCapacity;
+        vm.globalCapacity = GROW_CAPACITY(oldCapacity);
+        vm.globalValues   = GROW_ARRAY(Value, vm.globalValues, oldCapacity, vm.globalCapacity);
+        vm.globalNames    = GROW_ARRAY(ObjString*, vm.globalNames, oldCapacity, vm.globalCapacity);
+    }
+
+    vm.globalValues[vm.globalCount] = UNDEFINED_VAL;
+    vm.globalNames[vm.globalCount]  = name;
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(vm.globalCount));
+    pop();
+    return vm.globalCount++;
+}
+
+// Returns the index of the method `name` in every class's method array,
+// numbering the name the first time the compiler sees a method with it.
+// vm.selectors keeps the string alive, so the number sticks to the name.
+int methodSelector(ObjString* name)
+{
+    if (name->selector >= 0) return name->selector;
+
+    if (vm.selectorCapacity < vm.selectorCount + 1)
+    {
+        push(OBJ_VAL(name));
+        int oldCapacity     = vm.selectorCapacity;
+        vm.selectorCapacity = GROW_CAPACITY(oldCapacity);
+        vm.selectors        = GROW_ARRAY(ObjString*, vm.selectors, oldCapacity, vm.selectorCapacity);
+        pop();
+    }
+
+    vm.selectors[vm.selectorCount] = name;
+    name->selector                 = vm.selectorCount;
+    return vm.selectorCount++;
+}
+
+// The name of a global slot, for error messages. vm.globalSlots keeps it
+// alive.
+ObjString* globalName(int slot)
+{
+    return vm.globalNames[slot];
 }
 
 void push(Value value)
@@ -110,25 +303,198 @@ static Value peek(int distance)
     return vm.stackTop[-1 - distance];
 }
 
-static bool call(ObjClosure* closure, int argCount)
+// Moves the value stack to an array of `capacity` values, rebasing every
+// pointer into it: the stack top, each frame's slots and the open upvalues.
+static void moveStack(int capacity)
 {
-    if (argCount != closure->function->arity)
+    Value*       stack = ALLOCATE(Value, capacity);
+    ObjUpvalue** open  = ALLOCATE(ObjUpvalue*, capacity);
+    std::copy(vm.stack, vm.stackTop, stack);
+    std::copy_n(vm.openUpvalues, vm.openUpvalueTop, open);
+    std::fill(open + vm.openUpvalueTop, open + capacity, nullptr);
+
+    for (int i = 0; i < vm.frameCount; i++)
     {
-        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
-        return false;
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+
+    for (int i = 0; i < vm.openUpvalueTop; i++)
+    {
+        if (open[i] != nullptr) open[i]->location = stack + i;
     }
 
-    if (vm.frameCount == FRAMES_MAX)
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+    FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+    FREE_ARRAY(ObjUpvalue*, vm.openUpvalues, vm.stackCapacity);
+    vm.stack         = stack;
+    vm.openUpvalues  = open;
+    vm.stackCapacity = capacity;
+}
+
+// Grows the value stack, if it has to, so that a frame of `frameSize`
+// values fits from `slots`. Goes as far as the VM's limit.
+static bool reserveStack(Value* slots, int frameSize)
+{
+    int needed = (int)(slots - vm.stack) + frameSize;
+    if (needed <= vm.stackCapacity) return true;
+
+    if (needed > vm.stackLimit)
     {
         runtimeError("Stack overflow.");
         return false;
     }
 
+    int capacity = vm.stackCapacity;
+    while (capacity < needed) capacity = GROW_CAPACITY(capacity);
+    moveStack(std::min(capacity, vm.stackLimit));
+    return true;
+}
+
+// Makes room for one more frame, whose slots start at the callee below its
+// arguments and take up to `frameSize` values, when call() finds there
+// isn't. Either stack grows if it has to, as far as the VM's limits.
+static bool growStacks(int argCount, int frameSize)
+{
+    if (vm.frameCount == vm.frameCapacity)
+    {
+        if (vm.frameCount == vm.frameLimit)
+        {
+            runtimeError("Stack overflow.");
+            return false;
+        }
+
+        int oldCapacity  = vm.frameCapacity;
+        vm.frameCapacity = std::min(GROW_CAPACITY(oldCapacity), vm.frameLimit);
+        vm.frames        = GROW_ARRAY(CallFrame, vm.frames, oldCapacity, vm.frameCapacity);
+    }
+
+    return reserveStack(vm.stackTop - argCount - 1, frameSize);
+}
+
+// Returns how many values a frame of `closure` takes up on the stack, or
+// -1 after a runtime error. The compiler works out how deep each function
+// takes the stack, and register frames know their size.
+static int frameSize(ObjClosure* closure, int argCount)
+{
+    ObjFunction* function = closure->function;
+    if (argCount != function->arity)
+    {
+        runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+        return -1;
+    }
+
+    if (vm.engine == ENGINE_REGISTER)
+    {
+        if (function->regChunk == nullptr && !compileRegisters(function))
+        {
+            runtimeError("Function is too large for the register engine.");
+            return -1;
+        }
+
+        return function->regChunk->slotCount();
+    }
+
+    return function->maxStack;
+}
+
+#ifdef JIT
+// Runs frame `frameIndex`, the top frame, for as long as its function is
+// compiled. Compiled functions run to completion right here, so to the
+// caller they look like a native function that left its result on the
+// stack. One that ends in a tail call hands the frame over to the callee,
+// and the loop starts that in turn. The top-level script only runs once
+// and never gets compiled.
+static bool runCompiled(int frameIndex)
+{
+    ObjFunction* function = vm.frames[frameIndex].closure->function;
+    while (function->name != nullptr)
+    {
+        if (function->jitCode == nullptr && function->callCount++ == JIT_THRESHOLD)
+        {
+            compileJit(function);
+        }
+
+        if (function->jitCode == nullptr) break;
+
+        // Each compiled call nests on the native stack. The callee hasn't
+        // started, so the error is the caller's.
+        if ((uintptr_t)__builtin_frame_address(0) < vm.nativeStackLimit)
+        {
+            vm.frameCount = frameIndex;
+            runtimeError("Stack overflow.");
+            return false;
+        }
+
+        if (!function->jitCode->run(&vm.frames[frameIndex])) return false;
+        if (vm.frameCount == frameIndex) break;  // It returned.
+
+        function = vm.frames[frameIndex].closure->function;
+    }
+
+    return true;
+}
+#endif
+
+// Starts `closure` in the top frame, whose slots already hold the callee
+// and its arguments, with vm.stackTop just past them.
+static bool enterFrame(CallFrame* frame, ObjClosure* closure, int frameSize)
+{
+    ObjFunction* function = closure->function;
+    frame->closure        = closure;
+
+    if (vm.engine == ENGINE_REGISTER)
+    {
+        Value* frameTop = frame->slots + frameSize;
+
+        // The registers past the arguments may still hold values of frames
+        // that have returned, which the GC must not trace.
+        for (Value* slot = vm.stackTop; slot < frameTop; slot++)
+        {
+            *slot = NIL_VAL;
+        }
+
+        vm.stackTop = frameTop;
+        frame->pc   = function->regChunk->code().data();
+        return true;
+    }
+
+    frame->ip = function->chunk.code().data();
+
+#ifdef JIT
+    return runCompiled(vm.frameCount - 1);
+#else
+    return true;
+#endif
+}
+
+static bool call(ObjClosure* closure, int argCount)
+{
+    if (preempt()) return false;
+
+    int size = frameSize(closure, argCount);
+    if (size < 0) return false;
+
+    if (vm.frameCount == vm.frameCapacity || vm.stackTop - argCount - 1 + size > vm.stack + vm.stackCapacity)
+    {
+        if (!growStacks(argCount, size)) return false;
+    }
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
-    frame->closure   = closure;
-    frame->ip        = closure->function->chunk.code().data();
+    frame->slots     = vm.stackTop - argCount - 1;
+    return enterFrame(frame, closure, size);
+}
+
+static bool callNative(ObjNative* native, int argCount)
+{
+    if (argCount != native->arity && native->arity != NATIVE_VARIADIC)
+    {
+        runtimeError("Expected %d arguments but got %d.", native->arity, argCount);
+        return false;
+    }
 
-    frame->slots = vm.stackTop - argCount - 1;
+    Value* args = vm.stackTop - argCount;
+    if (!native->function(vm, argCount, args)) return false;
+    vm.stackTop = args;
     return true;
 }
 
@@ -149,10 +515,9 @@ static bool callValue(Value callee, int argCount)
             {
                 ObjClass* klass            = AS_CLASS(callee);
                 vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
-                Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer))
+                if (klass->initializer != nullptr)
                 {
-                    return call(AS_CLOSURE(initializer), argCount);
+                    return call(klass->initializer, argCount);
                 }
 
                 else if (argCount != 0)
@@ -166,14 +531,7 @@ static bool callValue(Value callee, int argCount)
 
             case OBJ_CLOSURE: return call(AS_CLOSURE(callee), argCount);
 
-            case OBJ_NATIVE:
-            {
-                NativeFn native = AS_NATIVE(callee);
-                Value    result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
-                return true;
-            }
+            case OBJ_NATIVE: return callNative(AS_NATIVE(callee), argCount);
 
             default:
                 // Non-callable object type.
@@ -185,16 +543,91 @@ static bool callValue(Value callee, int argCount)
     return false;
 }
 
+// The method `name` of `klass`, or nullptr. A class's methods are at
+// vm.dispatch[klass->dispatchBase + selector], in a row that leaves gaps
+// for those of other classes, so the entry says whose method it is. Names
+// no method was ever declared with have no selector and miss straight away.
+static inline ObjClosure* findMethod(ObjClass* klass, ObjString* name)
+{
+    unsigned slot = (unsigned)(klass->dispatchBase + name->selector);
+    if (slot >= (unsigned)vm.dispatchCapacity) return nullptr;
+    return vm.dispatch[slot].klass == klass ? vm.dispatch[slot].method : nullptr;
+}
+
+// Call after filling an inline cache, which lives in the chunk of the
+// function running.
+static inline void cacheBarrier()
+{
+    writeBarrier((Obj*)vm.frames[vm.frameCount - 1].closure->function);
+}
+
+// Whether an instance of `callee` can be replaced by the field locals of
+// OP_NEW_SCALAR `site`: no method may share a name with a field, and the
+// initializer, if any, has to do nothing but store fields.
+static bool scalarFits(ScalarSite* site, Value callee, int argCount)
+{
+    if (!IS_CLASS(callee)) return false;
+
+    ObjClass* klass = AS_CLASS(callee);
+    if (site->klass == klass) return true;
+
+    ObjClosure* initializer = klass->initializer;
+    if (initializer == nullptr ? argCount != 0
+                               : !initializer->function->onlyStoresFields || initializer->function->arity != argCount)
+    {
+        return false;
+    }
+
+    for (ObjString* field : site->fields)
+    {
+        if (findMethod(klass, field) != nullptr) return false;
+    }
+
+    // The first class that fits stays remembered, which traces that
+    // guard on it rely on.
+    if (site->klass == nullptr)
+    {
+        std::atomic_ref(site->klass).store(klass, std::memory_order_release);
+        cacheBarrier();
+    }
+    return true;
+}
+
+// Runs the initializer of the class in `callee` on the field locals below
+// it instead of an instance. Fields it doesn't store are UNDEFINED_VAL.
+static void newScalar(ScalarSite* site, Value* callee)
+{
+    int count = (int)site->fields.size();
+    for (int i = 0; i < count; i++) callee[i - count] = UNDEFINED_VAL;
+
+    ObjClosure* initializer = AS_CLASS(*callee)->initializer;
+    if (initializer != nullptr)
+    {
+        for (const FieldInit& store : initializer->function->fieldInits)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                if (site->fields[i] == store.name)
+                {
+                    callee[i - count] = store.param != 0 ? callee[store.param] : store.constant;
+                }
+            }
+        }
+    }
+
+    *callee = UNDEFINED_VAL;
+}
+
 static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount)
 {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method))
+    ObjClosure* method = findMethod(klass, name);
+    if (method == nullptr)
     {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
 
-    return call(AS_CLOSURE(method), argCount);
+    return call(method, argCount);
 }
 
 static bool invoke(ObjString* name, int argCount)
@@ -210,7 +643,7 @@ static bool invoke(ObjString* name, int argCount)
     ObjInstance* instance = AS_INSTANCE(receiver);
 
     Value value;
-    if (tableGet(&instance->fields, name, &value))
+    if (name->isFieldName && tableGet(&instance->fields, name, &value))
     {
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
@@ -219,458 +652,2122 @@ static bool invoke(ObjString* name, int argCount)
     return invokeFromClass(instance->klass, name, argCount);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name)
+// Remembers the bound-method lookup of a property access. The helper
+// thread may be marking the function that holds the cache.
+static void fillPropertyCache(PropertyCache* cache, ObjClass* klass, ObjClosure* method)
+{
+    std::atomic_ref(cache->klass).store(klass, std::memory_order_release);
+    std::atomic_ref(cache->method).store(method, std::memory_order_release);
+}
+
+// Looks a method up through a call site's inline cache, filling a free
+// entry on a miss. Returns nullptr if the class has no such method.
+static ObjClosure* cachedMethod(InvokeCache* cache, ObjClass* klass, ObjString* name)
 {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method))
+    for (int i = 0; i < cache->count; i++)
     {
-        runtimeError("Undefined property '%s'.", name->chars);
-        return false;
+        if (cache->klasses[i] == klass)
+        {
+            vm.cacheHits++;
+            return cache->methods[i];
+        }
     }
 
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
-    pop();
-    push(OBJ_VAL(bound));
-    return true;
-}
+    vm.cacheMisses++;
 
-static ObjUpvalue* captureUpvalue(Value* local)
-{
-    ObjUpvalue* prevUpvalue = nullptr;
-    ObjUpvalue* upvalue     = vm.openUpvalues;
+    ObjClosure* method = findMethod(klass, name);
+    if (method == nullptr) return nullptr;
 
-    while (upvalue != nullptr && upvalue->location > local)
+    if (cache->count < INVOKE_CACHE_SIZE)
     {
-        prevUpvalue = upvalue;
-        upvalue     = upvalue->next;
+        // The helper thread reads no further than the count.
+        cache->klasses[cache->count] = klass;
+        cache->methods[cache->count] = method;
+        std::atomic_ref(cache->count).store(cache->count + 1, std::memory_order_release);
+        cacheBarrier();
     }
 
-    if (upvalue != nullptr && upvalue->location == local)
+    return method;
+}
+
+// invoke() for a call site with an inline cache.
+static bool invokeCached(InvokeCache* cache, ObjString* name, int argCount)
+{
+    Value receiver = peek(argCount);
+
+    if (!IS_INSTANCE(receiver))
     {
-        return upvalue;
+        runtimeError("Only instances have methods.");
+        return false;
     }
 
-    ObjUpvalue* createdUpvalue = newUpvalue(local);
-    createdUpvalue->next       = upvalue;
+    ObjInstance* instance = AS_INSTANCE(receiver);
 
-    if (prevUpvalue == nullptr)
+    Value value;
+    if (name->isFieldName && tableGet(&instance->fields, name, &value))
     {
-        vm.openUpvalues = createdUpvalue;
+        vm.stackTop[-argCount - 1] = value;
+        return callValue(value, argCount);
     }
 
-    else
+    ObjClosure* method = cachedMethod(cache, instance->klass, name);
+    if (method == nullptr)
     {
-        prevUpvalue->next = createdUpvalue;
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
     }
 
-    return createdUpvalue;
+    return call(method, argCount);
 }
 
-static void closeUpvalues(Value* last)
+// The method an invoke in tail position hands its frame to, looked up
+// through `cache` if there is one. Returns nullptr when the invoke calls
+// a field or fails, which the ordinary invoke then takes care of.
+static ObjClosure* tailMethod(Value receiver, ObjString* name, InvokeCache* cache)
 {
-    while (vm.openUpvalues != nullptr && vm.openUpvalues->location >= last)
-    {
-        ObjUpvalue* upvalue = vm.openUpvalues;
-        upvalue->closed     = *upvalue->location;
-        upvalue->location   = &upvalue->closed;
-        vm.openUpvalues     = upvalue->next;
-    }
+    if (!IS_INSTANCE(receiver)) return nullptr;
+
+    ObjInstance* instance = AS_INSTANCE(receiver);
+
+    Value value;
+    if (name->isFieldName && tableGet(&instance->fields, name, &value)) return nullptr;
+
+    return cache != nullptr ? cachedMethod(cache, instance->klass, name) : findMethod(instance->klass, name);
 }
 
-static void defineMethod(ObjString* name)
+static bool bindMethod(ObjClass* klass, ObjString* name)
 {
-    Value     method = peek(0);
-    ObjClass* klass  = AS_CLASS(peek(1));
-    tableSet(&klass->methods, name, method);
+    ObjClosure* method = findMethod(klass, name);
+    if (method == nullptr)
+    {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    ObjBoundMethod* bound = newBoundMethod(peek(0), method);
     pop();
+    push(OBJ_VAL(bound));
+    return true;
 }
 
-static bool isFalsey(Value value)
+// bindMethod() for the register engine, where the receiver sits in a
+// register instead of on top of the stack.
+static bool bindMethodTo(ObjClass* klass, ObjString* name, Value receiver, Value* result)
 {
-    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+    ObjClosure* method = findMethod(klass, name);
+    if (method == nullptr)
+    {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    *result = OBJ_VAL(newBoundMethod(receiver, method));
+    return true;
 }
 
-static void concatenate()
+// Returns the field entry the inline cache points at if it still holds
+// `name` in this instance's table, or nullptr.
+static inline Entry* cachedField(PropertyCache* cache, Table* fields, ObjString* name)
 {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
+    if (cache->field > fields->capacity) return nullptr;
 
-    int   length = a->length + b->length;
-    char* chars  = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    Entry* entry = &fields->entries[cache->field];
+    return entry->key == name ? entry : nullptr;
+}
 
-    ObjString* result = takeString(chars, length);
-    pop();
-    pop();
-    push(OBJ_VAL(result));
+static ObjUpvalue* captureUpvalue(Value* local)
+{
+    int         slot    = (int)(local - vm.stack);
+    ObjUpvalue* upvalue = vm.openUpvalues[slot];
+    if (upvalue != nullptr) return upvalue;
+
+    upvalue               = newUpvalue(local);
+    vm.openUpvalues[slot] = upvalue;
+    vm.openUpvalueTop     = std::max(vm.openUpvalueTop, slot + 1);
+    return upvalue;
 }
 
-static InterpretResult run()
+static void closeUpvalues(Value* last)
 {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    int first = (int)(last - vm.stack);
+    for (int slot = first; slot < vm.openUpvalueTop; slot++)
+    {
+        ObjUpvalue* upvalue = vm.openUpvalues[slot];
+        if (upvalue == nullptr) continue;
+
+        Value value           = *upvalue->location;
+        upvalue->location     = &upvalue->closed;
+        storeUpvalue(upvalue, value);
+        vm.openUpvalues[slot] = nullptr;
+        writeBarrier((Obj*)upvalue);
+    }
 
-#define READ_BYTE()     (*frame->ip++)
-#define READ_SHORT()    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants()[READ_BYTE()])
-#define READ_STRING()   AS_STRING(READ_CONSTANT())
+    vm.openUpvalueTop = std::min(vm.openUpvalueTop, first);
+}
 
-#define BINARY_OP(valueType, op)                        \
-    do                                                  \
-    {                                                   \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
-        {                                               \
-            runtimeError("Operands must be numbers.");  \
-            return INTERPRET_RUNTIME_ERROR;             \
-        }                                               \
-        double b = AS_NUMBER(pop());                    \
-        double a = AS_NUMBER(pop());                    \
-        push(valueType(a op b));                        \
-    } while (false)
+// Gives `closure` its own closed copy of `value` as upvalue `index`.
+static void copyCapture(ObjClosure* closure, int index, Value value)
+{
+    // The helper thread may be marking the closure already, and mustn't
+    // see the cell before closure->cells.
+    if (closure->cells == nullptr)
+    {
+        ObjUpvalue* cells = ALLOCATE(ObjUpvalue, closure->upvalueCount);
+        std::atomic_ref(closure->cells).store(cells, std::memory_order_release);
+    }
 
-    for (;;)
+    ObjUpvalue* cell = &closure->cells[index];
+    cell->closed     = value;
+    cell->location   = &cell->closed;
+    std::atomic_ref(closure->upvalues[index]).store(cell, std::memory_order_release);
+}
+
+// Fills upvalue `index` of `closure`, just made in `frame`, from one of
+// the capture descriptors after its closure instruction.
+static void capture(ObjClosure* closure, int index, uint8_t kind, int operand, CallFrame* frame)
+{
+    switch (kind)
     {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
+        case CAPTURE_LOCAL:
         {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
+            ObjUpvalue* upvalue = captureUpvalue(frame->slots + operand);
+            std::atomic_ref(closure->upvalues[index]).store(upvalue, std::memory_order_release);
+            break;
         }
-
-        printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk,
-                               (int)(frame->ip - frame->closure->function->chunk.code().data()));
-#endif
-
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
+        case CAPTURE_VALUE: copyCapture(closure, index, frame->slots[operand]); break;
+        default:
         {
-            case OP_CONSTANT:
+            // A copy lives inside the enclosing closure, which can die first.
+            ObjUpvalue* upvalue = frame->closure->upvalues[operand];
+            if (isCell(frame->closure, upvalue))
+            {
+                copyCapture(closure, index, upvalue->closed);
+            }
+            else
+            {
+                std::atomic_ref(closure->upvalues[index]).store(upvalue, std::memory_order_release);
+            }
+            break;
+        }
+    }
+
+    // Capturing can allocate, and so promote the closure.
+    writeBarrier((Obj*)closure);
+}
+
+// Moves the callee and arguments of a call in tail position down over the
+// caller's slots, once the caller's captured locals are closed.
+static CallFrame* slideFrame(int argCount)
+{
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    if (frame->closure->function->capturesLocals) closeUpvalues(frame->slots);
+    memmove(frame->slots, vm.stackTop - argCount - 1, (argCount + 1) * sizeof(Value));
+    vm.stackTop = frame->slots + argCount + 1;
+    return frame;
+}
+
+// Calls `closure` from a call in tail position. The caller has nothing
+// left to do but return the result, so the callee takes over its frame.
+// Deep tail recursion runs in a single frame.
+static bool tailCall(ObjClosure* closure, int argCount)
+{
+    if (preempt()) return false;
+
+    int size = frameSize(closure, argCount);
+    if (size < 0) return false;
+
+    // The callee's frame may be bigger.
+    CallFrame* frame = slideFrame(argCount);
+    if (!reserveStack(frame->slots, size)) return false;
+
+    return enterFrame(frame, closure, size);
+}
+
+static void growMethods(ObjClass* klass, int capacity)
+{
+    ClassMethod* methods  = GROW_ARRAY(ClassMethod, klass->methods, klass->methodCapacity, capacity);
+    klass->methodCapacity = capacity;
+    std::atomic_ref(klass->methods).store(methods, std::memory_order_release);  // See addMethod().
+}
+
+static void addMethod(ObjClass* klass, int selector, ObjClosure* closure)
+{
+    if (klass->methodCapacity < klass->methodCount + 1) growMethods(klass, GROW_CAPACITY(klass->methodCapacity));
+    klass->methods[klass->methodCount] = {selector, closure};
+
+    // Only now, as the helper thread may be marking the class.
+    std::atomic_ref(klass->methodCount).store(klass->methodCount + 1, std::memory_order_release);
+}
+
+// Makes vm.dispatch cover `slot`.
+static void growDispatch(int slot)
+{
+    if (slot < vm.dispatchCapacity) return;
+
+    int oldCapacity     = vm.dispatchCapacity;
+    int capacity        = std::max(GROW_CAPACITY(oldCapacity), slot + 1);
+    vm.dispatch         = GROW_ARRAY(DispatchEntry, vm.dispatch, oldCapacity, capacity);
+    vm.dispatchCapacity = capacity;
+    std::fill(vm.dispatch + oldCapacity, vm.dispatch + capacity, DispatchEntry{nullptr, nullptr});
+}
+
+static bool isFreeEntry(int slot)
+{
+    return slot >= vm.dispatchCapacity || vm.dispatch[slot].klass == nullptr;
+}
+
+// Frees the class's entries in vm.dispatch.
+void removeMethods(ObjClass* klass)
+{
+    for (int i = 0; i < klass->methodCount; i++)
+    {
+        int slot = klass->dispatchBase + klass->methods[i].selector;
+        if (slot < 0 || isFreeEntry(slot) || vm.dispatch[slot].klass != klass) continue;
+
+        vm.dispatch[slot] = {nullptr, nullptr};
+        vm.dispatchFree   = std::min(vm.dispatchFree, slot);
+    }
+}
+
+// Moves the class's row to the first base where each of its methods
+// lands on a free entry, so that classes with far-apart selectors still
+// take only as many entries as they have methods.
+static void placeMethods(ObjClass* klass)
+{
+    removeMethods(klass);
+    if (klass->methodCount == 0) return;
+
+    int lowest  = INT_MAX;
+    int highest = 0;
+    for (int i = 0; i < klass->methodCount; i++)
+    {
+        lowest  = std::min(lowest, klass->methods[i].selector);
+        highest = std::max(highest, klass->methods[i].selector);
+    }
+
+    while (!isFreeEntry(vm.dispatchFree)) vm.dispatchFree++;
+    for (int base = vm.dispatchFree - lowest;; base++)
+    {
+        bool fits = true;
+        for (int i = 0; i < klass->methodCount && fits; i++)
+        {
+            fits = isFreeEntry(base + klass->methods[i].selector);
+        }
+        if (!fits) continue;
+
+        growDispatch(base + highest);
+        klass->dispatchBase = base;
+        for (int i = 0; i < klass->methodCount; i++)
+        {
+            vm.dispatch[base + klass->methods[i].selector] = {klass, klass->methods[i].closure};
+        }
+        return;
+    }
+}
+
+static void setMethod(ObjClass* klass, ObjString* name, Value method)
+{
+    ObjClosure* closure  = AS_CLOSURE(method);
+    int         selector = name->selector;
+    int         slot     = klass->dispatchBase + selector;
+    if (findMethod(klass, name) != nullptr)
+    {
+        // An override of an inherited method.
+        for (int i = 0; i < klass->methodCount; i++)
+        {
+            if (klass->methods[i].selector != selector) continue;
+            std::atomic_ref(klass->methods[i].closure).store(closure, std::memory_order_release);
+        }
+        vm.dispatch[slot].method = closure;
+    }
+    else
+    {
+        addMethod(klass, selector, closure);
+        if (slot >= 0 && isFreeEntry(slot))
+        {
+            growDispatch(slot);
+            vm.dispatch[slot] = {klass, closure};
+        }
+        else
+        {
+            placeMethods(klass);
+        }
+    }
+
+    if (name == vm.initString) std::atomic_ref(klass->initializer).store(closure, std::memory_order_release);
+    writeBarrier((Obj*)klass);
+}
+
+static void defineMethod(ObjString* name)
+{
+    setMethod(AS_CLASS(peek(1)), name, peek(0));
+    pop();
+}
+
+// Copies down the methods of the superclass, before the subclass defines
+// any of its own.
+static void inherit(ObjClass* superclass, ObjClass* subclass)
+{
+    growMethods(subclass, superclass->methodCount);
+    std::copy_n(superclass->methods, superclass->methodCount, subclass->methods);
+    std::atomic_ref(subclass->methodCount).store(superclass->methodCount, std::memory_order_release);
+    placeMethods(subclass);
+    std::atomic_ref(subclass->initializer).store(superclass->initializer, std::memory_order_release);
+    writeBarrier((Obj*)subclass);
+}
+
+// Stores a field, keeping track of how many instances of the class grow
+// to so that newInstance() can make room for them up front.
+static void setField(ObjInstance* instance, ObjString* name, Value value)
+{
+    if (tableSet(&instance->fields, name, value))
+    {
+        ObjClass* klass   = instance->klass;
+        klass->fieldCount = std::max(klass->fieldCount, instance->fields.count);
+    }
+    writeBarrier((Obj*)instance);
+
+    name->isFieldName = true;
+}
+
+static bool isFalsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static ObjString* concatenateStrings(ObjString* a, ObjString* b)
+{
+    int   length = a->length + b->length;
+    char* chars  = ALLOCATE(char, length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+
+    return takeString(chars, length);
+}
+
+static void concatenate()
+{
+    ObjString* b = AS_STRING(peek(0));
+    ObjString* a = AS_STRING(peek(1));
+
+    ObjString* result = concatenateStrings(a, b);
+    pop();
+    pop();
+    push(OBJ_VAL(result));
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(CallFrame* frame)
+{
+    printf("          ");
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
+    {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+
+    printf("\n");
+    disassembleInstruction(&frame->closure->function->chunk,
+                           (int)(frame->ip - frame->closure->function->chunk.code().data()));
+}
+
+static void traceRegisters(CallFrame* frame)
+{
+    printf("          ");
+    for (Value* slot = frame->slots; slot < vm.stackTop; slot++)
+    {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+
+    printf("\n");
+    RegChunk* chunk = frame->closure->function->regChunk.get();
+    disassembleRegInstruction(chunk, (int)(frame->pc - chunk->code().data()));
+}
+#endif
+
+#ifdef COMPUTED_GOTO
+// Labels-as-values is a GNU extension; keep -Wpedantic quiet about it here.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// Runs the interpreter loop until the frame at index `baseFrame` returns.
+// That is the script's frame, except when JIT code calls a function that
+// isn't compiled.
+static InterpretResult run(int baseFrame)
+{
+    // The hot state lives in locals so the compiler can keep it in
+    // registers. It is written back to the frame and to vm.stackTop only
+    // where someone else looks at it: calls, returns, anything that can
+    // allocate (and so collect), and runtime errors.
+    CallFrame*  frame     = &vm.frames[vm.frameCount - 1];
+    uint8_t*    ip        = frame->ip;
+    Value*      slots     = frame->slots;
+    Value*      constants = frame->closure->function->chunk.constants().data();
+    ObjString** names     = frame->closure->function->chunk.names().data();
+    Value*      sp        = vm.stackTop;
+
+#define READ_BYTE()           (*ip++)
+#define READ_SHORT()          (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT()       (constants[READ_BYTE()])
+#define READ_STRING()         (names[READ_BYTE()])
+#define READ_PROPERTY_CACHE() (&frame->closure->function->chunk.propertyCaches()[READ_SHORT()])
+#define READ_INVOKE_CACHE()   (&frame->closure->function->chunk.invokeCaches()[READ_SHORT()])
+
+#define PUSH(value)    (*sp++ = (value))
+#define POP()          (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+#define STORE_FRAME()     \
+    do                    \
+    {                     \
+        frame->ip   = ip; \
+        vm.stackTop = sp; \
+    } while (false)
+
+#define LOAD_FRAME()                                                    \
+    do                                                                  \
+    {                                                                   \
+        frame     = &vm.frames[vm.frameCount - 1];                      \
+        ip        = frame->ip;                                          \
+        slots     = frame->slots;                                       \
+        constants = frame->closure->function->chunk.constants().data(); \
+        names     = frame->closure->function->chunk.names().data();     \
+        sp        = vm.stackTop;                                        \
+    } while (false)
+
+#define RUNTIME_ERROR(...)              \
+    do                                  \
+    {                                   \
+        STORE_FRAME();                  \
+        runtimeError(__VA_ARGS__);      \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
+#define BINARY_OP(valueType, op)                        \
+    do                                                  \
+    {                                                   \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
+        {                                               \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        }                                               \
+        double b = AS_NUMBER(POP());                    \
+        double a = AS_NUMBER(POP());                    \
+        PUSH(valueType(a op b));                        \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()    \
+    do                         \
+    {                          \
+        STORE_FRAME();         \
+        traceExecution(frame); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() \
+    do                      \
+    {                       \
+    } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // One entry per OpCode, in enum order. Each handler jumps straight to the
+    // next one instead of going back through the shared switch branch.
+    static void* dispatchTable[] = {
+        &&TARGET_OP_CONSTANT,
+        &&TARGET_OP_NIL,
+        &&TARGET_OP_TRUE,
+        &&TARGET_OP_FALSE,
+        &&TARGET_OP_POP,
+        &&TARGET_OP_GET_LOCAL,
+        &&TARGET_OP_SET_LOCAL,
+        &&TARGET_OP_GET_GLOBAL,
+        &&TARGET_OP_DEFINE_GLOBAL,
+        &&TARGET_OP_SET_GLOBAL,
+        &&TARGET_OP_GET_UPVALUE,
+        &&TARGET_OP_SET_UPVALUE,
+        &&TARGET_OP_GET_PROPERTY,
+        &&TARGET_OP_SET_PROPERTY,
+        &&TARGET_OP_GET_SUPER,
+        &&TARGET_OP_EQUAL,
+        &&TARGET_OP_GREATER,
+        &&TARGET_OP_LESS,
+        &&TARGET_OP_ADD,
+        &&TARGET_OP_SUBTRACT,
+        &&TARGET_OP_MULTIPLY,
+        &&TARGET_OP_DIVIDE,
+        &&TARGET_OP_NOT,
+        &&TARGET_OP_NEGATE,
+        &&TARGET_OP_PRINT,
+        &&TARGET_OP_JUMP,
+        &&TARGET_OP_JUMP_IF_FALSE,
+        &&TARGET_OP_LOOP,
+        &&TARGET_OP_CALL,
+        &&TARGET_OP_TAIL_CALL,
+        &&TARGET_OP_INVOKE,
+        &&TARGET_OP_SUPER_INVOKE,
+        &&TARGET_OP_TAIL_INVOKE,
+        &&TARGET_OP_TAIL_SUPER_INVOKE,
+        &&TARGET_OP_CLOSURE,
+        &&TARGET_OP_CLOSE_UPVALUE,
+        &&TARGET_OP_RETURN,
+        &&TARGET_OP_CLASS,
+        &&TARGET_OP_INHERIT,
+        &&TARGET_OP_METHOD,
+        &&TARGET_OP_POP_JUMP_IF_FALSE,
+        &&TARGET_OP_LESS_JUMP_IF_FALSE,
+        &&TARGET_OP_GET_LOCAL_PROPERTY,
+        &&TARGET_OP_GET_LOCAL_CONSTANT,
+        &&TARGET_OP_RETURN_NIL,
+        &&TARGET_OP_CONSTANT_LONG,
+        &&TARGET_OP_GET_LOCAL_LONG,
+        &&TARGET_OP_SET_LOCAL_LONG,
+        &&TARGET_OP_GET_UPVALUE_LONG,
+        &&TARGET_OP_SET_UPVALUE_LONG,
+        &&TARGET_OP_CLOSURE_LONG,
+        &&TARGET_OP_ADD_NUM,
+        &&TARGET_OP_ADD_STR,
+        &&TARGET_OP_CALL_CLOSURE,
+        &&TARGET_OP_CALL_NATIVE,
+        &&TARGET_OP_LOOP_TRACE,
+        &&TARGET_OP_NEW_SCALAR,
+        &&TARGET_OP_GET_SCALAR,
+        &&TARGET_OP_SET_SCALAR,
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OP_SET_SCALAR + 1,
+                  "dispatchTable must have one entry per OpCode.");
+
+#define CASE(op) \
+    case op:     \
+    TARGET_##op
+#define DISPATCH()                                      \
+    do                                                  \
+    {                                                   \
+        TRACE_INSTRUCTION();                            \
+        goto* dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+#else
+#define CASE(op)   case op
+#define DISPATCH() continue
+#endif
+
+    uint8_t instruction;
+    for (;;)
+    {
+        TRACE_INSTRUCTION();
+
+        switch (instruction = READ_BYTE())
+        {
+            CASE(OP_CONSTANT_LONG):
+            {
+                Value constant = constants[READ_SHORT()];
+                PUSH(constant);
+                DISPATCH();
+            }
+
+            CASE(OP_GET_LOCAL_LONG):
+            {
+                uint16_t slot = READ_SHORT();
+                PUSH(slots[slot]);
+                DISPATCH();
+            }
+
+            CASE(OP_SET_LOCAL_LONG):
+            {
+                uint16_t slot = READ_SHORT();
+                slots[slot]   = PEEK(0);
+                DISPATCH();
+            }
+
+            CASE(OP_GET_UPVALUE_LONG):
+            {
+                uint16_t slot = READ_SHORT();
+                PUSH(*frame->closure->upvalues[slot]->location);
+                DISPATCH();
+            }
+
+            CASE(OP_SET_UPVALUE_LONG):
+            {
+                ObjUpvalue* upvalue = frame->closure->upvalues[READ_SHORT()];
+                storeUpvalue(upvalue, PEEK(0));
+                writeBarrier((Obj*)upvalue);
+                DISPATCH();
+            }
+
+            CASE(OP_CONSTANT):
             {
                 Value constant = READ_CONSTANT();
-                push(constant);
-                break;
+                PUSH(constant);
+                DISPATCH();
+            }
+
+            CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+            CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+            CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+            CASE(OP_POP): sp--; DISPATCH();
+
+            CASE(OP_GET_LOCAL):
+            {
+                uint8_t slot = READ_BYTE();
+                PUSH(slots[slot]);
+                DISPATCH();
+            }
+
+            CASE(OP_GET_LOCAL_CONSTANT):
+            {
+                uint8_t slot = READ_BYTE();
+                PUSH(slots[slot]);
+                PUSH(READ_CONSTANT());
+                DISPATCH();
+            }
+
+            CASE(OP_SET_LOCAL):
+            {
+                uint8_t slot = READ_BYTE();
+                slots[slot]  = PEEK(0);
+                DISPATCH();
+            }
+
+            CASE(OP_GET_GLOBAL):
+            {
+                uint16_t slot  = READ_SHORT();
+                Value    value = vm.globalValues[slot];
+                if (IS_UNDEFINED(value))
+                {
+                    RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
+                }
+
+                PUSH(value);
+                DISPATCH();
+            }
+
+            CASE(OP_DEFINE_GLOBAL):
+            {
+                uint16_t slot         = READ_SHORT();
+                vm.globalValues[slot] = POP();
+                DISPATCH();
+            }
+
+            CASE(OP_SET_GLOBAL):
+            {
+                uint16_t slot = READ_SHORT();
+                if (IS_UNDEFINED(vm.globalValues[slot]))
+                {
+                    RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
+                }
+
+                vm.globalValues[slot] = PEEK(0);
+                DISPATCH();
+            }
+
+            CASE(OP_GET_UPVALUE):
+            {
+                uint8_t slot = READ_BYTE();
+                PUSH(*frame->closure->upvalues[slot]->location);
+                DISPATCH();
+            }
+
+            CASE(OP_SET_UPVALUE):
+            {
+                ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+                storeUpvalue(upvalue, PEEK(0));
+                writeBarrier((Obj*)upvalue);
+                DISPATCH();
+            }
+
+            CASE(OP_GET_SCALAR):
+                if (IS_UNDEFINED(slots[ip[1]]))
+                {
+                    Value value = slots[ip[0]];
+                    if (IS_UNDEFINED(value))
+                    {
+                        ObjString* name = names[ip[2]];
+                        RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+                    }
+
+                    PUSH(value);
+                    ip += 5;
+                    DISPATCH();
+                }
+                ip++;  // A real instance: skip the field's slot.
+                [[fallthrough]];
+
+            CASE(OP_GET_LOCAL_PROPERTY):
+                PUSH(slots[READ_BYTE()]);
+                [[fallthrough]];
+
+            CASE(OP_GET_PROPERTY):
+            {
+                if (!IS_INSTANCE(PEEK(0)))
+                {
+                    RUNTIME_ERROR("Only instances have properties.");
+                }
+
+                ObjInstance*   instance = AS_INSTANCE(PEEK(0));
+                ObjString*     name     = READ_STRING();
+                PropertyCache* cache    = READ_PROPERTY_CACHE();
+
+                Entry* field = cachedField(cache, &instance->fields, name);
+                if (field != nullptr)
+                {
+                    vm.cacheHits++;
+                    PEEK(0) = field->value;  // Replace the instance.
+                    DISPATCH();
+                }
+
+                // Names never stored as fields, as those of methods usually
+                // are, skip the probe.
+                field = name->isFieldName ? tableGetEntry(&instance->fields, name) : nullptr;
+                if (field != nullptr)
+                {
+                    vm.cacheMisses++;
+                    cache->field = (int)(field - instance->fields.entries);
+                    PEEK(0)      = field->value;  // Replace the instance.
+                    DISPATCH();
+                }
+
+                if (cache->klass == instance->klass)
+                {
+                    vm.cacheHits++;
+                }
+                else
+                {
+                    vm.cacheMisses++;
+
+                    ObjClosure* method = findMethod(instance->klass, name);
+                    if (method == nullptr)
+                    {
+                        RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+                    }
+
+                    fillPropertyCache(cache, instance->klass, method);
+                    writeBarrier((Obj*)frame->closure->function);
+                }
+
+                STORE_FRAME();
+                ObjBoundMethod* bound = newBoundMethod(PEEK(0), cache->method);
+                PEEK(0)               = OBJ_VAL(bound);
+                DISPATCH();
+            }
+
+            CASE(OP_SET_SCALAR):
+                if (IS_UNDEFINED(PEEK(1)))
+                {
+                    slots[ip[0]] = PEEK(0);
+                    Value value  = POP();
+                    PEEK(0)      = value;  // Replace the instance.
+                    ip += 4;
+                    DISPATCH();
+                }
+                ip++;  // A real instance: skip the field's slot.
+                [[fallthrough]];
+
+            CASE(OP_SET_PROPERTY):
+            {
+                if (!IS_INSTANCE(PEEK(1)))
+                {
+                    RUNTIME_ERROR("Only instances have fields.");
+                }
+
+                ObjInstance*   instance = AS_INSTANCE(PEEK(1));
+                ObjString*     name     = READ_STRING();
+                PropertyCache* cache    = READ_PROPERTY_CACHE();
+
+                Entry* field = cachedField(cache, &instance->fields, name);
+                if (field != nullptr)
+                {
+                    vm.cacheHits++;
+                    storeEntryValue(field, PEEK(0));
+                    writeBarrier((Obj*)instance);
+                }
+                else
+                {
+                    vm.cacheMisses++;
+                    STORE_FRAME();
+                    setField(instance, name, PEEK(0));
+                    field        = tableGetEntry(&instance->fields, name);
+                    cache->field = (int)(field - instance->fields.entries);
+                }
+
+                Value value = POP();
+                PEEK(0)     = value;  // Replace the instance.
+                DISPATCH();
+            }
+
+            CASE(OP_GET_SUPER):
+            {
+                ObjString* name       = READ_STRING();
+                ObjClass*  superclass = AS_CLASS(POP());
+                STORE_FRAME();
+                if (!bindMethod(superclass, name))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                sp = vm.stackTop;
+                DISPATCH();
+            }
+
+            CASE(OP_EQUAL):
+            {
+                Value b = POP();
+                Value a = POP();
+                PUSH(BOOL_VAL(valuesEqual(a, b)));
+                DISPATCH();
+            }
+
+            CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+            CASE(OP_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+            CASE(OP_ADD_NUM):
+                if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+                {
+                    double b = AS_NUMBER(POP());
+                    double a = AS_NUMBER(POP());
+                    PUSH(NUMBER_VAL(a + b));
+                    DISPATCH();
+                }
+                [[fallthrough]];
+
+            CASE(OP_ADD_STR):
+                if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1)))
+                {
+                    STORE_FRAME();
+                    concatenate();
+                    sp = vm.stackTop;
+                    DISPATCH();
+                }
+                [[fallthrough]];
+
+            CASE(OP_ADD):
+            {
+                // Only the first execution picks a quickened form, so a site
+                // that sees both kinds of operands doesn't keep flipping.
+                if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1)))
+                {
+                    if (instruction == OP_ADD) ip[-1] = OP_ADD_STR;
+                    STORE_FRAME();
+                    concatenate();
+                    sp = vm.stackTop;
+                }
+
+                else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+                {
+                    if (instruction == OP_ADD) ip[-1] = OP_ADD_NUM;
+                    double b = AS_NUMBER(POP());
+                    double a = AS_NUMBER(POP());
+                    PUSH(NUMBER_VAL(a + b));
+                }
+
+                else
+                {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+
+                DISPATCH();
+            }
+
+            CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+            CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+            CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+            CASE(OP_NOT): PEEK(0) = BOOL_VAL(isFalsey(PEEK(0))); DISPATCH();
+            CASE(OP_NEGATE):
+                if (!IS_NUMBER(PEEK(0)))
+                {
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
+
+                PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+                DISPATCH();
+
+            CASE(OP_PRINT):
+            {
+                printValue(POP());
+                printf("\n");
+                DISPATCH();
+            }
+
+            CASE(OP_JUMP):
+            {
+                uint16_t offset = READ_SHORT();
+                ip += offset;
+                DISPATCH();
+            }
+
+            CASE(OP_JUMP_IF_FALSE):
+            {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(PEEK(0))) ip += offset;
+                DISPATCH();
+            }
+
+            CASE(OP_POP_JUMP_IF_FALSE):
+            {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(POP())) ip += offset;
+                DISPATCH();
+            }
+
+            CASE(OP_LESS_JUMP_IF_FALSE):
+            {
+                uint16_t offset = READ_SHORT();
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                if (!(a < b)) ip += offset;
+                DISPATCH();
+            }
+
+            CASE(OP_LOOP):
+            {
+                uint16_t offset = READ_SHORT();
+                ip -= offset;
+                if (preempt()) return INTERPRET_INTERRUPTED;
+#ifdef JIT
+                // The counters are shared by loops that hash alike, which at
+                // worst gets a loop recorded early.
+                if (++vm.hotLoops[HOT_LOOP(ip)] >= JIT_LOOP_THRESHOLD)
+                {
+                    vm.hotLoops[HOT_LOOP(ip)] = 0;
+                    STORE_FRAME();
+                    if (!recordTrace(frame, ip + offset - 3))
+                    {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+
+                    LOAD_FRAME();
+                }
+#endif
+                DISPATCH();
+            }
+
+            CASE(OP_LOOP_TRACE):
+            {
+                uint16_t offset = READ_SHORT();
+                ip -= offset;
+                if (preempt()) return INTERPRET_INTERRUPTED;
+#ifdef JIT
+                STORE_FRAME();
+                if (!runTrace(frame, ip + offset - 3))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                LOAD_FRAME();
+#endif
+                DISPATCH();
+            }
+
+            CASE(OP_NEW_SCALAR):
+            {
+                ScalarSite* site = &frame->closure->function->chunk.scalarSites()[READ_SHORT()];
+                if (scalarFits(site, PEEK(ip[0]), ip[0]))
+                {
+                    int argCount = READ_BYTE();
+                    newScalar(site, sp - argCount - 1);
+                    sp -= argCount;
+                    DISPATCH();
+                }
+            }
+                [[fallthrough]];
+
+            CASE(OP_CALL_CLOSURE):
+                if (IS_CLOSURE(PEEK(ip[0])))
+                {
+                    int argCount = READ_BYTE();
+                    STORE_FRAME();
+                    if (!call(AS_CLOSURE(PEEK(argCount)), argCount))
+                    {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+
+                    LOAD_FRAME();
+                    DISPATCH();
+                }
+                [[fallthrough]];
+
+            CASE(OP_CALL_NATIVE):
+                if (IS_NATIVE(PEEK(ip[0])))
+                {
+                    // A pure native can't fail or start a collection, so
+                    // it doesn't need the frame stored.
+                    ObjNative* native = AS_NATIVE(PEEK(ip[0]));
+                    if (native->pure && native->arity == ip[0])
+                    {
+                        int argCount = READ_BYTE();
+                        native->function(vm, argCount, sp - argCount);
+                        sp -= argCount;
+                        DISPATCH();
+                    }
+                }
+                [[fallthrough]];
+
+            CASE(OP_CALL):
+            {
+                int   argCount = READ_BYTE();
+                Value callee   = PEEK(argCount);
+                if (instruction == OP_CALL)
+                {
+                    if (IS_CLOSURE(callee)) ip[-2] = OP_CALL_CLOSURE;
+                    else if (IS_NATIVE(callee)) ip[-2] = OP_CALL_NATIVE;
+                }
+
+                STORE_FRAME();
+                if (!callValue(callee, argCount))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                LOAD_FRAME();
+                DISPATCH();
             }
 
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
+            CASE(OP_TAIL_CALL):
+            {
+                int   argCount = READ_BYTE();
+                Value callee   = PEEK(argCount);
+                STORE_FRAME();
+                if (!IS_CLOSURE(callee))
+                {
+                    // Natives, classes and bound methods are called as
+                    // usual, and the OP_RETURN that follows returns their
+                    // result.
+                    if (!callValue(callee, argCount))
+                    {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+
+                    LOAD_FRAME();
+                    DISPATCH();
+                }
+
+                if (!tailCall(AS_CLOSURE(callee), argCount))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                // A compiled callee has already returned from the frame.
+                if (vm.frameCount == baseFrame) return INTERPRET_OK;
+
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            CASE(OP_INVOKE):
+            {
+                ObjString*   method   = READ_STRING();
+                int          argCount = READ_BYTE();
+                InvokeCache* cache    = READ_INVOKE_CACHE();
+                STORE_FRAME();
+                if (!invokeCached(cache, method, argCount))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            CASE(OP_TAIL_INVOKE):
+            {
+                ObjString*   name     = READ_STRING();
+                int          argCount = READ_BYTE();
+                InvokeCache* cache    = READ_INVOKE_CACHE();
+                STORE_FRAME();
+
+                // A method takes over the frame, as in OP_TAIL_CALL. A
+                // field is called as usual, and the OP_RETURN that follows
+                // returns its result.
+                ObjClosure* method = tailMethod(PEEK(argCount), name, cache);
+                if (method != nullptr ? !tailCall(method, argCount) : !invokeCached(cache, name, argCount))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                // A compiled callee has already returned from the frame.
+                if (vm.frameCount == baseFrame) return INTERPRET_OK;
+
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            CASE(OP_TAIL_SUPER_INVOKE):
+            CASE(OP_SUPER_INVOKE):
+            {
+                ObjString*   name       = READ_STRING();
+                int          argCount   = READ_BYTE();
+                InvokeCache* cache      = READ_INVOKE_CACHE();
+                ObjClass*    superclass = AS_CLASS(POP());
+
+                ObjClosure* method = cachedMethod(cache, superclass, name);
+                if (method == nullptr)
+                {
+                    RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+                }
+
+                STORE_FRAME();
+                if (instruction == OP_TAIL_SUPER_INVOKE)
+                {
+                    if (!tailCall(method, argCount))
+                    {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+
+                    if (vm.frameCount == baseFrame) return INTERPRET_OK;
+                }
+                else if (!call(method, argCount))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            CASE(OP_CLOSURE_LONG):
+            CASE(OP_CLOSURE):
+            {
+                bool         wide     = instruction == OP_CLOSURE_LONG;
+                ObjFunction* function = AS_FUNCTION(wide ? constants[READ_SHORT()] : READ_CONSTANT());
+                STORE_FRAME();
+                ObjClosure* closure = newClosure(function);
+                PUSH(OBJ_VAL(closure));
+                vm.stackTop = sp;  // Keep the closure rooted while capturing.
+                for (int i = 0; i < closure->upvalueCount; i++)
+                {
+                    uint8_t kind    = READ_BYTE();
+                    int     operand = wide ? READ_SHORT() : READ_BYTE();
+                    capture(closure, i, kind, operand, frame);
+                }
+
+                DISPATCH();
+            }
+
+            CASE(OP_CLOSE_UPVALUE):
+                closeUpvalues(sp - 1);
+                sp--;
+                DISPATCH();
+
+            CASE(OP_RETURN_NIL):
+                PUSH(NIL_VAL);
+                [[fallthrough]];
+
+            CASE(OP_RETURN):
+            {
+                Value result = POP();
+
+                if (frame->closure->function->capturesLocals) closeUpvalues(slots);
+
+                vm.frameCount--;
+                if (vm.frameCount == 0)
+                {
+                    vm.stackTop = slots;
+                    return INTERPRET_OK;
+                }
+
+                sp = slots;
+                PUSH(result);
+                vm.stackTop = sp;
+                if (vm.frameCount == baseFrame) return INTERPRET_OK;
+
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            CASE(OP_CLASS):
+            {
+                ObjString* name = READ_STRING();
+                STORE_FRAME();
+                PUSH(OBJ_VAL(newClass(name)));
+                DISPATCH();
+            }
+
+            CASE(OP_INHERIT):
+            {
+                Value superclass = PEEK(1);
+                if (!IS_CLASS(superclass))
+                {
+                    RUNTIME_ERROR("Superclass must be a class.");
+                }
+
+                ObjClass* subclass = AS_CLASS(PEEK(0));
+                STORE_FRAME();
+                inherit(AS_CLASS(superclass), subclass);
+                sp--;  // Subclass.
+                DISPATCH();
+            }
+
+            CASE(OP_METHOD):
+            {
+                ObjString* name = READ_STRING();
+                STORE_FRAME();
+                defineMethod(name);
+                sp = vm.stackTop;
+                DISPATCH();
+            }
+        }
+    }
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_PROPERTY_CACHE
+#undef READ_INVOKE_CACHE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef TRACE_INSTRUCTION
+#undef CASE
+#undef DISPATCH
+}
+
+#ifdef JIT
+bool jitError(const char* message)
+{
+    runtimeError("%s", message);
+    return false;
+}
+
+// Compiled code has already counted the back-edge that got here.
+bool jitPreempt()
+{
+    stopScript();
+    return false;
+}
+
+bool jitUndefinedVariable(int slot)
+{
+    runtimeError("Undefined variable '%s'.", globalName(slot)->chars);
+    return false;
+}
+
+bool jitUndefinedProperty(ObjString* name)
+{
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+}
+
+bool jitGetProperty(ObjString* name, PropertyCache* cache)
+{
+    if (!IS_INSTANCE(peek(0)))
+    {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(peek(0));
+
+    Entry* field = cachedField(cache, &instance->fields, name);
+    if (field == nullptr && name->isFieldName)
+    {
+        field = tableGetEntry(&instance->fields, name);
+        if (field != nullptr) cache->field = (int)(field - instance->fields.entries);
+    }
+
+    if (field != nullptr)
+    {
+        vm.stackTop[-1] = field->value;  // Replace the instance.
+        return true;
+    }
+
+    if (cache->klass != instance->klass)
+    {
+        ObjClosure* method = findMethod(instance->klass, name);
+        if (method == nullptr)
+        {
+            runtimeError("Undefined property '%s'.", name->chars);
+            return false;
+        }
+
+        fillPropertyCache(cache, instance->klass, method);
+        cacheBarrier();
+    }
+
+    vm.stackTop[-1] = OBJ_VAL(newBoundMethod(peek(0), cache->method));
+    return true;
+}
 
-            case OP_GET_LOCAL:
-            {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
+bool jitSetProperty(ObjString* name, PropertyCache* cache)
+{
+    if (!IS_INSTANCE(peek(1)))
+    {
+        runtimeError("Only instances have fields.");
+        return false;
+    }
 
-            case OP_SET_LOCAL:
-            {
-                uint8_t slot       = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
+    ObjInstance* instance = AS_INSTANCE(peek(1));
+
+    Entry* field = cachedField(cache, &instance->fields, name);
+    if (field != nullptr)
+    {
+        storeEntryValue(field, peek(0));
+        writeBarrier((Obj*)instance);
+    }
+    else
+    {
+        setField(instance, name, peek(0));
+        field        = tableGetEntry(&instance->fields, name);
+        cache->field = (int)(field - instance->fields.entries);
+    }
+
+    Value value = pop();
+    pop();
+    push(value);
+    return true;
+}
+
+bool jitGetSuper(ObjString* name)
+{
+    ObjClass* superclass = AS_CLASS(pop());
+    return bindMethod(superclass, name);
+}
+
+bool jitAdd()
+{
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+    {
+        concatenate();
+        return true;
+    }
+
+    runtimeError("Operands must be two numbers or two strings.");
+    return false;
+}
+
+bool jitPrint()
+{
+    printValue(pop());
+    printf("\n");
+    return true;
+}
+
+// Finishes a call made from JIT code. A callee that isn't compiled has
+// only had its frame pushed, so run it in a nested interpreter loop.
+static bool finishJitCall(int frameCount)
+{
+    return vm.frameCount == frameCount || run(frameCount) == INTERPRET_OK;
+}
+
+bool jitCall(int argCount)
+{
+    int frameCount = vm.frameCount;
+    return callValue(peek(argCount), argCount) && finishJitCall(frameCount);
+}
+
+// Finishes a call compiled code made straight to compiled code, whose
+// callee handed its frame over in a tail call rather than returning.
+bool jitResumeCall()
+{
+    int frameIndex = vm.frameCount - 1;
+    return runCompiled(frameIndex) && finishJitCall(frameIndex);
+}
+
+bool jitNewScalar(ScalarSite* site, int argCount)
+{
+    if (!scalarFits(site, peek(argCount), argCount)) return jitCall(argCount);
+
+    newScalar(site, vm.stackTop - argCount - 1);
+    vm.stackTop -= argCount;
+    return true;
+}
+
+// Hands the frame of a compiled function over to the closure it calls in
+// tail position. The compiled code then jumps to the callee's, if it has
+// been compiled, or returns and leaves the callee to runCompiled().
+static bool handOverFrame(ObjClosure* closure, int argCount)
+{
+    if (preempt()) return false;
+
+    int size = frameSize(closure, argCount);
+    if (size < 0) return false;
+
+    // The callee's frame may be bigger. The JIT code returns right after,
+    // so the stack can move.
+    CallFrame* frame = slideFrame(argCount);
+    if (!reserveStack(frame->slots, size)) return false;
+
+    frame->closure = closure;
+    frame->ip      = closure->function->chunk.code().data();
+    return true;
+}
+
+bool jitTailCall(int argCount)
+{
+    return handOverFrame(AS_CLOSURE(peek(argCount)), argCount);
+}
+
+bool jitInvoke(ObjString* name, int argCount, InvokeCache* cache)
+{
+    int frameCount = vm.frameCount;
+    return invokeCached(cache, name, argCount) && finishJitCall(frameCount);
+}
+
+bool jitSuperInvoke(ObjString* name, int argCount, InvokeCache* cache)
+{
+    int         frameCount = vm.frameCount;
+    ObjClosure* method     = cachedMethod(cache, AS_CLASS(pop()), name);
+    if (method == nullptr)
+    {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    return call(method, argCount) && finishJitCall(frameCount);
+}
+
+// jitTailCall() for OP_TAIL_INVOKE. A field is called as usual instead,
+// which leaves the frame where it was.
+bool jitTailInvoke(ObjString* name, int argCount, InvokeCache* cache)
+{
+    ObjClosure* method = tailMethod(peek(argCount), name, cache);
+    if (method != nullptr) return handOverFrame(method, argCount);
+
+    return jitInvoke(name, argCount, cache);
+}
+
+bool jitTailSuperInvoke(ObjString* name, int argCount, InvokeCache* cache)
+{
+    ObjClosure* method = cachedMethod(cache, AS_CLASS(pop()), name);
+    if (method == nullptr)
+    {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    return handOverFrame(method, argCount);
+}
+
+bool jitClosure(ObjFunction* function, uint8_t* captures, bool wide)
+{
+    CallFrame*  frame   = &vm.frames[vm.frameCount - 1];
+    ObjClosure* closure = newClosure(function);
+    push(OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++)
+    {
+        uint8_t kind    = *captures++;
+        int     operand = *captures++;
+        if (wide) operand = (operand << 8) | *captures++;
+        capture(closure, i, kind, operand, frame);
+    }
+
+    return true;
+}
+
+bool jitCloseUpvalue()
+{
+    closeUpvalues(vm.stackTop - 1);
+    pop();
+    return true;
+}
+
+bool jitRememberUpvalue(int index)
+{
+    rememberObject((Obj*)vm.frames[vm.frameCount - 1].closure->upvalues[index]);
+    return true;
+}
+
+bool jitReturn()
+{
+    CallFrame* frame  = &vm.frames[vm.frameCount - 1];
+    Value      result = pop();
+    if (frame->closure->function->capturesLocals) closeUpvalues(frame->slots);
+
+    vm.frameCount--;
+    vm.stackTop = frame->slots;
+    push(result);
+    return true;
+}
+
+bool jitClass(ObjString* name)
+{
+    push(OBJ_VAL(newClass(name)));
+    return true;
+}
+
+bool jitInherit()
+{
+    Value superclass = peek(1);
+    if (!IS_CLASS(superclass))
+    {
+        runtimeError("Superclass must be a class.");
+        return false;
+    }
+
+    inherit(AS_CLASS(superclass), AS_CLASS(peek(0)));
+    pop();  // Subclass.
+    return true;
+}
+
+bool jitMethod(ObjString* name)
+{
+    defineMethod(name);
+    return true;
+}
+#endif
+
+// The register engine. Instructions name the frame slots they read and
+// write, so locals and constants feed operations directly instead of being
+// pushed first. vm.stackTop stays at the end of the current frame's
+// registers, which keeps all of them visible to the GC.
+static InterpretResult runRegisters()
+{
+    int             frameIndex = vm.frameCount - 1;
+    CallFrame*      frame      = &vm.frames[frameIndex];
+    RegInstruction* pc         = frame->pc;
+    Value*          slots      = frame->slots;
+    RegChunk*       chunk      = frame->closure->function->regChunk.get();
+    Value*          constants  = chunk->constants().data();
+
+#define RK(operand)        (((operand)&RK_CONSTANT) ? constants[(operand) & ~RK_CONSTANT] : slots[operand])
+#define READ_STRING(index) AS_STRING(constants[index])
+
+#define STORE_FRAME() (frame->pc = pc)
+
+#define LOAD_FRAME()                                           \
+    do                                                         \
+    {                                                          \
+        frameIndex = vm.frameCount - 1;                        \
+        frame      = &vm.frames[frameIndex];                   \
+        pc         = frame->pc;                                \
+        slots      = frame->slots;                             \
+        chunk      = frame->closure->function->regChunk.get(); \
+        constants  = chunk->constants().data();                \
+    } while (false)
 
-            case OP_GET_GLOBAL:
+// After callValue() or invoke(): either a new frame was pushed, or a native
+// or a class without an initializer left its result in the callee's slot.
+// Those ran with the registers above the arguments hidden from the GC, so
+// clear them before they are traced again. A new frame may have moved the
+// stacks, so only the frame index is trusted.
+#define FINISH_CALL()                                                \
+    do                                                               \
+    {                                                                \
+        if (vm.frameCount - 1 == frameIndex)                         \
+        {                                                            \
+            Value* frameTop = slots + chunk->slotCount();            \
+            for (Value* slot = vm.stackTop; slot < frameTop; slot++) \
+            {                                                        \
+                *slot = NIL_VAL;                                     \
+            }                                                        \
+            vm.stackTop = frameTop;                                  \
+        }                                                            \
+        else                                                         \
+        {                                                            \
+            LOAD_FRAME();                                            \
+        }                                                            \
+    } while (false)
+
+#define RUNTIME_ERROR(...)              \
+    do                                  \
+    {                                   \
+        STORE_FRAME();                  \
+        runtimeError(__VA_ARGS__);      \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
+#define BINARY_OP(valueType, op)                                         \
+    do                                                                   \
+    {                                                                    \
+        Value a = RK(instruction->b);                                    \
+        Value b = RK(instruction->c);                                    \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))                              \
+        {                                                                \
+            RUNTIME_ERROR("Operands must be numbers.");                  \
+        }                                                                \
+        slots[instruction->a] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()    \
+    do                         \
+    {                          \
+        STORE_FRAME();         \
+        traceRegisters(frame); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() \
+    do                      \
+    {                       \
+    } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // One entry per RegOpCode, in enum order.
+    static void* dispatchTable[] = {
+        &&TARGET_ROP_MOVE,
+        &&TARGET_ROP_LOADK,
+        &&TARGET_ROP_GET_GLOBAL,
+        &&TARGET_ROP_DEFINE_GLOBAL,
+        &&TARGET_ROP_SET_GLOBAL,
+        &&TARGET_ROP_GET_UPVALUE,
+        &&TARGET_ROP_SET_UPVALUE,
+        &&TARGET_ROP_GET_PROPERTY,
+        &&TARGET_ROP_SET_PROPERTY,
+        &&TARGET_ROP_GET_SUPER,
+        &&TARGET_ROP_EQUAL,
+        &&TARGET_ROP_GREATER,
+        &&TARGET_ROP_LESS,
+        &&TARGET_ROP_ADD,
+        &&TARGET_ROP_SUBTRACT,
+        &&TARGET_ROP_MULTIPLY,
+        &&TARGET_ROP_DIVIDE,
+        &&TARGET_ROP_NOT,
+        &&TARGET_ROP_NEGATE,
+        &&TARGET_ROP_PRINT,
+        &&TARGET_ROP_JUMP,
+        &&TARGET_ROP_LOOP,
+        &&TARGET_ROP_JUMP_IF_FALSE,
+        &&TARGET_ROP_LESS_JUMP,
+        &&TARGET_ROP_CALL,
+        &&TARGET_ROP_TAIL_CALL,
+        &&TARGET_ROP_INVOKE,
+        &&TARGET_ROP_SUPER_INVOKE,
+        &&TARGET_ROP_TAIL_INVOKE,
+        &&TARGET_ROP_TAIL_SUPER_INVOKE,
+        &&TARGET_ROP_CLOSURE,
+        &&TARGET_ROP_CAPTURE,
+        &&TARGET_ROP_CLOSE_UPVALUE,
+        &&TARGET_ROP_RETURN,
+        &&TARGET_ROP_CLASS,
+        &&TARGET_ROP_INHERIT,
+        &&TARGET_ROP_METHOD,
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == ROP_METHOD + 1,
+                  "dispatchTable must have one entry per RegOpCode.");
+
+#define CASE(op) \
+    case op:     \
+    TARGET_##op
+#define DISPATCH()                                     \
+    do                                                 \
+    {                                                  \
+        TRACE_INSTRUCTION();                           \
+        goto* dispatchTable[(instruction = pc++)->op]; \
+    } while (false)
+#else
+#define CASE(op)   case op
+#define DISPATCH() continue
+#endif
+
+    RegInstruction* instruction;
+    for (;;)
+    {
+        TRACE_INSTRUCTION();
+
+        switch ((instruction = pc++)->op)
+        {
+            CASE(ROP_MOVE): slots[instruction->a] = slots[instruction->b]; DISPATCH();
+            CASE(ROP_LOADK): slots[instruction->a] = constants[instruction->b]; DISPATCH();
+
+            CASE(ROP_GET_GLOBAL):
             {
-                ObjString* name = READ_STRING();
-                Value      value;
-                if (!tableGet(&vm.globals, name, &value))
+                Value value = vm.globalValues[instruction->b];
+                if (IS_UNDEFINED(value))
                 {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Undefined variable '%s'.", globalName(instruction->b)->chars);
                 }
 
-                push(value);
-                break;
+                slots[instruction->a] = value;
+                DISPATCH();
             }
 
-            case OP_DEFINE_GLOBAL:
-            {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
-            }
+            CASE(ROP_DEFINE_GLOBAL): vm.globalValues[instruction->a] = RK(instruction->b); DISPATCH();
 
-            case OP_SET_GLOBAL:
+            CASE(ROP_SET_GLOBAL):
             {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0)))
+                if (IS_UNDEFINED(vm.globalValues[instruction->a]))
                 {
-                    tableDelete(&vm.globals, name);  // [delete]
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Undefined variable '%s'.", globalName(instruction->a)->chars);
                 }
 
-                break;
+                vm.globalValues[instruction->a] = RK(instruction->b);
+                DISPATCH();
             }
 
-            case OP_GET_UPVALUE:
-            {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
+            CASE(ROP_GET_UPVALUE):
+                slots[instruction->a] = *frame->closure->upvalues[instruction->b]->location;
+                DISPATCH();
 
-            case OP_SET_UPVALUE:
+            CASE(ROP_SET_UPVALUE):
             {
-                uint8_t slot                              = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+                ObjUpvalue* upvalue = frame->closure->upvalues[instruction->a];
+                storeUpvalue(upvalue, RK(instruction->b));
+                writeBarrier((Obj*)upvalue);
+                DISPATCH();
             }
 
-            case OP_GET_PROPERTY:
+            CASE(ROP_GET_PROPERTY):
             {
-                if (!IS_INSTANCE(peek(0)))
+                Value object = RK(instruction->b);
+                if (!IS_INSTANCE(object))
                 {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Only instances have properties.");
                 }
 
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString*   name     = READ_STRING();
+                ObjInstance* instance = AS_INSTANCE(object);
+                ObjString*   name     = READ_STRING(instruction->c);
 
                 Value value;
-                if (tableGet(&instance->fields, name, &value))
+                if (name->isFieldName && tableGet(&instance->fields, name, &value))
                 {
-                    pop();  // Instance.
-                    push(value);
-                    break;
+                    slots[instruction->a] = value;
+                    DISPATCH();
                 }
 
-                if (!bindMethod(instance->klass, name))
+                STORE_FRAME();
+                if (!bindMethodTo(instance->klass, name, object, &slots[instruction->a]))
                 {
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                break;
+                DISPATCH();
             }
 
-            case OP_SET_PROPERTY:
+            CASE(ROP_SET_PROPERTY):
             {
-                if (!IS_INSTANCE(peek(1)))
+                Value object = RK(instruction->a);
+                if (!IS_INSTANCE(object))
                 {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Only instances have fields.");
                 }
 
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+                ObjString* name = READ_STRING(instruction->b);
+                STORE_FRAME();
+                setField(AS_INSTANCE(object), name, RK(instruction->c));
+                DISPATCH();
             }
 
-            case OP_GET_SUPER:
+            CASE(ROP_GET_SUPER):
             {
-                ObjString* name       = READ_STRING();
-                ObjClass*  superclass = AS_CLASS(pop());
-                if (!bindMethod(superclass, name))
+                ObjClass* superclass = AS_CLASS(RK(instruction->b));
+                STORE_FRAME();
+                if (!bindMethodTo(superclass,
+                                  READ_STRING(instruction->c),
+                                  slots[instruction->a],
+                                  &slots[instruction->a]))
                 {
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                break;
+                DISPATCH();
             }
 
-            case OP_EQUAL:
-            {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
+            CASE(ROP_EQUAL):
+                slots[instruction->a] = BOOL_VAL(valuesEqual(RK(instruction->b), RK(instruction->c)));
+                DISPATCH();
 
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD:
+            CASE(ROP_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+            CASE(ROP_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+            CASE(ROP_ADD):
             {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+                Value a = RK(instruction->b);
+                Value b = RK(instruction->c);
+                if (IS_STRING(a) && IS_STRING(b))
                 {
-                    concatenate();
+                    STORE_FRAME();
+                    ObjString* result     = concatenateStrings(AS_STRING(a), AS_STRING(b));
+                    slots[instruction->a] = OBJ_VAL(result);
                 }
 
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+                else if (IS_NUMBER(a) && IS_NUMBER(b))
                 {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+                    slots[instruction->a] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
                 }
 
                 else
                 {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
                 }
 
-                break;
+                DISPATCH();
             }
 
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0)))
+            CASE(ROP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+            CASE(ROP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+            CASE(ROP_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+            CASE(ROP_NOT): slots[instruction->a] = BOOL_VAL(isFalsey(RK(instruction->b))); DISPATCH();
+            CASE(ROP_NEGATE):
+            {
+                Value value = RK(instruction->b);
+                if (!IS_NUMBER(value))
                 {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operand must be a number.");
                 }
 
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
+                slots[instruction->a] = NUMBER_VAL(-AS_NUMBER(value));
+                DISPATCH();
+            }
 
-            case OP_PRINT:
+            CASE(ROP_PRINT):
             {
-                printValue(pop());
+                printValue(RK(instruction->a));
                 printf("\n");
-                break;
+                DISPATCH();
             }
 
-            case OP_JUMP:
+            CASE(ROP_JUMP): pc += (int16_t)instruction->a; DISPATCH();
+
+            CASE(ROP_LOOP):
+                pc += (int16_t)instruction->a;
+                if (preempt()) return INTERPRET_INTERRUPTED;
+                DISPATCH();
+
+            CASE(ROP_JUMP_IF_FALSE):
+                if (isFalsey(RK(instruction->b))) pc += (int16_t)instruction->a;
+                DISPATCH();
+
+            CASE(ROP_LESS_JUMP):
             {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+                Value a = RK(instruction->b);
+                Value b = RK(instruction->c);
+                if (!IS_NUMBER(a) || !IS_NUMBER(b))
+                {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+
+                if (!(AS_NUMBER(a) < AS_NUMBER(b))) pc += (int16_t)instruction->a;
+                DISPATCH();
             }
 
-            case OP_JUMP_IF_FALSE:
+            CASE(ROP_TAIL_CALL):
+                if (IS_CLOSURE(slots[instruction->a]))
+                {
+                    Value* callee   = slots + instruction->a;
+                    int    argCount = instruction->b;
+                    STORE_FRAME();
+                    vm.stackTop = callee + argCount + 1;
+                    if (!tailCall(AS_CLOSURE(*callee), argCount))
+                    {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+
+                    LOAD_FRAME();
+                    DISPATCH();
+                }
+                [[fallthrough]];
+
+            CASE(ROP_CALL):
             {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
+                Value* callee   = slots + instruction->a;
+                int    argCount = instruction->b;
+                if (IS_NATIVE(*callee))
+                {
+                    ObjNative* native = AS_NATIVE(*callee);
+                    if (native->pure && native->arity == argCount)
+                    {
+                        native->function(vm, argCount, callee + 1);
+                        DISPATCH();
+                    }
+                }
+
+                STORE_FRAME();
+                vm.stackTop = callee + argCount + 1;
+                if (!callValue(*callee, argCount))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                FINISH_CALL();
+                DISPATCH();
             }
 
-            case OP_LOOP:
+            CASE(ROP_TAIL_INVOKE):
             {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+                ObjClosure* method = tailMethod(slots[instruction->a], READ_STRING(instruction->b), nullptr);
+                if (method != nullptr)
+                {
+                    int argCount = instruction->c;
+                    STORE_FRAME();
+                    vm.stackTop = slots + instruction->a + argCount + 1;
+                    if (!tailCall(method, argCount))
+                    {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+
+                    LOAD_FRAME();
+                    DISPATCH();
+                }
             }
+                [[fallthrough]];
 
-            case OP_CALL:
+            CASE(ROP_INVOKE):
             {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount))
+                Value* receiver = slots + instruction->a;
+                int    argCount = instruction->c;
+                STORE_FRAME();
+                vm.stackTop = receiver + argCount + 1;
+                if (!invoke(READ_STRING(instruction->b), argCount))
                 {
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                FINISH_CALL();
+                DISPATCH();
             }
 
-            case OP_INVOKE:
+            CASE(ROP_TAIL_SUPER_INVOKE):
             {
-                ObjString* method   = READ_STRING();
-                int        argCount = READ_BYTE();
-                if (!invoke(method, argCount))
+                int         argCount = instruction->c;
+                ObjClass*   klass    = AS_CLASS(slots[instruction->a + argCount + 1]);
+                ObjClosure* method   = findMethod(klass, READ_STRING(instruction->b));
+                if (method != nullptr)
                 {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+                    STORE_FRAME();
+                    vm.stackTop = slots + instruction->a + argCount + 1;
+                    if (!tailCall(method, argCount))
+                    {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
 
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                    LOAD_FRAME();
+                    DISPATCH();
+                }
             }
+                [[fallthrough]];
 
-            case OP_SUPER_INVOKE:
+            CASE(ROP_SUPER_INVOKE):
             {
-                ObjString* method     = READ_STRING();
-                int        argCount   = READ_BYTE();
-                ObjClass*  superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount))
+                Value*    receiver   = slots + instruction->a;
+                int       argCount   = instruction->c;
+                ObjClass* superclass = AS_CLASS(receiver[argCount + 1]);
+                STORE_FRAME();
+                vm.stackTop = receiver + argCount + 1;
+                if (!invokeFromClass(superclass, READ_STRING(instruction->b), argCount))
                 {
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                FINISH_CALL();
+                DISPATCH();
             }
 
-            case OP_CLOSURE:
+            CASE(ROP_CLOSURE):
             {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure*  closure  = newClosure(function);
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++)
+                ObjFunction* function = AS_FUNCTION(constants[instruction->b]);
+                STORE_FRAME();
+                ObjClosure* closure   = newClosure(function);
+                slots[instruction->a] = OBJ_VAL(closure);
+                for (int i = 0; i < closure->upvalueCount; i++, pc++)
                 {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index   = READ_BYTE();
-                    if (isLocal)
-                    {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    }
-
-                    else
-                    {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
+                    capture(closure, i, pc->a, pc->b, frame);
                 }
 
-                break;
+                DISPATCH();
             }
 
-            case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+            // Only ever read by ROP_CLOSURE.
+            CASE(ROP_CAPTURE): DISPATCH();
 
-            case OP_RETURN:
+            CASE(ROP_CLOSE_UPVALUE): closeUpvalues(slots + instruction->a); DISPATCH();
+
+            CASE(ROP_RETURN):
             {
-                Value result = pop();
+                Value  result    = RK(instruction->a);
+                Value* calleeTop = vm.stackTop;
 
-                closeUpvalues(frame->slots);
+                if (frame->closure->function->capturesLocals) closeUpvalues(slots);
 
                 vm.frameCount--;
                 if (vm.frameCount == 0)
                 {
-                    pop();
+                    vm.stackTop = slots;
                     return INTERPRET_OK;
                 }
 
-                vm.stackTop = frame->slots;
-                push(result);
+                slots[0] = result;
+                LOAD_FRAME();
 
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                // The callee's registers were live up to its return, but
+                // whatever frames above them left behind hasn't been traced
+                // since. Clear it before the GC sees it again.
+                Value* frameTop = slots + chunk->slotCount();
+                for (Value* slot = calleeTop; slot < frameTop; slot++)
+                {
+                    *slot = NIL_VAL;
+                }
+
+                vm.stackTop = frameTop;
+                DISPATCH();
             }
 
-            case OP_CLASS: push(OBJ_VAL(newClass(READ_STRING()))); break;
+            CASE(ROP_CLASS):
+                STORE_FRAME();
+                slots[instruction->a] = OBJ_VAL(newClass(READ_STRING(instruction->b)));
+                DISPATCH();
 
-            case OP_INHERIT:
+            CASE(ROP_INHERIT):
             {
-                Value superclass = peek(1);
+                Value superclass = RK(instruction->a);
                 if (!IS_CLASS(superclass))
                 {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Superclass must be a class.");
                 }
 
-                ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop();  // Subclass.
-                break;
+                STORE_FRAME();
+                inherit(AS_CLASS(superclass), AS_CLASS(RK(instruction->b)));
+                DISPATCH();
             }
 
-            case OP_METHOD: defineMethod(READ_STRING()); break;
+            CASE(ROP_METHOD):
+                STORE_FRAME();
+                setMethod(AS_CLASS(RK(instruction->a)), READ_STRING(instruction->c), RK(instruction->b));
+                DISPATCH();
         }
     }
 
-#undef READ_BYTE
-#undef READ_SHORT
-#undef READ_CONSTANT
+#undef RK
 #undef READ_STRING
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef FINISH_CALL
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef TRACE_INSTRUCTION
+#undef CASE
+#undef DISPATCH
 }
 
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef JIT
+// Finds how far down the native stack of the thread running the script
+// compiled code may be entered.
+static void findNativeStackLimit()
+{
+    pthread_attr_t attributes;
+    void*          bottom;
+    size_t         size;
+
+    vm.nativeStackLimit = 0;
+    if (pthread_getattr_np(pthread_self(), &attributes) != 0) return;
+    if (pthread_attr_getstack(&attributes, &bottom, &size) == 0)
+    {
+        vm.nativeStackLimit = (uintptr_t)bottom + std::min((size_t)JIT_STACK_RESERVE, size / 2);
+    }
+    pthread_attr_destroy(&attributes);
+}
+#endif
+
 InterpretResult interpret(std::string_view source)
 {
+#ifdef JIT
+    findNativeStackLimit();
+#endif
+
     ObjFunction* function = compile(source);
     if (function == nullptr) return INTERPRET_COMPILE_ERROR;
 
@@ -678,7 +2775,19 @@ InterpretResult interpret(std::string_view source)
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
-    callValue(OBJ_VAL(closure), 0);
+    InterpretResult result = INTERPRET_RUNTIME_ERROR;
+    if (callValue(OBJ_VAL(closure), 0))
+    {
+        result = vm.engine == ENGINE_REGISTER ? runRegisters() : run(0);
+    }
+
+    // A stop inside a call or compiled code looks like an error to the
+    // code it unwinds through.
+    if (vm.preempted)
+    {
+        vm.preempted = false;
+        result       = INTERPRET_INTERRUPTED;
+    }
 
-    return run();
+    return result;
 }
@@ -1,48 +1,162 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <atomic>
+#include <cstdint>
 #include <string_view>
 
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
+// Default limits on the stacks, which grow as calls nest.
+#define FRAMES_MAX 16384
 #define STACK_MAX  (FRAMES_MAX * UINT8_COUNT)
 
 struct CallFrame
 {
-    ObjClosure* closure;
-    uint8_t*    ip;
-    Value*      slots;
+    ObjClosure*     closure;
+    uint8_t*        ip;
+    RegInstruction* pc;  // Used instead of ip by the register engine.
+    Value*          slots;
+};
+
+// An entry of vm.dispatch: a method of the class, or a free entry if the
+// class is nullptr.
+struct DispatchEntry
+{
+    ObjClass*   klass;
+    ObjClosure* method;
+};
+
+// How long collections of one kind stopped the program.
+struct GcPauses
+{
+    size_t   count;
+    uint64_t totalNs;
+    uint64_t maxNs;
+};
+
+// Every pause, whatever its kind, is also counted in one of these buckets
+// of vm.pauseHistogram: eight per power of two nanoseconds.
+#define GC_PAUSE_BUCKETS (64 * 8)
+
+// Cells of freed objects are kept for reuse on a free list per size
+// class, the classes GC_CELL_BYTES apart. See allocateCell().
+#define GC_CELL_BYTES   16
+#define GC_CELL_CLASSES 32
+
+enum GcPhase : uint8_t
+{
+    GC_IDLE,
+    GC_MARKING,    // A major collection is marking, a slice at a time.
+    GC_CONCURRENT  // A major collection is marking on a helper thread.
+};
+
+enum Engine
+{
+    ENGINE_STACK,
+    ENGINE_REGISTER
 };
 
 struct VM
 {
-    CallFrame frames[FRAMES_MAX];
-    int       frameCount;
+    CallFrame* frames;
+    int        frameCount;
+    int        frameCapacity;
+    int        frameLimit;  // Calls deeper than this overflow the stack.
+
+    // Anything that points into the stack is rebased when it moves, so
+    // hold on to indexes rather than pointers across calls.
+    Value*       stack;
+    Value*       stackTop;
+    int          stackCapacity;
+    int          stackLimit;
+    ObjUpvalue** openUpvalues;    // Parallel to the stack: the open upvalue of each slot, if any.
+    int          openUpvalueTop;  // No slot at or above this one has an open upvalue.
+    Table        globalSlots;     // Maps each global's name to its slot.
+    Table        strings;
+    ObjString*   initString;
+
+    Value*      globalValues;  // UNDEFINED_VAL until the global is defined.
+    ObjString** globalNames;   // Parallel to globalValues, for error messages.
+    int         globalCount;
+    int         globalCapacity;
+
+    ObjString** selectors;  // Method names, by selector.
+    int         selectorCount;
+    int         selectorCapacity;
 
-    Value       stack[STACK_MAX];
-    Value*      stackTop;
-    Table       globals;
-    Table       strings;
-    ObjString*  initString;
-    ObjUpvalue* openUpvalues;
+    // The methods of every class, the rows of different classes
+    // interleaved. See findMethod().
+    DispatchEntry* dispatch;
+    int            dispatchCapacity;
+    int            dispatchFree;  // Every entry below this one is taken.
+
+    Engine engine;  // Which interpreter loop runs the code.
+
+    // Loop back-edges and calls left before the script is stopped, and a
+    // flag another thread sets to stop it sooner. Both are only checked on
+    // those paths, so straight-line code never looks at them.
+    int64_t           budget;
+    std::atomic<bool> interrupt;
+    bool              preempted;  // Whether the last stop was one of the above.
+
+#ifdef JIT
+    uint16_t  hotLoops[HOT_LOOP_SLOTS];  // Iteration counts, hashed by loop header.
+    uintptr_t nativeStackLimit;          // Compiled code isn't entered with the native stack below this.
+#endif
+
+    size_t cacheHits;  // Inline cache lookups, for tuning.
+    size_t cacheMisses;
 
     size_t bytesAllocated;
-    size_t nextGC;
+    size_t objectsAllocated;  // Ever, not live; for tests and tuning.
+    size_t nextGC;        // A major collection starts once bytesAllocated passes this,
+    size_t nurseryLimit;  // and a minor one runs once it passes this.
+    size_t nextSlice;     // While marking, the next slice runs once it passes this.
+
+    GcPhase  gcPhase;
+    int      sliceBudget;       // Gray objects a marking slice may blacken; 0 marks all at once.
+    uint64_t pauseTarget;       // Nanoseconds a marking slice may take, or 0 for no limit.
+    bool     markConcurrently;  // Whether major collections mark on a helper thread.
+    int      markThreads;       // Threads that trace the heap, the collecting one included.
 
-    Obj*  objects;
+    Obj*  objects;       // The old generation: objects that survived a collection.
+    Obj*  youngObjects;  // Everything allocated since the last collection.
+    Obj*  unswept;       // Objects the last major collection has yet to sweep. See startSweeping().
+    void* freeCells[GC_CELL_CLASSES];  // Each cell links to the next through its first word.
     int   grayCount;
     int   grayCapacity;
     Obj** grayStack;
+
+    // Old objects stored into since the last collection, which may point
+    // to young ones, and any objects stored into while marking. See
+    // writeBarrier().
+    Obj** remembered;
+    int   rememberedCount;
+    int   rememberedCapacity;
+    bool  collectingYoung;  // Whether the collection running is a minor one.
+
+    // Blocks freed while the helper thread marks, which it may still be
+    // reading. They are freed when marking finishes.
+    void** retired;
+    int    retiredCount;
+    int    retiredCapacity;
+
+    GcPauses minorPauses;
+    GcPauses slicePauses;  // Those of a major collection but the last.
+    GcPauses majorPauses;  // The last pause of each major collection.
+    GcPauses sweepPauses;  // Chunks of the sweep after one.
+    size_t   pauseHistogram[GC_PAUSE_BUCKETS];
 };
 
 enum InterpretResult
 {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    INTERPRET_INTERRUPTED
 };
 
 extern VM vm;
@@ -50,6 +164,12 @@ extern VM vm;
 void            initVM();
 void            freeVM();
 InterpretResult interpret(std::string_view source);
+int             globalSlot(ObjString* name);
+ObjString*      globalName(int slot);
+int             methodSelector(ObjString* name);
+void            removeMethods(ObjClass* klass);
+bool            nativeError(const char* format, ...);
+void            interruptVM();
 void            push(Value value);
 Value           pop();
 
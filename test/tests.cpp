@@ -1,8 +1,18 @@
 #include <catch2/catch.hpp>
+#include <chrono>
+#include <filesystem>
 #include <fstream>
 #include <string>
+#include <thread>
+#include <utility>
 #include <cstdio>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 #include "vm.h"
 
 static std::string read_file(const char* path)
@@ -25,6 +35,28 @@ static std::string read_file(const char* path)
     return buffer;
 }
 
+// Interprets `source` with stdout sent to a temporary file, and returns
+// what the script printed along with the result.
+static std::pair<InterpretResult, std::string> interpret_captured(const std::string& source)
+{
+    fflush(stdout);
+    FILE* file  = std::tmpfile();
+    int   saved = dup(fileno(stdout));
+    dup2(fileno(file), fileno(stdout));
+
+    auto result = interpret(source);
+
+    fflush(stdout);
+    dup2(saved, fileno(stdout));
+    close(saved);
+
+    std::string output;
+    rewind(file);
+    for (int c; (c = fgetc(file)) != EOF;) output += (char)c;
+    fclose(file);
+    return {result, output};
+}
+
 TEST_CASE("bool__equality", "[bool]")
 {
     initVM();
@@ -129,6 +161,14 @@ TEST_CASE("constructor__default", "[constructor]")
     REQUIRE(result == INTERPRET_OK);
 }
 
+TEST_CASE("constructor__cached_initializer", "[constructor]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\constructor\cached_initializer.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
 TEST_CASE("call__object", "[call]")
 {
     initVM();
@@ -169,6 +209,14 @@ TEST_CASE("call__num", "[call]")
     REQUIRE(result == INTERPRET_RUNTIME_ERROR);
 }
 
+TEST_CASE("call__native_arity", "[call]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\call\native_arity.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_RUNTIME_ERROR);
+}
+
 TEST_CASE("string__error_after_multiline", "[string]")
 {
     initVM();
@@ -521,6 +569,14 @@ TEST_CASE("while__return_closure", "[while]")
     REQUIRE(result == INTERPRET_OK);
 }
 
+TEST_CASE("while__hot_loop_guards", "[while]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\while\hot_loop_guards.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
 TEST_CASE("return__after_while", "[return]")
 {
     initVM();
@@ -1641,20 +1697,20 @@ TEST_CASE("logical_operator__and", "[logical_operator]")
     REQUIRE(result == INTERPRET_OK);
 }
 
-TEST_CASE("limit__too_many_upvalues", "[limit]")
+TEST_CASE("limit__many_upvalues", "[limit]")
 {
     initVM();
-    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\too_many_upvalues.lox)");
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\many_upvalues.lox)");
     auto result = interpret(source);
-    REQUIRE(result == INTERPRET_COMPILE_ERROR);
+    REQUIRE(result == INTERPRET_OK);
 }
 
-TEST_CASE("limit__too_many_locals", "[limit]")
+TEST_CASE("limit__many_locals", "[limit]")
 {
     initVM();
-    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\too_many_locals.lox)");
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\many_locals.lox)");
     auto result = interpret(source);
-    REQUIRE(result == INTERPRET_COMPILE_ERROR);
+    REQUIRE(result == INTERPRET_OK);
 }
 
 TEST_CASE("limit__no_reuse_constants", "[limit]")
@@ -1662,7 +1718,7 @@ TEST_CASE("limit__no_reuse_constants", "[limit]")
     initVM();
     auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\no_reuse_constants.lox)");
     auto result = interpret(source);
-    REQUIRE(result == INTERPRET_COMPILE_ERROR);
+    REQUIRE(result == INTERPRET_OK);
 }
 
 TEST_CASE("limit__stack_overflow", "[limit]")
@@ -1673,14 +1729,96 @@ TEST_CASE("limit__stack_overflow", "[limit]")
     REQUIRE(result == INTERPRET_RUNTIME_ERROR);
 }
 
-TEST_CASE("limit__too_many_constants", "[limit]")
+TEST_CASE("limit__deep_expression", "[limit]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\deep_expression.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
+TEST_CASE("limit__method_overflow", "[limit]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\method_overflow.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_CASE("limit__deep_recursion", "[limit]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\deep_recursion.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
+TEST_CASE("limit__many_constants", "[limit]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\many_constants.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
+TEST_CASE("limit__many_constants_and_names", "[limit]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\many_constants_and_names.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
+TEST_CASE("limit__too_many_names", "[limit]")
 {
     initVM();
-    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\too_many_constants.lox)");
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\too_many_names.lox)");
     auto result = interpret(source);
     REQUIRE(result == INTERPRET_COMPILE_ERROR);
 }
 
+TEST_CASE("limit__loop_budget", "[limit]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\loop_budget.lox)");
+    REQUIRE(interpret(source) == INTERPRET_OK);
+
+    vm.budget = 1000;
+    REQUIRE(interpret(source) == INTERPRET_INTERRUPTED);
+}
+
+TEST_CASE("limit__call_budget", "[limit]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\call_budget.lox)");
+    REQUIRE(interpret(source) == INTERPRET_OK);
+
+    vm.budget = 1000;
+    REQUIRE(interpret(source) == INTERPRET_INTERRUPTED);
+}
+
+TEST_CASE("limit__interrupt", "[limit]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\interrupt.lox)");
+    interruptVM();
+    REQUIRE(interpret(source) == INTERPRET_INTERRUPTED);
+    REQUIRE(interpret(source) == INTERPRET_OK);
+}
+
+TEST_CASE("limit__interrupt_running", "[limit]")
+{
+    initVM();
+    auto        source = read_file(R"(S:\C++\cpplox\test\loxsrc\limit\interrupt_running.lox)");
+    std::thread host([] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        interruptVM();
+    });
+    auto result = interpret(source);
+    host.join();
+    REQUIRE(result == INTERPRET_INTERRUPTED);
+}
+
 TEST_CASE("class__empty", "[class]")
 {
     initVM();
@@ -1761,6 +1899,24 @@ TEST_CASE("closure__close_over_later_variable", "[closure]")
     REQUIRE(result == INTERPRET_OK);
 }
 
+TEST_CASE("closure__capture_kinds", "[closure]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\closure\capture_kinds.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
+TEST_CASE("closure__shared_closure", "[closure]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\closure\shared_closure.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+    // The loops declare functions 10002 times.
+    REQUIRE(vm.objectsAllocated < 100);
+}
+
 TEST_CASE("closure__nested_closure", "[closure]")
 {
     initVM();
@@ -1993,6 +2149,30 @@ TEST_CASE("function__print", "[function]")
     REQUIRE(result == INTERPRET_OK);
 }
 
+TEST_CASE("function__tail_calls", "[function]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\function\tail_calls.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
+TEST_CASE("function__compiled_calls", "[function]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\function\compiled_calls.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_CASE("method__tail_calls", "[method]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\method\tail_calls.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
 TEST_CASE("function__too_many_arguments", "[function]")
 {
     initVM();
@@ -2040,3 +2220,173 @@ TEST_CASE("unexpected_character", "[unexpected_character]")
     auto result = interpret(source);
     REQUIRE(result == INTERPRET_COMPILE_ERROR);
 }
+
+TEST_CASE("register__assign_to_closure", "[register]")
+{
+    initVM();
+    vm.engine   = ENGINE_REGISTER;
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\closure\assign_to_closure.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
+TEST_CASE("register__for_syntax", "[register]")
+{
+    initVM();
+    vm.engine   = ENGINE_REGISTER;
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\for\syntax.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
+TEST_CASE("register__super_indirectly_inherited", "[register]")
+{
+    initVM();
+    vm.engine   = ENGINE_REGISTER;
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\super\indirectly_inherited.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
+TEST_CASE("register__super_extra_arguments", "[register]")
+{
+    initVM();
+    vm.engine   = ENGINE_REGISTER;
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\super\extra_arguments.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_CASE("operator__add_mixed_operands", "[operator]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\operator\add_mixed_operands.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
+TEST_CASE("field__inline_cache", "[field]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\field\inline_cache.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+    REQUIRE(vm.cacheHits > 0);
+    REQUIRE(vm.cacheMisses > 0);
+}
+
+TEST_CASE("field__scalar_replacement", "[field]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\field\scalar_replacement.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+    // The loop makes 1000 points without allocating them.
+    REQUIRE(vm.objectsAllocated < 500);
+}
+
+TEST_CASE("field__scalar_nested_functions", "[field]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\field\scalar_nested_functions.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
+TEST_CASE("field__scalar_undefined", "[field]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\field\scalar_undefined.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_CASE("method__inline_cache", "[method]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\method\inline_cache.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+}
+
+TEST_CASE("method__shared_names", "[method]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\method\shared_names.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_CASE("method__far_apart_names", "[method]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\method\far_apart_names.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_CASE("gc__generations", "[gc]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\gc\generations.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+    REQUIRE(vm.minorPauses.count > 0);
+}
+
+TEST_CASE("gc__incremental", "[gc]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\gc\incremental.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+    REQUIRE(vm.slicePauses.count > 0);
+}
+
+TEST_CASE("gc__parallel", "[gc]")
+{
+    initVM();
+    vm.sliceBudget = 0;
+    vm.markThreads = 4;
+    auto source    = read_file(R"(S:\C++\cpplox\test\loxsrc\gc\parallel.lox)");
+    auto result    = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+    REQUIRE(vm.majorPauses.count > 0);
+}
+
+TEST_CASE("gc__sweep", "[gc]")
+{
+    initVM();
+    auto source = read_file(R"(S:\C++\cpplox\test\loxsrc\gc\sweep.lox)");
+    auto result = interpret(source);
+    REQUIRE(result == INTERPRET_OK);
+    REQUIRE(vm.sweepPauses.count > 0);
+}
+
+// Runs every script again with major collections marked on the helper
+// thread, from the first allocation on, and expects the same results and
+// the same output.
+TEST_CASE("gc__concurrent_corpus", "[gc]")
+{
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(R"(S:\C++\cpplox\test\loxsrc)"))
+    {
+        const auto& path = entry.path();
+        if (path.extension() != ".lox" || path.parent_path().filename() == "benchmark") continue;
+        if (path.filename() == "interrupt_running.lox") continue;  // Only ends when interrupted.
+
+        auto source = read_file(path.string().c_str());
+        initVM();
+        auto expected = interpret_captured(source);
+        freeVM();
+
+        initVM();
+        vm.markConcurrently = true;
+        vm.nextGC           = 0;
+        auto actual         = interpret_captured(source);
+        freeVM();
+
+        INFO(path.string());
+        REQUIRE(actual.first == expected.first);
+        REQUIRE(actual.second == expected.second);
+    }
+}